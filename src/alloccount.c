@@ -0,0 +1,81 @@
+/** \file alloccount.c
+* \brief allocation counter, only linked into the build made with 'make allocs'.
+*
+* malloc(), calloc() and realloc() are replaced by wrappers that count the calls and forward
+* them to the glibc allocator through its __libc_* entry points. Every library inside the
+* process, readline and libc included, goes through the wrappers.
+*
+* The shell prints the number of allocations made by each command line to stderr, see
+* ALLOC_COUNT_START() and ALLOC_COUNT_REPORT(). A line that ran before, e.g. any repeated
+* command, should report 0. In interactive mode the line itself and the history entry are
+* allocated by readline before the count starts and are not included.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "utils.h"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void __libc_free(void *p);
+
+/** number of allocations since the process started. */
+unsigned long alloc_count = 0;
+/** value of \a alloc_count when the current line started. */
+static unsigned long line_start = 0;
+/** number of lines reported so far. */
+static unsigned long line_number = 0;
+
+/**
+ * @brief counting malloc().
+ * @param size number of bytes.
+ * @returns the memory.
+ */
+void *malloc(size_t size) {
+    alloc_count++;
+    return __libc_malloc(size);
+}
+
+/**
+ * @brief counting calloc().
+ * @param n number of elements.
+ * @param size size of each element.
+ * @returns the zeroed memory.
+ */
+void *calloc(size_t n, size_t size) {
+    alloc_count++;
+    return __libc_calloc(n, size);
+}
+
+/**
+ * @brief counting realloc(). Counted even when the block is resized in place.
+ * @param p the memory to resize.
+ * @param size the new size.
+ * @returns the resized memory.
+ */
+void *realloc(void *p, size_t size) {
+    alloc_count++;
+    return __libc_realloc(p, size);
+}
+
+/**
+ * @brief free(), replaced together with the allocators so both sides use the same heap.
+ * @param p the memory to free.
+ */
+void free(void *p) { __libc_free(p); }
+
+/**
+ * @brief start counting the allocations of a command line.
+ */
+void alloc_count_start() { line_start = alloc_count; }
+
+/**
+ * @brief print the number of allocations made since alloc_count_start().
+ */
+void alloc_count_report() {
+    unsigned long n = alloc_count - line_start;
+    /* fprintf() to an unbuffered stderr does not allocate */
+    fprintf(stderr, "allocs: line=%lu count=%lu\n", ++line_number, n);
+}
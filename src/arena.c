@@ -0,0 +1,172 @@
+/** \file arena.c
+* \brief bump allocator for short-lived memory.
+*
+* An arena hands out memory by moving a pointer forward inside large chunks. Nothing is freed
+* on its own, the whole arena is reset at once. After a reset that found more than one chunk,
+* they are merged into a single chunk big enough for all of them, so an arena that is reset
+* for every line stops calling malloc() once it saw the largest line.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+arena line_arena;
+
+/**
+ * @brief round a size up to the alignment of the arena.
+ * @param n the size.
+ * @returns the aligned size.
+ */
+static size_t align_up(size_t n) { return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1); }
+
+/**
+ * @brief add a chunk to an arena.
+ * @param a the arena.
+ * @param min the minimum usable size of the chunk.
+ */
+static void add_chunk(arena *a, size_t min) {
+    arena_chunk *c;
+    size_t size = a->head ? a->head->size * 2 : ARENA_CHUNK_SIZE;
+    while (size < min) {
+        size *= 2;
+    }
+    c = malloc(sizeof(arena_chunk) + size);
+    c->next = a->head;
+    c->size = size;
+    a->head = c;
+    a->ptr = c->data;
+    a->end = c->data + size;
+}
+
+/**
+ * @brief initialize an empty arena. No memory is allocated until the first arena_alloc().
+ * @param a the arena.
+ */
+void arena_init(arena *a) {
+    a->head = NULL;
+    a->ptr = a->end = a->last = NULL;
+}
+
+/**
+ * @brief allocate memory from an arena.
+ * @param a the arena.
+ * @param n number of bytes.
+ * @returns memory aligned to ARENA_ALIGN, valid until the next arena_reset().
+ */
+void *arena_alloc(arena *a, size_t n) {
+    n = align_up(n ? n : 1);
+    if (a->head == NULL || (size_t)(a->end - a->ptr) < n) {
+        add_chunk(a, n);
+    }
+    a->last = a->ptr;
+    a->ptr += n;
+    return a->last;
+}
+
+/**
+ * @brief grow an allocation, like realloc().
+ * @param a the arena.
+ * @param p memory returned by arena_alloc() or arena_grow(), or NULL.
+ * @param old the current size of \a p.
+ * @param n the new size.
+ * @returns the grown memory, holding the old contents.
+ *
+ * The latest allocation is extended in place when its chunk has room, so a vector that grows
+ * while nothing else is allocated is never copied.
+ */
+void *arena_grow(arena *a, void *p, size_t old, size_t n) {
+    void *q;
+    if (p && p == a->last && (size_t)(a->end - a->last) >= align_up(n)) {
+        a->ptr = a->last + align_up(n);
+        return p;
+    }
+    q = arena_alloc(a, n);
+    if (p) {
+        memcpy(q, p, old);
+    }
+    return q;
+}
+
+/**
+ * @brief copy a string into an arena.
+ * @param a the arena.
+ * @param s the string.
+ * @returns the copy.
+ */
+char *arena_strdup(arena *a, const char *s) {
+    size_t n = strlen(s) + 1;
+    return memcpy(arena_alloc(a, n), s, n);
+}
+
+/**
+ * @brief remember the current end of an arena.
+ * @param a the arena.
+ * @returns a mark for arena_rewind().
+ */
+arena_mark arena_save(arena *a) {
+    arena_mark m;
+    m.head = a->head;
+    m.ptr = a->ptr;
+    return m;
+}
+
+/**
+ * @brief free what was allocated from an arena after a mark.
+ * @param a the arena.
+ * @param m a mark of \a a from arena_save(). Marks taken after it become invalid.
+ *
+ * Chunks added after the mark are given back to malloc(). A loop that runs a command per
+ * iteration rewinds before each one, so it uses the memory of a single iteration.
+ */
+void arena_rewind(arena *a, arena_mark m) {
+    arena_chunk *c;
+
+    while (a->head != m.head) {
+        c = a->head;
+        a->head = c->next;
+        free(c);
+    }
+    a->ptr = m.ptr;
+    a->end = a->head ? a->head->data + a->head->size : NULL;
+    a->last = NULL;
+}
+
+/**
+ * @brief free everything allocated from an arena, keeping the memory for reuse.
+ * @param a the arena.
+ */
+void arena_reset(arena *a) {
+    arena_chunk *c;
+    size_t total = 0;
+
+    if (a->head == NULL) {
+        return;
+    }
+    if (a->head->next) {
+        /* more than one chunk: replace them with one that fits everything */
+        while ((c = a->head) != NULL) {
+            total += c->size;
+            a->head = c->next;
+            free(c);
+        }
+        add_chunk(a, total);
+    }
+    a->ptr = a->head->data;
+    a->end = a->head->data + a->head->size;
+    a->last = NULL;
+}
+
+/**
+ * @brief give all memory of an arena back to malloc().
+ * @param a the arena.
+ */
+void arena_free(arena *a) {
+    arena_chunk *c;
+    while ((c = a->head) != NULL) {
+        a->head = c->next;
+        free(c);
+    }
+    arena_init(a);
+}
@@ -0,0 +1,277 @@
+/** \file bench.c
+* \brief micro benchmarks of the hot paths of the shell.
+*
+* Built and run with 'make bench'. The shell sources are linked without main.c, so every path
+* is measured in isolation, without processes or a terminal. The build counts allocations with
+* alloccount.c.
+*
+* Every case prints one line of key=value pairs, always with ns_per_op and allocs_per_op, e.g.
+*     case=parse args=10 iters=587882 ns_per_op=340.2 allocs_per_op=0.000 mb_per_s=194.0
+* so the output can be diffed or fed to a script.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utils.h"
+
+/** minimum time spent on each case, in nanoseconds. */
+#define BENCH_MIN_NS 200000000LL
+
+/** number of operations between two reads of the clock. */
+#define BENCH_BATCH 64
+
+/** records that stay in the job table while the job cases run, like long running background jobs. */
+#define BENCH_RESIDENT_JOBS 1000
+
+/** pids inserted and removed by one round of the job cases. */
+#define BENCH_JOB_ROUND 1024
+
+/** results of the cases are stored here so the compiler can not drop the calls. */
+static volatile long sink;
+
+/**
+ * @brief current time of the monotonic clock.
+ * @returns nanoseconds.
+ */
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @brief print the result of a case.
+ * @param name the case name.
+ * @param params extra key=value pairs that identify the case, may be empty.
+ * @param iters number of operations.
+ * @param ns total time of the operations.
+ * @param allocs number of allocations made by the operations.
+ */
+static void report(const char *name, const char *params, long iters, long long ns, unsigned long allocs) {
+    printf("case=%s%s%s iters=%ld ns_per_op=%.1f allocs_per_op=%.3f", name, params[0] ? " " : "", params, iters,
+           (double)ns / iters, (double)allocs / iters);
+}
+
+/**
+ * @brief repeat an operation for at least BENCH_MIN_NS and print the result.
+ * @param name the case name.
+ * @param params extra key=value pairs that identify the case, may be empty.
+ * @param op the operation, called with its argument and the iteration number.
+ * @param arg argument of \a op.
+ * @returns the number of operations, so callers can add their own columns to the line.
+ *
+ * The line is not terminated, the caller prints the '\n'.
+ */
+static long run_case(const char *name, const char *params, void (*op)(void *arg, long i), void *arg) {
+    unsigned long allocs = alloc_count;
+    long long start = now_ns();
+    long long elapsed;
+    long iters = 0;
+    int b;
+
+    do {
+        for (b = 0; b < BENCH_BATCH; ++b) {
+            op(arg, iters++);
+        }
+    } while ((elapsed = now_ns() - start) < BENCH_MIN_NS);
+    report(name, params, iters, elapsed, alloc_count - allocs);
+    return iters;
+}
+
+/**
+ * @brief a line for the parse case.
+ */
+typedef struct parse_arg {
+    char *line; /**< the line as the user typed it. */
+    char *work; /**< copy that is parsed, the lexer modifies it. */
+    size_t len; /**< length of \a line with its terminator. */
+    int args;   /**< number of arguments after the command name. */
+} parse_arg;
+
+/**
+ * @brief build a command line with a number of arguments.
+ * @param args number of arguments after the command name.
+ * @returns the line, must be freed.
+ *
+ * Every fourth argument is quoted and every eighth contains an escape, so the unquoting path is
+ * measured too.
+ */
+static char *make_line(int args) {
+    size_t size = 16 + (size_t)args * 24;
+    char *line = malloc(size);
+    size_t len = 0;
+    int i;
+
+    len += sprintf(line, "/bin/echo");
+    for (i = 0; i < args; ++i) {
+        if (i % 8 == 7)
+            len += sprintf(line + len, " \"arg\\\"%d\"", i);
+        else if (i % 4 == 3)
+            len += sprintf(line + len, " 'arg %d'", i);
+        else
+            len += sprintf(line + len, " arg%d", i);
+    }
+    return line;
+}
+
+/**
+ * @brief parse one line like the shell does: copy it, reset the line arena, parse it.
+ * @param arg the \a parse_arg.
+ * @param i unused.
+ *
+ * The copy is part of the measured time, the shell pays it too when the line is read.
+ */
+static void op_parse(void *arg, long i) {
+    parse_arg *p = arg;
+    pipeline pl;
+
+    (void)i;
+    memcpy(p->work, p->line, p->len);
+    arena_reset(&line_arena);
+    if (parse_pipeline(p->work, &pl, &line_arena) == -1 || pl.argc[0] != p->args + 1) {
+        fprintf(stderr, "bench: parse failed for %d arguments\n", p->args);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief parse lines with a number of arguments.
+ * @param args number of arguments of the line.
+ */
+static void bench_parse(int args) {
+    parse_arg p;
+    char params[32];
+    long iters;
+    long long start;
+    double secs;
+
+    p.args = args;
+    p.line = make_line(args);
+    p.len = strlen(p.line) + 1;
+    p.work = malloc(p.len);
+    op_parse(&p, 0); /* warm up the arena */
+
+    snprintf(params, sizeof(params), "args=%d", args);
+    start = now_ns();
+    iters = run_case("parse", params, op_parse, &p);
+    secs = (now_ns() - start) / 1e9;
+    printf(" mb_per_s=%.1f\n", (double)(p.len - 1) * iters / secs / 1e6);
+    free(p.work);
+    free(p.line);
+}
+
+/** commands looked up by the builtin case: builtins first, then commands that are not. */
+static char *lookup_names[] = {"cd", "pwd", "exit", "hash", "ls", "grep", "/bin/true", "make"};
+
+/**
+ * @brief look up one name in the builtin table.
+ * @param arg unused.
+ * @param i selects the name.
+ */
+static void op_check_builtin(void *arg, long i) {
+    (void)arg;
+    sink = check_if_builtin(lookup_names[i % (sizeof(lookup_names) / sizeof(lookup_names[0]))]);
+}
+
+/**
+ * @brief build the prompt when nothing changed.
+ * @param arg unused.
+ * @param i unused.
+ */
+static void op_prompt_cached(void *arg, long i) {
+    (void)arg;
+    (void)i;
+    sink = (long)create_prompt_message();
+}
+
+/**
+ * @brief build the prompt after a cd, which looks up the cwd again.
+ * @param arg unused.
+ * @param i unused.
+ */
+static void op_prompt_after_cd(void *arg, long i) {
+    (void)arg;
+    (void)i;
+    prompt_invalidate_cwd();
+    sink = (long)create_prompt_message();
+}
+
+/**
+ * @brief measure job_insert() and pop_from_pid() separately.
+ *
+ * Rounds of BENCH_JOB_ROUND consecutive pids are inserted and then removed, with
+ * BENCH_RESIDENT_JOBS other records in the table the whole time. Consecutive pids are what the
+ * kernel hands out to a busy shell.
+ */
+static void bench_jobs() {
+    process *resident[BENCH_RESIDENT_JOBS];
+    process *p;
+    pid_t pid = 100000;
+    long long insert_ns = 0, pop_ns = 0, t;
+    unsigned long insert_allocs = 0, pop_allocs = 0, a;
+    long rounds = 0;
+    char params[32];
+    int i;
+
+    for (i = 0; i < BENCH_RESIDENT_JOBS; ++i) {
+        resident[i] = job_alloc();
+        resident[i]->pid = 2 + i * 7;
+        job_insert(resident[i]);
+    }
+    while (insert_ns + pop_ns < BENCH_MIN_NS) {
+        a = alloc_count;
+        t = now_ns();
+        for (i = 0; i < BENCH_JOB_ROUND; ++i) {
+            p = job_alloc();
+            p->pid = pid + i;
+            job_insert(p);
+        }
+        insert_ns += now_ns() - t;
+        insert_allocs += alloc_count - a;
+
+        a = alloc_count;
+        t = now_ns();
+        for (i = 0; i < BENCH_JOB_ROUND; ++i) {
+            job_release(pop_from_pid(pid + i));
+        }
+        pop_ns += now_ns() - t;
+        pop_allocs += alloc_count - a;
+        pid += BENCH_JOB_ROUND;
+        rounds++;
+    }
+    snprintf(params, sizeof(params), "resident=%d", BENCH_RESIDENT_JOBS);
+    report("job_insert", params, rounds * BENCH_JOB_ROUND, insert_ns, insert_allocs);
+    printf("\n");
+    report("pop_from_pid", params, rounds * BENCH_JOB_ROUND, pop_ns, pop_allocs);
+    printf("\n");
+    for (i = 0; i < BENCH_RESIDENT_JOBS; ++i) {
+        job_release(pop_from_pid(resident[i]->pid));
+    }
+}
+
+int main() {
+    bench_parse(10);
+    bench_parse(1000);
+    bench_parse(100000);
+
+    run_case("check_if_builtin", "", op_check_builtin, NULL);
+    printf("\n");
+
+    bench_jobs();
+
+    create_prompt_message(); /* the first call looks up the user and the host */
+    run_case("prompt", "state=cached", op_prompt_cached, NULL);
+    printf("\n");
+    run_case("prompt", "state=after_cd", op_prompt_after_cd, NULL);
+    printf("\n");
+
+    free_all();
+    prompt_free();
+    arena_free(&line_arena);
+    return EXIT_SUCCESS;
+}
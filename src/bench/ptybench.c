@@ -0,0 +1,506 @@
+/** \file ptybench.c
+* \brief end to end latency and throughput of the interactive shell.
+*
+* Built and run with 'make ptybench'. The shell runs on a pseudo terminal, exactly as a user
+* would see it, and lines are typed into it. The time from Enter to the next prompt is measured
+* for every line:
+*     pwd       a builtin, the cost of the event loop, the parser and readline.
+*     true      /bin/true, launch, exec and reap of a foreground child.
+*     bg_notify '/bin/true &' until the shell reports that it exited, i.e. harvest_dead_child().
+*     launch_rate many '/bin/true' lines typed ahead at once, in launches per second.
+*     bg_stress many background jobs typed ahead, until every one of them is reported.
+*
+* Every case prints one line of key=value pairs with percentiles in microseconds. With -b the
+* results are compared to a baseline file written earlier with -w.
+*/
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pty.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/** time to wait for any output of the shell before giving up, in milliseconds. */
+#define PTY_TIMEOUT_MS 10000
+
+/** size of the buffer that collects the output of one line. */
+#define PTY_OUTPUT_SIZE (1 << 16)
+
+/** max number of cases in a baseline file. */
+#define MAX_BASELINE 32
+
+/**
+ * @brief the result of a case, as printed and as stored in a baseline file.
+ */
+typedef struct result {
+    char name[32]; /**< case name. */
+    double rate;   /**< operations per second. */
+    double p50;    /**< median latency in microseconds. */
+    double p99;    /**< 99th percentile in microseconds. */
+    double p999;   /**< 99.9th percentile in microseconds. */
+} result;
+
+/** the pseudo terminal master, connected to the shell. */
+static int master = -1;
+/** the pid of the shell. */
+static pid_t shell_pid;
+/** the HOME of the shell, an empty directory made by start_shell(). */
+static char home[] = "/tmp/ptybench.XXXXXX";
+/** the end of the prompt: the cwd followed by '$ '. */
+static char marker[PATH_MAX + 3];
+
+/** output of the shell since the last clear_output(). */
+static char output[PTY_OUTPUT_SIZE + 1];
+/** number of bytes in \a output. */
+static size_t output_len = 0;
+
+/** the baseline to compare to, read with -b. */
+static result baseline[MAX_BASELINE];
+/** number of entries in \a baseline. */
+static int baseline_count = 0;
+/** the results of this run, written with -w. */
+static result results[MAX_BASELINE];
+/** number of entries in \a results. */
+static int results_count = 0;
+
+/**
+ * @brief current time of the monotonic clock.
+ * @returns microseconds.
+ */
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+ * @brief forget the collected output.
+ */
+static void clear_output() { output_len = 0; }
+
+/**
+ * @brief read the output of the shell that is available, waiting for it up to a timeout.
+ * @param timeout_ms how long to wait for the first byte.
+ * @returns the number of bytes read, 0 on timeout. Exits if the shell is gone.
+ *
+ * When \a output is full its older half is dropped, only the end matters to the callers.
+ */
+static size_t read_output(int timeout_ms) {
+    struct pollfd pfd = {master, POLLIN, 0};
+    ssize_t n;
+
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return 0;
+    }
+    if (output_len == PTY_OUTPUT_SIZE) {
+        memmove(output, output + PTY_OUTPUT_SIZE / 2, PTY_OUTPUT_SIZE / 2);
+        output_len = PTY_OUTPUT_SIZE / 2;
+    }
+    if ((n = read(master, output + output_len, PTY_OUTPUT_SIZE - output_len)) <= 0) {
+        fprintf(stderr, "ptybench: the shell exited\n");
+        exit(EXIT_FAILURE);
+    }
+    output_len += n;
+    output[output_len] = '\0';
+    return n;
+}
+
+/**
+ * @brief check if the output ends with the prompt.
+ * @returns True if the shell waits for the next line.
+ */
+static int at_prompt() {
+    size_t m = strlen(marker);
+    return output_len >= m && memcmp(output + output_len - m, marker, m) == 0;
+}
+
+/**
+ * @brief read until the shell shows its prompt, and optionally printed a string before it.
+ * @param text a string that must appear in the output first, NULL if only the prompt matters.
+ *
+ * Exits if nothing is read for PTY_TIMEOUT_MS.
+ */
+static void wait_prompt(const char *text) {
+    while (!(at_prompt() && (text == NULL || strstr(output, text)))) {
+        if (read_output(PTY_TIMEOUT_MS) == 0) {
+            fprintf(stderr, "ptybench: timeout, the shell printed:\n%s\n", output);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * @brief type a string into the shell.
+ * @param s the string. Lines end with '\r', as the Enter key sends.
+ *
+ * Output of the shell is read meanwhile, so a shell that echoes while the terminal is full can
+ * not block the write.
+ */
+static void type(const char *s) {
+    size_t len = strlen(s);
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(master, s, len)) == -1) {
+            if (errno != EAGAIN && errno != EINTR) {
+                perror("write");
+                exit(EXIT_FAILURE);
+            }
+            read_output(10);
+            continue;
+        }
+        s += n;
+        len -= n;
+    }
+}
+
+/**
+ * @brief start the shell on a pseudo terminal and wait for its first prompt.
+ * @param argv argument vector of the shell, argv[0] is its path.
+ *
+ * HOME points to an empty directory, so the history log of the user is not touched.
+ */
+static void start_shell(char **argv) {
+    struct winsize ws = {50, 200, 0, 0};
+    char cwd[PATH_MAX];
+
+    if (mkdtemp(home) == NULL || getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("ptybench");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(marker, sizeof(marker), "%s$ ", cwd);
+    if ((shell_pid = forkpty(&master, NULL, NULL, &ws)) == -1) {
+        perror("forkpty");
+        exit(EXIT_FAILURE);
+    }
+    if (shell_pid == 0) {
+        setenv("HOME", home, 1);
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    wait_prompt(NULL);
+}
+
+/**
+ * @brief remove the HOME of the shell with the files the shell makes there.
+ *
+ * They are the history log, its index and the directory of the caches of sourced scripts.
+ */
+static void remove_home() {
+    char path[PATH_MAX];
+    struct dirent *d;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "%s/.source_cache", home);
+    if ((dir = opendir(path)) != NULL) {
+        while ((d = readdir(dir)) != NULL) {
+            if (strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0)
+                unlinkat(dirfd(dir), d->d_name, 0);
+        }
+        closedir(dir);
+        rmdir(path);
+    }
+    snprintf(path, sizeof(path), "%s/.history", home);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/.history.idx", home);
+    unlink(path);
+    if (rmdir(home) == -1)
+        perror(home);
+}
+
+/**
+ * @brief leave the shell, wait for it and remove its HOME.
+ */
+static void stop_shell() {
+    char buffer[4096];
+    struct pollfd pfd = {master, POLLIN, 0};
+
+    type("exit\r");
+    /* read() fails with EIO once the shell closed the terminal */
+    while (poll(&pfd, 1, 1000) > 0 && read(master, buffer, sizeof(buffer)) > 0) {
+    }
+    waitpid(shell_pid, NULL, 0);
+    close(master);
+    remove_home();
+}
+
+/**
+ * @brief compare two doubles, for qsort().
+ * @param a pointer to the first double.
+ * @param b pointer to the second double.
+ * @returns <0, 0 or >0 like strcmp().
+ */
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief a percentile of sorted samples.
+ * @param v the samples, sorted.
+ * @param n number of samples.
+ * @param p the percentile, from 0 to 1.
+ * @returns the sample at the percentile, with the nearest rank method.
+ */
+static double percentile(const double *v, int n, double p) {
+    int i = (int)(p * n);
+    if (i < p * n) /* the rank is the ceiling of p * n */
+        i++;
+    i--;
+    return v[i < 0 ? 0 : i >= n ? n - 1 : i];
+}
+
+/**
+ * @brief find a case in the baseline.
+ * @param name the case name.
+ * @returns the entry, NULL if the baseline has no such case.
+ */
+static const result *find_baseline(const char *name) {
+    int i;
+    for (i = 0; i < baseline_count; ++i) {
+        if (strcmp(baseline[i].name, name) == 0)
+            return &baseline[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief print and store the result of a case.
+ * @param name the case name.
+ * @param v the latencies in microseconds. They are sorted.
+ * @param n number of latencies.
+ * @param rate operations per second.
+ */
+static void report(const char *name, double *v, int n, double rate) {
+    result *r = &results[results_count < MAX_BASELINE ? results_count++ : MAX_BASELINE - 1];
+    const result *b = find_baseline(name);
+
+    qsort(v, n, sizeof(double), cmp_double);
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->rate = rate;
+    r->p50 = percentile(v, n, 0.5);
+    r->p99 = percentile(v, n, 0.99);
+    r->p999 = percentile(v, n, 0.999);
+    printf("case=%s iters=%d ops_per_s=%.1f p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f", name, n, rate,
+           r->p50, r->p99, r->p999, v[n - 1]);
+    if (b) {
+        printf(" p50_delta=%+.1f%% p99_delta=%+.1f%% rate_delta=%+.1f%%", (r->p50 / b->p50 - 1) * 100,
+               (r->p99 / b->p99 - 1) * 100, (r->rate / b->rate - 1) * 100);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+/**
+ * @brief measure Enter to prompt for one line typed many times.
+ * @param name the case name.
+ * @param line the line, ending with '\r'.
+ * @param text output that must be seen before the line counts as done, NULL for the prompt only.
+ * @param n number of repetitions.
+ */
+static void bench_line(const char *name, const char *line, const char *text, int n) {
+    double *v = malloc(n * sizeof(double));
+    double start = now_us();
+    double t;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        clear_output();
+        t = now_us();
+        type(line);
+        wait_prompt(text);
+        v[i] = now_us() - t;
+    }
+    report(name, v, n, n / ((now_us() - start) / 1e6));
+    free(v);
+}
+
+/**
+ * @brief count the occurrences of a string in the output and drop everything up to the last one.
+ * @param s the string.
+ * @returns the number of occurrences.
+ *
+ * Whatever follows the last occurrence is kept, it may be the start of the next one.
+ */
+static int consume(const char *s) {
+    char *p = output;
+    char *q;
+    int count = 0;
+
+    while ((q = strstr(p, s)) != NULL) {
+        count++;
+        p = q + strlen(s);
+    }
+    memmove(output, p, output_len - (p - output) + 1);
+    output_len -= p - output;
+    return count;
+}
+
+/**
+ * @brief type many lines ahead and wait until each of them printed a string.
+ * @param name the case name.
+ * @param line the line, ending with '\r'.
+ * @param text what each line prints once it is done.
+ * @param n number of lines.
+ *
+ * Lines are typed as fast as the terminal takes them. The latency of a line is measured from
+ * the time it was typed to the time its text was seen. That includes waiting for the lines
+ * before it, the interesting number is the rate.
+ */
+static void bench_flood(const char *name, const char *line, const char *text, int n) {
+    double *typed = malloc(n * sizeof(double));
+    double *v = malloc(n * sizeof(double));
+    size_t len = strlen(line);
+    double start;
+    int sent = 0, done = 0, k;
+    ssize_t w = 0;
+
+    clear_output();
+    start = now_us();
+    while (done < n) {
+        while (sent < n && (w = write(master, line, len)) == (ssize_t)len) {
+            typed[sent++] = now_us();
+        }
+        if (sent < n && w > 0) {
+            /* a partial line: finish it, the terminal has room again soon */
+            const char *rest = line + w;
+            typed[sent] = now_us();
+            type(rest);
+            sent++;
+        }
+        if (read_output(sent < n ? 1 : PTY_TIMEOUT_MS) == 0 && sent == n) {
+            fprintf(stderr, "ptybench: timeout after %d of %d lines\n", done, n);
+            exit(EXIT_FAILURE);
+        }
+        for (k = consume(text); k > 0 && done < n; --k, ++done) {
+            v[done] = now_us() - typed[done];
+        }
+    }
+    report(name, v, n, n / ((now_us() - start) / 1e6));
+    free(typed);
+    free(v);
+    /* let the prompts and notifications of the last lines settle */
+    while (read_output(300) > 0) {
+    }
+}
+
+/**
+ * @brief read a baseline file.
+ * @param path the file.
+ */
+static void read_baseline(const char *path) {
+    FILE *f = fopen(path, "r");
+    result *r;
+
+    if (f == NULL) {
+        perror(path);
+        return;
+    }
+    while (baseline_count < MAX_BASELINE) {
+        r = &baseline[baseline_count];
+        if (fscanf(f, " case=%31s ops_per_s=%lf p50_us=%lf p99_us=%lf p999_us=%lf", r->name, &r->rate, &r->p50,
+                   &r->p99, &r->p999) != 5)
+            break;
+        baseline_count++;
+    }
+    fclose(f);
+}
+
+/**
+ * @brief write the results of this run as a baseline file.
+ * @param path the file.
+ */
+static void write_baseline(const char *path) {
+    FILE *f = fopen(path, "w");
+    int i;
+
+    if (f == NULL) {
+        perror(path);
+        return;
+    }
+    for (i = 0; i < results_count; ++i) {
+        fprintf(f, "case=%s ops_per_s=%.1f p50_us=%.1f p99_us=%.1f p999_us=%.1f\n", results[i].name,
+                results[i].rate, results[i].p50, results[i].p99, results[i].p999);
+    }
+    fclose(f);
+}
+
+/**
+ * @brief print the usage of the harness.
+ * @param name argv[0].
+ */
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-s shell] [-e engine] [-n lines] [-j bg_jobs] [-b baseline] [-w baseline]\n", name);
+    fprintf(stderr, "  -s shell    the shell binary (default ../bin/shell)\n");
+    fprintf(stderr, "  -e engine   passed to the shell with -e\n");
+    fprintf(stderr, "  -n lines    lines typed by each latency case (default 1000)\n");
+    fprintf(stderr, "  -j bg_jobs  background jobs of the bg_stress case, 0 to skip it (default 10000)\n");
+    fprintf(stderr, "  -b file     compare to the baseline in file\n");
+    fprintf(stderr, "  -w file     write the results to file as the new baseline\n");
+}
+
+int main(int argc, char *argv[]) {
+    char *shell_argv[4] = {"../bin/shell", NULL, NULL, NULL};
+    char *write_path = NULL;
+    int lines = 1000;
+    int bg_jobs = 10000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:e:n:j:b:w:h")) != -1) {
+        switch (opt) {
+            case 's':
+                shell_argv[0] = optarg;
+                break;
+            case 'e':
+                shell_argv[1] = "-e";
+                shell_argv[2] = optarg;
+                break;
+            case 'n':
+                lines = atoi(optarg);
+                break;
+            case 'j':
+                bg_jobs = atoi(optarg);
+                break;
+            case 'b':
+                read_baseline(optarg);
+                break;
+            case 'w':
+                write_path = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (lines <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    start_shell(shell_argv);
+    bench_line("pwd", "pwd\r", NULL, lines);
+    bench_line("true", "/bin/true\r", NULL, lines);
+    bench_line("bg_notify", "/bin/true &\r", "exited with status", lines);
+    bench_flood("launch_rate", "/bin/true\r", marker, lines);
+    if (bg_jobs > 0)
+        bench_flood("bg_stress", "/bin/true &\r", "exited with status", bg_jobs);
+    stop_shell();
+
+    if (write_path)
+        write_baseline(write_path);
+    return EXIT_SUCCESS;
+}
@@ -9,34 +9,114 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "utils.h"
 
-#include <readline/history.h>
-
 /** structure that holds all the implemented builtins. */
 const builtin_struct builtins[BUILTINS_NUM] = {
         {EXIT_CMD, "exit", shell_exit, "usage:\nexit [exit_code]\n\nDefault value of [exit_code] is 0\n"},
         {CD_CMD, "cd", change_directory, "usage:\ncd [dir]\n\nChange current working directory to [dir] directory "
                                          "(spaces don't need to be escaped)\nif [dir] is blank, change the directory "
                                          "to HOME Unix environmental variable\n"},
-        {JOBS_CMD, "jobs", jobs_list, "usage:\njobs\n\nlist all active processes.\n"},
+        {JOBS_CMD, "jobs", jobs_list,
+         "usage:\njobs [-l]\njobs -max [N]\n\nlist all active processes, the queued background pipelines and the "
+         "background processes\nthat completed since the last 'jobs'.\n-l also shows the time, CPU, max RSS and "
+         "context switches (voluntary/involuntary) of each.\n-max N runs at most N background pipelines at once, "
+         "later '&' lines wait in a queue.\nN = 0 removes the limit. Without N the current limit is printed.\n"},
         {HELP_CMD, "help", print_help,
          "usage:\nhelp [cmd]\n\nShow help for command [cmd].\nIf [cmd] is blank show this text.\n"},
-        {HOFF_CMD, "hoff", history_off, "usage:\nhoff\n\nhoff disables the history log\n"},
-        {HON_CMD, "hon", history_on, "usage:\nhon\n\nhon enables the history log\n"},
+        {HOFF_CMD, "hoff", history_off,
+         "usage:\nhoff\n\nhoff stops appending lines to the history log\n"},
+        {HON_CMD, "hon", history_on,
+         "usage:\nhon\n\nhon appends every following line to the history log again\n"},
         {PDEAD_CMD, "pdead", print_dead,
          "usage:\npdead [on|off]\n\n enables/disables printing of foreground processes' status on their death.\n"},
-        {PWD_CMD, "pwd", print_wd, "usage:\npwd\n\n prints the current working directory.\n"}};
+        {PWD_CMD, "pwd", print_wd, "usage:\npwd\n\n prints the current working directory.\n"},
+        {HASH_CMD, "hash", hash_builtin,
+         "usage:\nhash [-r] [cmd ...]\n\nWithout arguments list the remembered command locations.\n"
+         "-r forgets all remembered locations.\ncmd ... looks up each command in PATH and remembers its location.\n"
+         "The table is flushed automatically when PATH changes. Commands found through a relative PATH\n"
+         "directory, like '.', are not remembered.\n"},
+        {TIME_CMD, "time", time_builtin,
+         "usage:\ntime cmd [| cmd]...\ntime\n\nRun a foreground pipeline and print its real time, user and system "
+         "CPU,\nmax RSS and context switches (voluntary/involuntary) to stderr.\n'time' alone prints the totals "
+         "of the shell and of its finished children.\n"},
+        {PARALLEL_CMD, "parallel", parallel_builtin,
+         "usage:\nparallel [-j N] cmd [arg]... [::: input...]\n\nRun cmd once per input, at most N at a time "
+         "(default: the number of CPUs).\n'{}' in the arguments is replaced by the input, without '{}' the input "
+         "is appended.\nWithout ':::' the inputs are the lines of stdin. The output of each job is printed whole, "
+         "in input\norder. Failed jobs are reported on stderr, the exit status is the number of failures.\n"},
+        {PLACE_CMD, "place", place_builtin,
+         "usage:\nplace [-c cpus] [-n nice] [-i class[:level]]\nplace -r\nplace [-c cpus] [-n nice] [-i class[:level]] "
+         "cmd [| cmd]...\n\nSet where launched processes run: -c a CPU list like 0-3,8, -n a nice level from -20 to "
+         "19,\n-i an I/O class rt, be or idle with a level from 0 to 7.\nAlone it sets the defaults of all "
+         "commands, before a command only that line.\n'place' prints the defaults, -r removes them.\n"},
+        {ULIMIT_CMD, "ulimit", ulimit_builtin,
+         "usage:\nulimit [-S|-H] [-a | -f|-c|-d|-l|-m|-n|-s|-t|-u|-v] [N|unlimited]\n\nShow or set a resource "
+         "limit of the shell, inherited by every command it launches.\n-a shows all limits. -S and -H select the "
+         "soft or hard limit, a new value sets both by default.\n"},
+        {HSEARCH_CMD, "hsearch", hsearch_builtin,
+         "usage:\nhsearch [-n N] word...\n\nPrint the N (default 10) history lines that contain every word, in any "
+         "order and case.\nThe most often and most recently used come first, after how many times they were used.\n"
+         "Ctrl-R searches for the typed line the same way, press it again for the next match.\n"},
+        {GSORT_CMD, "gsort", glob_sorting,
+         "usage:\ngsort [on|off]\n\nUnquoted '*', '?' and '[...]' in a word are replaced by the matching paths, "
+         "sorted by default.\ngsort off keeps them in directory order, which is faster for huge directories.\n"},
+        {BATCH_CMD, "batch", batch_builtin,
+         "usage:\nbatch [-j N] cmd [arg]... [::: arg...]\n\nRun cmd over the arguments after ':::' in as few runs as "
+         "exec allows, like xargs.\nThe arguments before ':::' are given to every run. Without ':::' all arguments "
+         "after cmd are split.\nThe runs go one at a time, or N at a time with -j, their outputs in order.\nThe "
+         "exit status is the highest one of the runs.\n"},
+        {ABATCH_CMD, "autobatch", batch_auto_set,
+         "usage:\nautobatch [on|off]\n\nWhen on, a command whose expanded patterns make it too long for exec runs "
+         "with batch.\nThe arguments from the first pattern on are split, those before it are given to every run.\n"
+         "Only use it with commands whose last arguments are independent, like rm or chmod, not cp or mv.\n"},
+        {EXPORT_CMD, "export", export_builtin,
+         "usage:\nexport [NAME[=value]]...\n\nPut the variables in the environment of every command launched "
+         "later.\nWithout arguments list the exported variables. NAME=value alone on a line sets a variable\n"
+         "without exporting it, $NAME and ${NAME} are replaced by its value, $? is the last exit status.\n"},
+        {UNSET_CMD, "unset", unset_builtin, "usage:\nunset NAME...\n\nRemove the variables, from the environment "
+                                            "too.\n"},
+        {TASKS_CMD, "tasks", tasks_builtin,
+         "usage:\ntasks [-e] [-j N] file\n\nRun the tasks of file, one per line as 'name: dep... : command'.\nA task "
+         "starts once the tasks it depends on succeeded, as many at once as there are cores, or N with -j.\nThe "
+         "command is a line of this shell. Its output is written whole when it ends. A task without a\ncommand "
+         "only groups its dependencies. A failed task skips the tasks that depend on it, the others go on.\n-e "
+         "starts no new task after the first failure. The exit status is 1 if a task did not succeed.\n"},
+        {ECHO_CMD, "echo", echo_builtin,
+         "usage:\necho [-neE] [string]...\n\nPrint the strings. -n: no newline at the end. -e: interpret backslash "
+         "escapes.\n"},
+        {PRINTF_CMD, "printf", printf_builtin,
+         "usage:\nprintf [--] format [argument]...\n\nPrint the arguments as the format says, like printf(1). "
+         "%q quotes its argument\nfor the shell.\n"},
+        {TEST_CMD, "test", test_builtin,
+         "usage:\ntest expression\n\nExit with 0 if the expression is true, 1 if it is false, like test(1).\n"},
+        {BRACKET_CMD, "[", test_builtin, "usage:\n[ expression ]\n\nThe same as test.\n"},
+        {TRUE_CMD, "true", true_builtin, "usage:\ntrue\n\nExit with 0.\n"},
+        {FALSE_CMD, "false", false_builtin, "usage:\nfalse\n\nExit with 1.\n"},
+        {CAT_CMD, "cat", cat_builtin,
+         "usage:\ncat [-AbeEnstTuv] [file]...\n\nCopy the files to stdout, stdin without files or for '-'. Like "
+         "cat(1).\n"},
+        {FAST_CMD, "fastutils", fast_utils_set,
+         "usage:\nfastutils [on|off]\n\necho, printf, test, [, true, false and cat run inside the shell by "
+         "default, without a new\nprocess. fastutils off runs the external binaries instead, to compare the "
+         "results.\n"},
+        {SOURCE_CMD, "source", source_builtin,
+         "usage:\nsource file\n\nRun the commands of file in this shell, so the variables it sets stay set. "
+         "The compiled\nscript is cached in ~/.source_cache and used again while the file does not change.\n"}};
 
 /**
- * @brief Prints an invalid usage message.
+ * @brief Prints an invalid usage message and sets the exit status to 2.
  * @param thing_name usually argv[0] or function name.
  * @returns nothing
  */
 #define PRINT_BAD_ARGS_MSG(thing_name)                                                                                 \
-    { printf("%s: invalid usage\n", thing_name); }
+    {                                                                                                                  \
+        printf("%s: invalid usage\n", thing_name);                                                                     \
+        last_status = W_EXITCODE(2, 0);                                                                                \
+    }
 
 /**
  * @brief prints the current working directory.
@@ -44,15 +124,14 @@ const builtin_struct builtins[BUILTINS_NUM] = {
  * @param unused.
  */
 void print_wd(int argc, char **argv) {
-    extern char *shell_get_cwd();
-    char *cwd;
+    const char *cwd;
     if (argc > 1) {
         PRINT_BAD_ARGS_MSG(argv[0]);
         return;
     }
-    cwd = shell_get_cwd();
-    printf("%s\n", cwd);
-    free(cwd);
+    if ((cwd = shell_get_cwd()) != NULL) {
+        printf("%s\n", cwd);
+    }
 }
 
 /**
@@ -77,7 +156,28 @@ void print_dead(int argc, char **argv) {
 }
 }
 
-/** True if log file (~/.history) is enabled. */
+/**
+ * @brief enable/disable sorting the paths a pattern expands to.
+ * @param argc argument count, should be 2.
+ * @param argv argv[1] should contain "on" or "off" string.
+ */
+void glob_sorting(int argc, char **argv) {
+    if (argc != 2) {
+        PRINT_BAD_ARGS_MSG(argv[0]);
+        return;
+    }
+    if (strcmp(argv[1], "on") == 0) {
+        printf("sort pattern matches: %s -> ENABLED\n", glob_sort ? "ENABLED" : "DISABLED");
+        glob_sort = 1;
+    } else if (strcmp(argv[1], "off") == 0) {
+        printf("sort pattern matches: %s -> DISABLED\n", glob_sort ? "ENABLED" : "DISABLED");
+        glob_sort = 0;
+    } else {
+        fprintf(stderr, "%s: invalid option\n", argv[0]);
+    }
+}
+
+/** True if accepted lines are appended to the log file (~/.history). */
 int save_history_to_file = 1;
 
 /**
@@ -129,6 +229,7 @@ void print_help(int argc, char **argv) {
 
     if (code == -1) {
         fprintf(stderr, "command %s not found!\n", argv[1]);
+        last_status = W_EXITCODE(EXIT_FAILURE, 0);
     } else {
         printf("Showing help for command: %s\n", builtins[code].cmd);
         printf("-------------------------\n");
@@ -144,20 +245,21 @@ void print_help(int argc, char **argv) {
 }
 
 /**
- * @brief free all memory allocated by the process structs.
- *
- * usually called by shell_exit(). Pointer p is used to iterate through the list,
- * pr is used to free the last element. Once p is NULL, pr frees the last element
- * of the list.
+ * @brief free memory and exit. The history log is already complete on disk.
+ * @param exit_code the exit code of the shell.
  */
-void free_all() {
-    process *p;
-    process *pr;
-    pr = head;
-    for (p = head->next; p != NULL; p = p->next) {
-        free(pr);
-        pr = p;
-    }
+void shell_quit(int exit_code) {
+    free_all();
+    path_hash_free();
+    prompt_free();
+    spawn_free();
+    arena_free(&line_arena);
+    histsearch_free();
+    completion_free();
+    glob_free();
+    vars_free();
+    hlog_close();
+    exit(exit_code);
 }
 
 /**
@@ -173,38 +275,131 @@ void shell_exit(int argc, char **argv) {
         PRINT_BAD_ARGS_MSG(argv[0]);
     if (argc == 2) {
         exit_code = atoi(argv[1]);
+    }
+    shell_quit(exit_code);
 }
 
-    free_all();
-    if (save_history_to_file) {
-        write_history(NULL);
+/**
+ * @brief print one line of jobs_list().
+ * @param p the record.
+ * @param stats True to show the resources used.
+ */
+static void print_job(const process *p, int stats) {
+    job_stats s;
+
+    printf("[%d] %s", p->pid, (p->completed) ? "COMPLETED" : "RUNNING");
+    if (p->completed) {
+        printf(" status: %d", p->status);
+    }
+    if (stats) {
+        job_stats_of(p, &s);
+        printf(" ");
+        job_stats_print(stdout, &s);
+    }
+    printf("\n");
 }
-    exit(exit_code);
+
+/**
+ * @brief print a queued background pipeline as it was typed.
+ * @param q the queue entry.
+ */
+static void print_queued(const queued_job *q) {
+    int i, j;
+
+    printf("[q%d] QUEUED ", q->id);
+    for (i = 0; i < q->pl.stages + q->pl.consumers; ++i) {
+        if (i > 0)
+            printf(i == q->pl.stages ? " |& " : i > q->pl.stages ? ", " : " | ");
+        for (j = 0; j < q->pl.argc[i]; ++j) {
+            printf(j ? " %s" : "%s", q->pl.argv[i][j]);
+        }
+    }
+    printf(" &\n");
+}
+
+/**
+ * @brief set or print the limit of running background pipelines.
+ * @param argc 2, or 3 with the new limit.
+ * @param argv 'jobs -max [N]'.
+ */
+static void jobs_max(int argc, char **argv) {
+    char *end;
+    long n;
+
+    if (argc == 2) {
+        if (bg_jobs_max)
+            printf("%d\n", bg_jobs_max);
+        else
+            printf("unlimited\n");
+        return;
+    }
+    n = strtol(argv[2], &end, 10);
+    if (argc > 3 || *end != '\0' || end == argv[2] || n < 0 || n > INT_MAX) {
+        PRINT_BAD_ARGS_MSG(argv[0]);
+        return;
+    }
+    bg_jobs_max = n;
+    /* a higher limit frees slots at once */
+    run_queued_jobs();
 }
 
 /**
  * @brief Print a list of all active jobs. Theoritically including the foreground one.
- * @param argc unused.
- * @param argv unused.
+ * @param argc 1, or 2 with '-l'.
+ * @param argv '-l' shows the resources used by each job. '-max' is handled by jobs_max().
+ *
+ * Running processes are listed first, then the queued background pipelines in the order they
+ * will start. Background jobs that completed since the last call are listed too, then forgotten.
  */
 void jobs_list(int argc, char **argv) {
     process *p;
+    queued_job *q;
+    int stats = argc == 2 && strcmp(argv[1], "-l") == 0;
 
-    if (argc > 1)
+    if (argc >= 2 && strcmp(argv[1], "-max") == 0) {
+        jobs_max(argc, argv);
+        return;
+    }
+    if (argc > 2 || (argc == 2 && !stats)) {
         PRINT_BAD_ARGS_MSG(argv[0]);
+        return;
+    }
 
-    for (p = head; p != NULL; p = p->next) {
-        if (p->pid) {
-            /* ignore the master process */
-            printf("[%d] %s", p->pid, (p->completed) ? "COMPLETED" : "RUNNING");
-            if (p->completed) {
-                /* currently this should never happen. */
-                printf(" status: %d\n", p->status);
-            } else {
-                printf("\n");
+    for (p = job_oldest(); p != NULL; p = p->next) {
+        print_job(p, stats);
+    }
+    for (q = job_queue_oldest(); q != NULL; q = q->next) {
+        print_queued(q);
+    }
+    for (p = job_finished_oldest(); p != NULL; p = p->next) {
+        print_job(p, stats);
+    }
+    job_finished_clear();
 }
-        }
+
+/**
+ * @brief the time builtin without a command. Prints the resources used by the shell and its children.
+ * @param argc argument count, must be 1.
+ * @param argv argument vector.
+ *
+ * 'time cmd' is a prefix handled by the parser, a command only reaches this function when 'time'
+ * is not at the start of the line.
+ */
+void time_builtin(int argc, char **argv) {
+    struct rusage self, children;
+
+    if (argc > 1) {
+        fprintf(stderr, "%s: must be at the start of the line\n", argv[0]);
+        return;
     }
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    printf("shell:    user %ld.%03lds sys %ld.%03lds maxrss %ldKB csw %ld/%ld\n", (long)self.ru_utime.tv_sec,
+           (long)self.ru_utime.tv_usec / 1000, (long)self.ru_stime.tv_sec, (long)self.ru_stime.tv_usec / 1000,
+           self.ru_maxrss, self.ru_nvcsw, self.ru_nivcsw);
+    printf("children: user %ld.%03lds sys %ld.%03lds maxrss %ldKB csw %ld/%ld\n", (long)children.ru_utime.tv_sec,
+           (long)children.ru_utime.tv_usec / 1000, (long)children.ru_stime.tv_sec,
+           (long)children.ru_stime.tv_usec / 1000, children.ru_maxrss, children.ru_nvcsw, children.ru_nivcsw);
 }
 
 /**
@@ -212,18 +407,30 @@ void jobs_list(int argc, char **argv) {
  * @param argc any value >1 for a specific directory, 1 for home directory.
  * @param argv if argc>1 argv[1] and onwards contains the target directory.
  *
- * argv is splitted on spaces so we must reconstruct the string to get the real
- * target directory. This is not an ideal behavior, spaces in directory names
- * should be escaped and not passed normally, but the current input parser doesn't
- * allow this.
+ * A quoted or escaped directory reaches us as a single argument and is used as it is.
+ * For compatibility several arguments are still joined with spaces, so 'cd My Documents'
+ * keeps working without quotes.
  *
  * The total size neeeded to be allocated is calculated with strlen() and the final
- * string is created with strcat() calls.
+ * string is created with strcat() calls, in the arena of the current line.
  */
 void change_directory(int argc, char **argv) {
     if (argc == 1) {
         /* no arguments after 'cd', change directory to HOME */
-        chdir(getenv("HOME"));
+        if (var_get("HOME") == NULL) {
+            fprintf(stderr, "%s: HOME not set\n", argv[0]);
+            last_status = W_EXITCODE(EXIT_FAILURE, 0);
+        } else if (chdir(var_get("HOME")) == 0) {
+            prompt_invalidate_cwd();
+        }
+    } else if (argc == 2) {
+        /* the usual case, nothing to join */
+        if (chdir(argv[1]) == -1) {
+            perror(argv[0]);
+            last_status = W_EXITCODE(EXIT_FAILURE, 0);
+        } else {
+            prompt_invalidate_cwd();
+        }
     } else {
         /* Merge all argv[] strings together => handle paths with spaces in them */
         /* 0 because:
@@ -236,7 +443,7 @@ void change_directory(int argc, char **argv) {
         for (i = 1; i < argc; ++i) {
             total_size += (strlen(argv[i]) + 1) * sizeof(char);
 }
-        full_dir = malloc(total_size); /* allocate the calculated size */
+        full_dir = arena_alloc(&line_arena, total_size); /* allocate the calculated size */
         strcpy(full_dir, argv[1]);     /* strcpy the first string */
         for (i = 2; i < argc; ++i) {
             strcat(full_dir, " ");     /* use strcat() to append a space */
@@ -246,8 +453,10 @@ void change_directory(int argc, char **argv) {
         if ((chdir(full_dir)) == -1) {
             /* error in chdir */
             perror(argv[0]);
+            last_status = W_EXITCODE(EXIT_FAILURE, 0);
+        } else {
+            prompt_invalidate_cwd();
         }
-        free(full_dir);
     }
 }
 
@@ -257,21 +466,42 @@ void change_directory(int argc, char **argv) {
  * @param argc argument count to be passed.
  * @param argv argument vector to be passed.
  *
- *
+ * stdout is flushed afterwards, so the output of the builtin comes before what is written next to
+ * stderr or by a child, like the output of the external command it replaces.
  */
-void call_builtin(int code, int argc, char **argv) { builtins[code].action(argc, argv); }
+void call_builtin(int code, int argc, char **argv) {
+    builtins[code].action(argc, argv);
+    fflush(stdout);
+}
 
 /**
- * @brief check if a string is a builtin.
- * @param cmd the string to be checked.
- * @returns -1 if the command was not found. The code of the builtin if the command was found.
+ * @brief find the builtin of a command name.
+ * @param cmd the name.
+ * @returns the code of the builtin, -1 if there is none. It may be disabled, see builtin_enabled().
  */
-int check_if_builtin(char *cmd) {
+int builtin_code(const char *cmd) {
     int code;
     for (code = 0; code < BUILTINS_NUM; ++code) {
-        if (strcmp(builtins[code].cmd, cmd) == 0) {
+        if (strcmp(builtins[code].cmd, cmd) == 0)
             return code;
-}
     }
     return -1;
 }
+
+/**
+ * @brief check if a builtin currently replaces the command of its name.
+ * @param code the code of the builtin.
+ * @returns False for the fast utilities, echo to cat, with 'fastutils off': the external binaries run.
+ */
+int builtin_enabled(int code) { return fast_utils || code < ECHO_CMD || code > CAT_CMD; }
+
+/**
+ * @brief check if a string is a builtin.
+ * @param cmd the string to be checked.
+ * @returns -1 if the command was not found or its builtin is disabled. The code of the builtin if the command
+ * was found.
+ */
+int check_if_builtin(char *cmd) {
+    int code = builtin_code(cmd);
+    return code >= 0 && builtin_enabled(code) ? code : -1;
+}
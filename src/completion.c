@@ -0,0 +1,562 @@
+/** \file completion.c
+* \brief tab completion of command names from an index of the executables in PATH.
+*
+* A background thread lists the PATH directories and publishes the sorted names of their
+* executables. It watches the directories with inotify. After a change it lists only the
+* changed directories again, once they have been quiet for COMPLETE_DEBOUNCE_MS, so a package
+* install that adds many files costs one scan. A completion never reads a directory: it uses
+* the latest published index, or only the builtins until the first index is ready.
+*
+* The first word of a stage completes to a builtin or an indexed command. The arguments of the
+* commands in \a pid_commands complete to the pids of the running jobs. Everything else, and
+* any word with a '/', is left to the filename completion of readline.
+*
+* The thread owns the directory lists and the main thread owns the index it completes from.
+* A new index is handed over through \a pending under \a lock. The main thread frees the index
+* it replaces, so no index is freed while it is in use.
+*/
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#include <readline/readline.h>
+
+/**
+ * @brief the executables of one PATH directory. Only used by the index thread.
+ */
+typedef struct path_dir {
+    char *path;    /**< the directory. Points inside \a dirs_buf. */
+    int wd;        /**< the inotify watch, -1 if the directory is not watched. */
+    int dirty;     /**< True if the directory must be listed again. */
+    char **names;  /**< the names of the executables, in \a strings. */
+    size_t count;  /**< number of names. */
+    size_t cap;    /**< capacity of \a names. */
+    arena strings; /**< the names. */
+} path_dir;
+
+/**
+ * @brief the names of all executables in PATH.
+ */
+typedef struct exec_index {
+    char **names;  /**< sorted and without duplicates. */
+    size_t count;  /**< number of names. */
+    arena strings; /**< the vector and the names. */
+} exec_index;
+
+/** commands whose arguments complete to job pids. */
+static const char *pid_commands[] = {"kill", "renice"};
+
+/** protects \a pending, \a requested_path and \a stopping. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/** the index published by the thread and not yet taken by the main thread. */
+static exec_index *pending = NULL;
+/** a PATH value the thread must index from now on, NULL if there is none. */
+static char *requested_path = NULL;
+/** True once the shell is leaving. The thread stops publishing. */
+static int stopping = 0;
+/** eventfd that wakes the thread up for \a requested_path or \a stopping. */
+static int wake_fd = -1;
+
+/** the PATH directories. Only used by the thread. */
+static path_dir *dirs = NULL;
+/** number of elements in \a dirs. */
+static int dir_count = 0;
+/** copy of the PATH value, split with '\0'. */
+static char *dirs_buf = NULL;
+/** inotify instance watching \a dirs, -1 if inotify is not available. */
+static int inotify_fd = -1;
+
+/** the index completions use. Only used by the main thread. */
+static exec_index *active = NULL;
+/** the PATH value last sent to the thread. */
+static char *indexed_path = NULL;
+/** True if the thread runs. */
+static int started = 0;
+
+/**
+ * @brief compare two names for qsort().
+ * @param a pointer to the first name.
+ * @param b pointer to the second name.
+ * @returns like strcmp().
+ */
+static int compare_names(const void *a, const void *b) { return strcmp(*(char *const *)a, *(char *const *)b); }
+
+/**
+ * @brief free an index.
+ * @param ix the index, may be NULL.
+ */
+static void free_index(exec_index *ix) {
+    if (ix) {
+        arena_free(&ix->strings);
+        free(ix);
+    }
+}
+
+/**
+ * @brief list the executables of a directory again.
+ * @param d the directory.
+ *
+ * A directory that can not be opened, e.g. one that does not exist, has no executables.
+ */
+static void scan_dir(path_dir *d) {
+    struct dirent *e;
+    struct stat st;
+    DIR *dir;
+
+    d->dirty = 0;
+    d->count = 0;
+    arena_reset(&d->strings);
+    if ((dir = opendir(d->path)) == NULL) {
+        return;
+    }
+    while ((e = readdir(dir)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+            continue;
+        if (e->d_type != DT_REG && e->d_type != DT_LNK && e->d_type != DT_UNKNOWN)
+            continue;
+        if (fstatat(dirfd(dir), e->d_name, &st, 0) == -1 || !S_ISREG(st.st_mode) || !(st.st_mode & 0111))
+            continue;
+        if (d->count == d->cap) {
+            d->cap = d->cap ? d->cap * 2 : COMPLETE_NAMES_INITIAL_SIZE;
+            d->names = realloc(d->names, d->cap * sizeof(char *));
+        }
+        d->names[d->count++] = arena_strdup(&d->strings, e->d_name);
+    }
+    closedir(dir);
+}
+
+/**
+ * @brief forget the directories of the previous PATH value.
+ */
+static void clear_dirs() {
+    int i;
+    for (i = 0; i < dir_count; ++i) {
+        if (dirs[i].wd != -1)
+            inotify_rm_watch(inotify_fd, dirs[i].wd);
+        arena_free(&dirs[i].strings);
+        free(dirs[i].names);
+    }
+    free(dirs);
+    free(dirs_buf);
+    dirs = NULL;
+    dirs_buf = NULL;
+    dir_count = 0;
+}
+
+/**
+ * @brief start indexing the directories of a PATH value.
+ * @param path the value.
+ *
+ * Relative elements, the empty one included, depend on the current directory and are skipped.
+ * The watches are added before the first listing so no change is missed.
+ */
+static void set_dirs(const char *path) {
+    char *s, *save;
+
+    clear_dirs();
+    dirs_buf = strdup(path);
+    dirs = calloc(strlen(path) / 2 + 1, sizeof(path_dir));
+    for (s = strtok_r(dirs_buf, ":", &save); s; s = strtok_r(NULL, ":", &save)) {
+        if (s[0] != '/')
+            continue;
+        dirs[dir_count].path = s;
+        dirs[dir_count].wd = inotify_fd == -1 ? -1
+                                               : inotify_add_watch(inotify_fd, s,
+                                                                   IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                                                           IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+        dirs[dir_count].dirty = 1;
+        arena_init(&dirs[dir_count].strings);
+        dir_count++;
+    }
+}
+
+/**
+ * @brief mark the directories named by the queued inotify events as dirty.
+ */
+static void read_events() {
+    uint64_t buffer[COMPLETE_EVENT_BUFFER / sizeof(uint64_t)]; /* aligned for struct inotify_event */
+    const struct inotify_event *e;
+    const char *p;
+    ssize_t n;
+    int i;
+
+    while ((n = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (p = (const char *)buffer; p < (const char *)buffer + n; p += sizeof(struct inotify_event) + e->len) {
+            e = (const struct inotify_event *)p;
+            for (i = 0; i < dir_count; ++i) {
+                /* after an overflow any directory may have changed */
+                if (dirs[i].wd == e->wd || (e->mask & IN_Q_OVERFLOW))
+                    dirs[i].dirty = 1;
+                if (dirs[i].wd == e->wd && (e->mask & IN_IGNORED))
+                    dirs[i].wd = -1;
+            }
+        }
+    }
+}
+
+/**
+ * @brief merge the names of all directories into a new index and hand it to the main thread.
+ */
+static void publish() {
+    exec_index *ix = malloc(sizeof(exec_index));
+    size_t total = 0, i, n = 0;
+    int d;
+
+    arena_init(&ix->strings);
+    for (d = 0; d < dir_count; ++d) {
+        total += dirs[d].count;
+    }
+    ix->names = arena_alloc(&ix->strings, (total + 1) * sizeof(char *));
+    for (d = 0; d < dir_count; ++d) {
+        for (i = 0; i < dirs[d].count; ++i)
+            ix->names[n++] = arena_strdup(&ix->strings, dirs[d].names[i]);
+    }
+    qsort(ix->names, n, sizeof(char *), compare_names);
+    /* a command in several directories is listed once */
+    for (ix->count = 0, i = 0; i < n; ++i) {
+        if (ix->count == 0 || strcmp(ix->names[ix->count - 1], ix->names[i]) != 0)
+            ix->names[ix->count++] = ix->names[i];
+    }
+
+    pthread_mutex_lock(&lock);
+    if (stopping) {
+        free_index(ix);
+    } else {
+        /* the main thread never saw the previous one */
+        free_index(pending);
+        pending = ix;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief the index thread.
+ * @param unused unused.
+ * @returns NULL when the shell is leaving.
+ */
+static void *index_thread(void *unused) {
+    struct pollfd fds[2];
+    uint64_t value;
+    char *path;
+    int changed = 0;
+    int stop;
+    int i;
+
+    (void)unused;
+    fds[0].fd = wake_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = inotify_fd; /* ignored by poll() if -1 */
+    fds[1].events = POLLIN;
+    while (1) {
+        pthread_mutex_lock(&lock);
+        path = requested_path;
+        requested_path = NULL;
+        stop = stopping;
+        pthread_mutex_unlock(&lock);
+        if (stop) {
+            free(path);
+            break;
+        }
+        if (path) {
+            set_dirs(path);
+            free(path);
+            changed = 1;
+        }
+        if (changed) {
+            for (i = 0; i < dir_count; ++i) {
+                if (dirs[i].dirty)
+                    scan_dir(&dirs[i]);
+            }
+            publish();
+            changed = 0;
+        }
+        if (poll(fds, 2, -1) == -1) {
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            while (read(wake_fd, &value, sizeof(value)) > 0) {
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            /* wait until the directories are quiet */
+            do {
+                read_events();
+            } while (poll(&fds[1], 1, COMPLETE_DEBOUNCE_MS) > 0);
+            changed = 1;
+        }
+    }
+    clear_dirs();
+    return NULL;
+}
+
+/**
+ * @brief wake the index thread up.
+ */
+static void wake_thread() {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1) {
+        /* the counter is already set, the thread wakes up anyway */
+    }
+}
+
+/**
+ * @brief take the latest index of the thread, and ask for a new one if PATH changed.
+ */
+static void refresh_index() {
+    const char *path = var_get("PATH");
+    exec_index *ix;
+
+    if (!started) {
+        return;
+    }
+    if (path == NULL) {
+        path = "";
+    }
+    if (strcmp(indexed_path, path) != 0) {
+        free(indexed_path);
+        indexed_path = strdup(path);
+        pthread_mutex_lock(&lock);
+        free(requested_path);
+        requested_path = strdup(path);
+        pthread_mutex_unlock(&lock);
+        wake_thread();
+    }
+    pthread_mutex_lock(&lock);
+    ix = pending;
+    pending = NULL;
+    pthread_mutex_unlock(&lock);
+    if (ix) {
+        free_index(active);
+        active = ix;
+    }
+}
+
+/**
+ * @brief find the first name of the index that is not smaller than a prefix.
+ * @param text the prefix.
+ * @returns the position in active->names.
+ */
+static size_t lower_bound(const char *text) {
+    size_t lo = 0, hi = active->count, mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (strcmp(active->names[mid], text) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * @brief readline generator of command names: the builtins, then the indexed executables.
+ * @param text the prefix being completed.
+ * @param state 0 for the first call of a completion.
+ * @returns the next match, allocated with malloc(), NULL after the last one.
+ */
+static char *command_generator(const char *text, int state) {
+    static size_t next;
+    static int builtin;
+    static size_t len;
+    const char *name;
+
+    if (state == 0) {
+        len = strlen(text);
+        builtin = 0;
+        next = active ? lower_bound(text) : 0;
+    }
+    while (builtin < BUILTINS_NUM) {
+        name = builtins[builtin++].cmd;
+        if (strncmp(name, text, len) == 0)
+            return strdup(name);
+    }
+    /* the matches are consecutive in the sorted index */
+    if (active && next < active->count && strncmp(active->names[next], text, len) == 0) {
+        return strdup(active->names[next++]);
+    }
+    return NULL;
+}
+
+/**
+ * @brief readline generator of the pids of running jobs.
+ * @param text the prefix being completed.
+ * @param state 0 for the first call of a completion.
+ * @returns the next match, allocated with malloc(), NULL after the last one.
+ */
+static char *pid_generator(const char *text, int state) {
+    static process *next;
+    char buffer[MAX_PID_LENGTH + 1];
+    process *p;
+
+    if (state == 0) {
+        next = job_oldest();
+    }
+    while ((p = next) != NULL) {
+        next = p->next;
+        snprintf(buffer, sizeof(buffer), "%d", (int)p->pid);
+        if (!p->completed && strncmp(buffer, text, strlen(text)) == 0)
+            return strdup(buffer);
+    }
+    return NULL;
+}
+
+/**
+ * @brief check if a blank ends the line at a position.
+ * @param i the position in rl_line_buffer.
+ * @returns True if rl_line_buffer[i] is a blank.
+ */
+static int is_blank(int i) { return rl_line_buffer[i] == ' ' || rl_line_buffer[i] == '\t'; }
+
+/**
+ * @brief skip a word and the blanks after it.
+ * @param i the start of the word in rl_line_buffer.
+ * @param limit where to stop.
+ * @returns the start of the next word, at most \a limit.
+ */
+static int next_word(int i, int limit) {
+    while (i < limit && !is_blank(i)) {
+        i++;
+    }
+    while (i < limit && is_blank(i)) {
+        i++;
+    }
+    return i;
+}
+
+/**
+ * @brief check if a whole word is at a position.
+ * @param i the position in rl_line_buffer.
+ * @param limit the start of the word being completed.
+ * @param word the word.
+ * @returns True if \a word followed by a blank starts at \a i, before \a limit.
+ */
+static int word_at(int i, int limit, const char *word) {
+    int len = strlen(word);
+    return i + len < limit && strncmp(rl_line_buffer + i, word, len) == 0 && is_blank(i + len);
+}
+
+/**
+ * @brief find the command of the stage a word is in.
+ * @param start the start of the word being completed in rl_line_buffer.
+ * @returns the start of the command of the stage. \a start if the word is the command itself.
+ *
+ * Stages start after '|', '&' or, after '|&', ','. Quotes are not taken into account.
+ */
+static int command_start(int start) {
+    const char *fanout = strstr(rl_line_buffer, "|&");
+    int commas = fanout ? fanout - rl_line_buffer : start;
+    int i = start;
+    char c;
+
+    while (i > 0 && (c = rl_line_buffer[i - 1]) != '|' && c != '&' && !(c == ',' && i - 1 > commas)) {
+        i--;
+    }
+    while (i < start && is_blank(i)) {
+        i++;
+    }
+    /* the 'time' and 'place' prefixes are not commands, the word after them is */
+    if (word_at(i, start, "time")) {
+        i = next_word(i, start);
+    }
+    if (word_at(i, start, "place")) {
+        for (i = next_word(i, start); i < start && rl_line_buffer[i] == '-';) {
+            i = next_word(next_word(i, start), start);
+        }
+    }
+    return i;
+}
+
+/**
+ * @brief the completion function of readline.
+ * @param text the word being completed.
+ * @param start the start of \a text in rl_line_buffer.
+ * @param end the end of \a text in rl_line_buffer.
+ * @returns the matches, NULL to let readline complete file names.
+ */
+static char **complete(const char *text, int start, int end) {
+    size_t i;
+    int cmd;
+
+    (void)end;
+    refresh_index();
+    cmd = command_start(start);
+    if (cmd == start) {
+        return strchr(text, '/') ? NULL : rl_completion_matches(text, command_generator);
+    }
+    for (i = 0; i < sizeof(pid_commands) / sizeof(pid_commands[0]); ++i) {
+        if (word_at(cmd, start, pid_commands[i])) {
+            rl_attempted_completion_over = 1;
+            return rl_completion_matches(text, pid_generator);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief install the completion function and start indexing PATH in the background.
+ *
+ * Without a thread only the builtins complete as commands. The thread is started with all
+ * signals blocked, they are left to the signal_fd of the main thread.
+ */
+void completion_init() {
+    const char *path = var_get("PATH");
+    pthread_t thread;
+    sigset_t all, old;
+
+    rl_attempted_completion_function = complete;
+    if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        return;
+    }
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (path == NULL) {
+        path = "";
+    }
+    indexed_path = strdup(path);
+    requested_path = strdup(path);
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    started = pthread_create(&thread, NULL, index_thread, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (started) {
+        pthread_detach(thread);
+    }
+}
+
+/**
+ * @brief free the index and tell the thread to stop.
+ *
+ * The thread may be listing a slow directory. It is not waited for, it ends with the process.
+ * A forked child has no thread and must not take \a lock, which the thread may have held.
+ */
+void completion_free() {
+    if (!started || getpid() != shell_pid) {
+        return;
+    }
+    free_index(active);
+    free(indexed_path);
+    active = NULL;
+    indexed_path = NULL;
+    started = 0;
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    free_index(pending);
+    pending = NULL;
+    pthread_mutex_unlock(&lock);
+    wake_thread();
+}
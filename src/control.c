@@ -0,0 +1,639 @@
+/** \file control.c
+* \brief for, while, until and if blocks, compiled once to instructions.
+*
+* A list is compiled to a program before any of it runs. Every pipeline is lexed once, and the
+* blocks become jumps between the pipelines. Running the program only expands the variables
+* and patterns of a pipeline and runs it, so the body of a loop is never parsed again. The
+* builtin of a command with a literal name is looked up once, when it is compiled.
+*
+* grammar, a keyword being the first word of a pipeline of split_list():
+*
+*     list:    command [(';' | '\n' | '&&' | '||') command]...
+*     command: pipeline | for | while | if
+*     for:     'for' NAME 'in' [word...] ';' 'do' list 'done'
+*     while:   ('while' | 'until') list 'do' list 'done'
+*     if:      'if' list 'then' list ['elif' list 'then' list]... ['else' list] 'fi'
+*
+* 'do', 'then' and 'else' may be followed by the first command of their list in the same
+* pipeline, as in 'for f in *.c; do cc -c $f; done'. The status of a loop is the one of the last
+* command of its body, 0 if the body never ran.
+*
+* Each pipeline gives its memory back to line_arena when the next one starts, so a loop runs in
+* the memory of one iteration whatever its number of iterations.
+*
+* Input lines that leave a block open are kept, and the block runs once a line closes it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "utils.h"
+
+/** the keywords, indexed by \enum keywords. */
+static const char *keyword_names[] = {"", "for", "while", "until", "if", "do", "done", "then", "elif", "else", "fi",
+                                      "end of input"};
+
+/**
+ * @brief the state of the compiler.
+ */
+typedef struct compiler {
+    list_item *items; /**< the pipelines. */
+    int count;        /**< number of pipelines. */
+    int i;            /**< the current pipeline. */
+    char *rest;       /**< the text of the current pipeline after the keywords taken from it. */
+    arena *a;         /**< the arena of the program. */
+    program *p;       /**< the program. */
+    int missing;      /**< the keyword the input ended before, KW_NONE if it did not. */
+} compiler;
+
+/**
+ * @brief make room for one more element in a vector that grows inside an arena.
+ * @param a the arena.
+ * @param v the vector.
+ * @param count number of elements.
+ * @param cap pointer to the capacity, updated.
+ * @param size size of an element.
+ * @returns the vector, maybe moved.
+ */
+static void *make_room(arena *a, void *v, int count, int *cap, size_t size) {
+    int n;
+
+    if (count < *cap) {
+        return v;
+    }
+    n = *cap ? *cap * 2 : PROGRAM_INITIAL_SIZE;
+    v = arena_grow(a, v, *cap * size, n * size);
+    *cap = n;
+    return v;
+}
+
+/**
+ * @brief append an instruction.
+ * @param c the compiler.
+ * @param code the code of the instruction.
+ * @param arg its argument.
+ * @returns the index of the instruction.
+ */
+static int emit(compiler *c, int code, int arg) {
+    program *p = c->p;
+
+    p->code = make_room(c->a, p->code, p->length, &p->code_cap, sizeof(instruction));
+    p->code[p->length].code = code;
+    p->code[p->length].arg = arg;
+    return p->length++;
+}
+
+/**
+ * @brief check if the rest of a pipeline has no words.
+ * @param s the text.
+ * @returns True if \a s is blank up to its end or a comment.
+ */
+static int blank(const char *s) {
+    s += strspn(s, " \t\n");
+    return *s == '\0' || *s == '#';
+}
+
+/**
+ * @brief look at the first word of the current pipeline.
+ * @param c the compiler.
+ * @param after where the text after the word is stored if it is a keyword.
+ * @returns the keyword, KW_NONE for a command, KW_END if no pipelines are left.
+ *
+ * Only a plain word is a keyword: "do" or \do are commands.
+ */
+static int peek_keyword(compiler *c, char **after) {
+    char *s;
+    size_t n;
+    int k;
+
+    if (c->i == c->count) {
+        return KW_END;
+    }
+    s = c->rest + strspn(c->rest, " \t\n");
+    n = strcspn(s, " \t\n");
+    for (k = KW_FOR; k < KW_END; ++k) {
+        if (strlen(keyword_names[k]) == n && strncmp(s, keyword_names[k], n) == 0) {
+            *after = s + n;
+            return k;
+        }
+    }
+    return KW_NONE;
+}
+
+/**
+ * @brief print a syntax error about a keyword or operator that is not allowed where it is.
+ * @param what the keyword or operator.
+ * @returns -1.
+ */
+static int unexpected(const char *what) {
+    fprintf(stderr, "syntax error near unexpected token '%s'\n", what);
+    return -1;
+}
+
+/**
+ * @brief go to the next pipeline.
+ * @param c the compiler.
+ * @returns the operator after the pipeline that is left.
+ */
+static int next_pipeline(compiler *c) {
+    int op = c->items[c->i++].op;
+    if (c->i < c->count)
+        c->rest = c->items[c->i].text;
+    return op;
+}
+
+/**
+ * @brief take the expected keyword from the current pipeline.
+ * @param c the compiler.
+ * @param kw the keyword.
+ * @returns the operator after the keyword if nothing follows it in its pipeline, -2 if words
+ * follow it. -1 on a syntax error after printing it, or if the input ended before the keyword.
+ *
+ * Only 'done' and 'fi', which end a block, may be followed by '&&' or '||'.
+ */
+static int take_keyword(compiler *c, int kw) {
+    char *after;
+    int k = peek_keyword(c, &after);
+    int op;
+
+    if (k != kw) {
+        if (k == KW_END)
+            c->missing = kw;
+        else if (k == KW_NONE)
+            fprintf(stderr, "syntax error: '%s' expected\n", keyword_names[kw]);
+        else
+            unexpected(keyword_names[k]);
+        return -1;
+    }
+    c->rest = after;
+    if (!blank(after) && (kw == KW_DONE || kw == KW_FI)) {
+        after += strspn(after, " \t");
+        fprintf(stderr, "syntax error near unexpected token '%.*s'\n", (int)strcspn(after, " \t"), after);
+        return -1;
+    }
+    if (!blank(after)) {
+        return -2;
+    }
+    op = next_pipeline(c);
+    if (kw != KW_DONE && kw != KW_FI && op != LIST_SEQ && op != LIST_END) {
+        return unexpected(list_names[op]);
+    }
+    return op;
+}
+
+/**
+ * @brief look up the command of a pipeline, if its name is a literal word.
+ * @param cmd the pipeline.
+ *
+ * A name that is expanded, or one after the 'time' or 'place' prefixes, is looked up when it runs.
+ */
+void resolve_command(block_command *cmd) {
+    const token *t = &cmd->tokens[0];
+
+    cmd->name = NULL;
+    cmd->code = BUILTIN_UNKNOWN;
+    if (cmd->count == 0 || t->type != TOK_WORD || t->refs || t->glob || strcmp(t->text, "time") == 0 ||
+        strcmp(t->text, "place") == 0) {
+        return;
+    }
+    cmd->name = t->text;
+    cmd->code = builtin_code(t->text);
+}
+
+static int compile_list(compiler *c, int stops);
+
+/**
+ * @brief compile a for loop.
+ * @param c the compiler, at 'for'.
+ * @returns the operator after 'done', -1 on a syntax error.
+ *
+ * FORGET, FOR_START, top: FOR_NEXT, body, KEEP, JUMP top, end: RESTORE
+ */
+static int compile_for(compiler *c) {
+    program *p = c->p;
+    for_loop *l;
+    token *tokens;
+    int count, i, top, loop;
+
+    if (take_keyword(c, KW_FOR) != -2) {
+        fprintf(stderr, "syntax error: 'for' needs a variable\n");
+        return -1;
+    }
+    if ((count = lex_line(c->rest, c->a, &tokens)) == -1) {
+        return -1;
+    }
+    for (i = 0; i < count && tokens[i].type == TOK_WORD; ++i) {
+    }
+    if (i < count || count < 2 || tokens[0].refs || tokens[0].quoted ||
+        !var_name_valid(tokens[0].text, strlen(tokens[0].text)) || tokens[1].quoted ||
+        strcmp(tokens[1].text, "in") != 0) {
+        fprintf(stderr, "syntax error: expected 'for NAME in word...'\n");
+        return -1;
+    }
+    if ((i = next_pipeline(c)) != LIST_SEQ && i != LIST_END) {
+        return unexpected(list_names[i]);
+    }
+
+    p->loops = make_room(c->a, p->loops, p->loops_count, &p->loops_cap, sizeof(for_loop));
+    loop = p->loops_count++;
+    l = &p->loops[loop];
+    l->name = tokens[0].text;
+    l->words = tokens + 2;
+    l->count = count - 2;
+    emit(c, INS_FORGET, 0);
+    emit(c, INS_FOR_START, loop);
+    top = emit(c, INS_FOR_NEXT, loop);
+    if (take_keyword(c, KW_DO) == -1 || compile_list(c, 1 << KW_DONE) == -1) {
+        return -1;
+    }
+    emit(c, INS_KEEP, 0);
+    emit(c, INS_JUMP, top);
+    /* the vector may have moved while the body was compiled */
+    p->loops[loop].end = emit(c, INS_RESTORE, 0);
+    return take_keyword(c, KW_DONE);
+}
+
+/**
+ * @brief compile a while or until loop.
+ * @param c the compiler, at 'while' or 'until'.
+ * @param kw KW_WHILE or KW_UNTIL.
+ * @returns the operator after 'done', -1 on a syntax error.
+ *
+ * FORGET, top: condition, JUMP_FAIL (JUMP_OK for until) end, body, KEEP, JUMP top, end: RESTORE
+ */
+static int compile_while(compiler *c, int kw) {
+    int top, exit;
+
+    if (take_keyword(c, kw) == -1) {
+        return -1;
+    }
+    emit(c, INS_FORGET, 0);
+    top = c->p->length;
+    if (compile_list(c, 1 << KW_DO) == -1) {
+        return -1;
+    }
+    exit = emit(c, kw == KW_WHILE ? INS_JUMP_FAIL : INS_JUMP_OK, 0);
+    if (take_keyword(c, KW_DO) == -1 || compile_list(c, 1 << KW_DONE) == -1) {
+        return -1;
+    }
+    emit(c, INS_KEEP, 0);
+    emit(c, INS_JUMP, top);
+    c->p->code[exit].arg = emit(c, INS_RESTORE, 0);
+    return take_keyword(c, KW_DONE);
+}
+
+/**
+ * @brief compile an if block.
+ * @param c the compiler, at 'if'.
+ * @returns the operator after 'fi', -1 on a syntax error.
+ *
+ * condition, JUMP_FAIL next, body, JUMP end, next: [elif...] [else body | SUCCEED], end:
+ * The jumps to the end are chained through their arguments until the end is known.
+ */
+static int compile_if(compiler *c) {
+    instruction *code;
+    int fail, kw, op, j, chain = -1;
+    char *after;
+
+    kw = KW_IF;
+    do {
+        if (take_keyword(c, kw) == -1 || compile_list(c, 1 << KW_THEN) == -1) {
+            return -1;
+        }
+        fail = emit(c, INS_JUMP_FAIL, 0);
+        if (take_keyword(c, KW_THEN) == -1 || compile_list(c, 1 << KW_ELIF | 1 << KW_ELSE | 1 << KW_FI) == -1) {
+            return -1;
+        }
+        chain = emit(c, INS_JUMP, chain);
+        c->p->code[fail].arg = c->p->length;
+    } while ((kw = peek_keyword(c, &after)) == KW_ELIF);
+
+    if (kw == KW_ELSE) {
+        if (take_keyword(c, KW_ELSE) == -1 || compile_list(c, 1 << KW_FI) == -1)
+            return -1;
+    } else {
+        emit(c, INS_SUCCEED, 0);
+    }
+    if ((op = take_keyword(c, KW_FI)) == -1) {
+        return -1;
+    }
+    code = c->p->code;
+    for (; chain != -1; chain = j) {
+        j = code[chain].arg;
+        code[chain].arg = c->p->length;
+    }
+    return op;
+}
+
+/**
+ * @brief compile a command: a pipeline or a block.
+ * @param c the compiler.
+ * @param kw the keyword at the current pipeline, from peek_keyword().
+ * @returns the operator after the command, -1 on a syntax error.
+ */
+static int compile_command(compiler *c, int kw) {
+    program *p = c->p;
+    block_command *cmd;
+    int op;
+
+    switch (kw) {
+        case KW_NONE:
+            p->commands = make_room(c->a, p->commands, p->commands_count, &p->commands_cap, sizeof(block_command));
+            cmd = &p->commands[p->commands_count];
+            if ((cmd->count = lex_line(c->rest, c->a, &cmd->tokens)) == -1)
+                return -1;
+            op = next_pipeline(c);
+            cmd->background = op == LIST_BG;
+            resolve_command(cmd);
+            emit(c, INS_RUN, p->commands_count++);
+            return op;
+        case KW_FOR:
+            op = compile_for(c);
+            break;
+        case KW_WHILE:
+        case KW_UNTIL:
+            op = compile_while(c, kw);
+            break;
+        case KW_IF:
+            op = compile_if(c);
+            break;
+        default:
+            return unexpected(keyword_names[kw]);
+    }
+    if (op == LIST_BG) {
+        fprintf(stderr, "syntax error: blocks can not run in the background\n");
+        return -1;
+    }
+    return op;
+}
+
+/**
+ * @brief compile commands until a keyword that ends the list.
+ * @param c the compiler.
+ * @param stops the keywords that end the list, as bits (1 << kw).
+ * @returns 0 on success, -1 on a syntax error or if the input ended before a keyword of \a stops.
+ *
+ * After '&&' a JUMP_FAIL, after '||' a JUMP_OK, skips the next command. It lands on the jump
+ * that follows that command, which sees the same status: in 'a && b || c' a failing a skips b
+ * and runs c.
+ */
+static int compile_list(compiler *c, int stops) {
+    int pending = -1; /* the jump after '&&' or '||', its target is not known yet */
+    int n = 0;
+    int op = LIST_SEQ;
+    int kw;
+    char *after;
+
+    while (!(stops & (1 << (kw = peek_keyword(c, &after))))) {
+        if (kw == KW_END) {
+            /* the block is still open: the last keyword of stops closes it */
+            for (c->missing = KW_FI; !(stops & (1 << c->missing)); --c->missing) {
+            }
+            return -1;
+        }
+        if ((op = compile_command(c, kw)) == -1) {
+            return -1;
+        }
+        n++;
+        if (pending != -1)
+            c->p->code[pending].arg = c->p->length;
+        pending = op == LIST_AND ? emit(c, INS_JUMP_FAIL, 0) : op == LIST_OR ? emit(c, INS_JUMP_OK, 0) : -1;
+    }
+    if (pending != -1) {
+        fprintf(stderr, "syntax error: missing command after '%s'\n", list_names[op]);
+        return -1;
+    }
+    return n == 0 ? unexpected(keyword_names[kw]) : 0;
+}
+
+/**
+ * @brief run a pipeline of a program.
+ * @param cmd the pipeline.
+ * @returns 0 on success, -1 on a syntax error after printing it.
+ */
+static int run_command(block_command *cmd) {
+    pipeline pl;
+
+    if (build_pipeline(cmd->tokens, cmd->count, &pl, &line_arena) == -1) {
+        return -1;
+    }
+    if (pl.stages == 0) {
+        return 0;
+    }
+    pl.background |= cmd->background;
+    if (cmd->name && pl.argv[0][0] == cmd->name) {
+        /* the name was not expanded or changed by autobatch */
+        pl.builtin = cmd->code;
+    }
+    run_pipeline(&pl);
+    return 0;
+}
+
+/**
+ * @brief run a program.
+ * @param p the program.
+ *
+ * Stops at the end, on a syntax error in a pipeline, with status 2, or when ctrl-c stopped a
+ * foreground pipeline. A loop whose body starts no process is checked for ctrl-c at each
+ * iteration.
+ */
+void run_program(program *p) {
+    arena_mark start = arena_save(&line_arena);
+    arena_mark *scope = &start; /* where the memory of the next pipeline starts */
+    int kept = 0;
+    instruction *ins;
+    for_loop *l;
+    int pc = 0;
+
+    foreground_interrupted = 0;
+    while (pc < p->length && !foreground_interrupted && !script_interrupted) {
+        ins = &p->code[pc++];
+        switch (ins->code) {
+            case INS_RUN:
+                arena_rewind(&line_arena, *scope);
+                if (run_command(&p->commands[ins->arg]) == -1) {
+                    last_status = W_EXITCODE(2, 0);
+                    return;
+                }
+                break;
+            case INS_JUMP:
+                if (ins->arg < pc && poll_interrupt())
+                    return;
+                pc = ins->arg;
+                break;
+            case INS_JUMP_FAIL:
+                if (last_status != 0)
+                    pc = ins->arg;
+                break;
+            case INS_JUMP_OK:
+                if (last_status == 0)
+                    pc = ins->arg;
+                break;
+            case INS_FOR_START:
+                l = &p->loops[ins->arg];
+                arena_rewind(&line_arena, *scope);
+                l->outer = scope;
+                expand_words(l->words, l->count, &line_arena, &l->values);
+                l->next = 0;
+                l->inner = arena_save(&line_arena);
+                scope = &l->inner;
+                break;
+            case INS_FOR_NEXT:
+                l = &p->loops[ins->arg];
+                if (l->values[l->next] == NULL) {
+                    scope = l->outer;
+                    pc = l->end;
+                } else {
+                    var_set(l->name, strlen(l->name), l->values[l->next++], 0);
+                }
+                break;
+            case INS_FORGET:
+                kept = 0;
+                break;
+            case INS_KEEP:
+                kept = last_status;
+                break;
+            case INS_RESTORE:
+                last_status = kept;
+                break;
+            case INS_SUCCEED:
+                last_status = 0;
+                break;
+        }
+    }
+}
+
+/**
+ * @brief compile the pipelines of a list.
+ * @param items the pipelines, from split_list(). Their text is modified, the program points inside it.
+ * @param count number of pipelines.
+ * @param more True if more lines can follow, e.g. when a line is typed.
+ * @param p the program, allocated from line_arena.
+ * @returns 0 on success, -1 on a syntax error after printing it. 1 if \a more is True and a block
+ * is still open: the caller should compile again with the next line appended.
+ */
+int compile_program(list_item *items, int count, int more, program *p) {
+    compiler c;
+
+    memset(p, 0, sizeof(*p));
+    c.items = items;
+    c.count = count;
+    c.i = 0;
+    c.rest = items[0].text;
+    c.a = &line_arena;
+    c.p = p;
+    c.missing = KW_NONE;
+    if (compile_list(&c, 1 << KW_END) == 0) {
+        return 0;
+    }
+    if (c.missing != KW_NONE && more) {
+        return 1;
+    }
+    if (c.missing != KW_NONE) {
+        fprintf(stderr, "syntax error: missing '%s'\n", keyword_names[c.missing]);
+    }
+    return -1;
+}
+
+/**
+ * @brief compile and run the pipelines of a list.
+ * @param items the pipelines, from split_list(). Their text is modified.
+ * @param count number of pipelines.
+ * @param more True if more lines can follow, e.g. when a line is typed.
+ * @returns True if \a more is True and a block is still open: nothing ran, the caller should
+ * call again with the next line appended. False when the list ran or had a syntax error, which
+ * sets the status to 2.
+ *
+ * The program is allocated from line_arena, below the memory of the pipelines it runs.
+ */
+int run_list(list_item *items, int count, int more) {
+    program p;
+
+    switch (compile_program(items, count, more, &p)) {
+        case 0:
+            run_program(&p);
+            return 0;
+        case 1:
+            return 1;
+        default:
+            last_status = W_EXITCODE(2, 0);
+            return 0;
+    }
+}
+
+/**
+ * @brief parse and run one line of user input.
+ * @param line the line. It may hold several lines of a block, separated by '\n'.
+ * @param more True if more lines can follow it.
+ * @returns True if \a more is True and the line leaves a block open, after running nothing.
+ *
+ * The line is a list of pipelines and blocks, compiled as a whole before it runs, see control.c.
+ * The variables and patterns of each pipeline are expanded only when its turn comes, so it sees
+ * what the pipelines before it did. After '&&' the next pipeline runs only if the last one that
+ * ran succeeded, after '||' only if it failed: in 'a && b || c' a failing a skips b and runs c.
+ * ctrl-c on a foreground pipeline stops the rest of the list.
+ *
+ * Everything the parser allocates comes from line_arena. It is not reset here but by the
+ * callers, before they read the next line.
+ */
+int execute_line(const char *line, int more) {
+    list_item *items;
+    int count;
+
+    if ((count = split_list(arena_strdup(&line_arena, line), &line_arena, &items)) <= 0) {
+        if (count == -1)
+            last_status = W_EXITCODE(2, 0);
+        return 0;
+    }
+    return run_list(items, count, more);
+}
+
+/** the lines of a block that is still open, joined with '\n'. NULL if no block is open. */
+static char *open_block = NULL;
+
+/**
+ * @brief check if the lines read so far left a block open.
+ * @returns True if a block is open, its next line gets the continuation prompt.
+ */
+int block_open() { return open_block != NULL; }
+
+/**
+ * @brief forget the lines of a block that is still open, e.g. on ctrl-c at its prompt.
+ * @returns True if a block was open.
+ */
+int drop_open_block() {
+    int was_open = open_block != NULL;
+    free(open_block);
+    open_block = NULL;
+    return was_open;
+}
+
+/**
+ * @brief run a line of input, or keep it while it leaves a block open.
+ * @param line the line.
+ * @param more False at the end of the input, where a block that is still open is a syntax error.
+ * @returns True if the line was kept.
+ *
+ * The lines of a block run together once it is closed, like a line typed at once.
+ */
+int run_input(const char *line, int more) {
+    size_t n;
+
+    if (open_block) {
+        n = strlen(open_block);
+        open_block = realloc(open_block, n + strlen(line) + 2);
+        open_block[n] = '\n';
+        strcpy(open_block + n + 1, line);
+        line = open_block;
+    }
+    arena_reset(&line_arena);
+    if (execute_line(line, more)) {
+        if (open_block == NULL)
+            open_block = strdup(line);
+        return 1;
+    }
+    drop_open_block();
+    return 0;
+}
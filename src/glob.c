@@ -0,0 +1,431 @@
+/** \file glob.c
+* \brief pathname expansion of the words with unquoted '*', '?' or '['.
+*
+* A pattern is split on '/' in parts. A part without pattern characters is taken as it is, the
+* others are matched against the names of their directory. Directories are read with
+* getdents64() in blocks of GLOB_DENTS_SIZE bytes, so a directory with a million entries costs
+* a few hundred system calls and no memory per entry that does not match.
+*
+* Before the matcher runs, each name goes through a prefilter: the literal text before the first
+* and after the last pattern character, and the length the pattern requires, are compared first.
+* For usual patterns like 'data-2024*.csv' most names are rejected by one memcmp().
+*
+* The matches are sorted in byte order, unless sorting was turned off with 'gsort off', then they
+* come in directory order. Names starting with '.' only match a part that starts with a literal
+* '.', and '.' and '..' never match. A pattern that ends with '/' only matches directories, and
+* the '/' is kept at the end of each match.
+*/
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/**
+ * @brief a directory entry as returned by getdents64().
+ */
+typedef struct dirent64_record {
+    uint64_t d_ino;          /**< inode number. */
+    int64_t d_off;           /**< offset of the next record. */
+    unsigned short d_reclen; /**< length of this record. */
+    unsigned char d_type;    /**< type of the file. */
+    char d_name[];           /**< the name, '\0' terminated. */
+} dirent64_record;
+
+/**
+ * @brief one '/' separated part of a pattern.
+ */
+typedef struct glob_part {
+    const char *pat;    /**< the text of the part, not '\0' terminated. */
+    const char *active; /**< for each byte of \a pat, True if it is a pattern character. */
+    int len;            /**< length of \a pat. */
+    int is_pattern;     /**< True if the part has a pattern character. Else it is a plain name. */
+    int prefix;         /**< length of the literal text at the start. */
+    int suffix;         /**< length of the literal text at the end, 0 if it overlaps \a prefix. */
+    int min_len;        /**< the shortest name that can match. */
+    int fixed;          /**< True without '*': a name must be exactly \a min_len long. */
+} glob_part;
+
+/**
+ * @brief the state of one expansion.
+ */
+typedef struct glob_state {
+    glob_part *parts; /**< the parts of the pattern. */
+    int count;        /**< number of parts. */
+    arena *a;         /**< where the results live. */
+    char **matches;   /**< the results. */
+    size_t n;         /**< number of results. */
+    size_t cap;       /**< capacity of \a matches. */
+    int dirs_only;    /**< True if the pattern ends with '/': the last part only matches directories. */
+} glob_state;
+
+/** True to sort the matches of a pattern. 'gsort off' turns it off. */
+int glob_sort = 1;
+
+/** the buffer getdents64() reads into, allocated by the first expansion. */
+static char *dents = NULL;
+
+/**
+ * @brief find where a bracket expression ends.
+ * @param g the part.
+ * @param i position of the '[' in the part.
+ * @returns the position after the closing ']', 0 if there is none and '[' is a plain character.
+ *
+ * A ']' right after '[', '[!' or '[^' belongs to the set.
+ */
+static int class_end(const glob_part *g, int i) {
+    int j = i + 1;
+    if (j < g->len && (g->pat[j] == '!' || g->pat[j] == '^'))
+        j++;
+    if (j < g->len && g->pat[j] == ']')
+        j++;
+    while (j < g->len && g->pat[j] != ']') {
+        j++;
+    }
+    return j < g->len ? j + 1 : 0;
+}
+
+/**
+ * @brief check if a character is in a bracket expression.
+ * @param p the expression, from '[' to ']' included.
+ * @param len length of \a p.
+ * @param c the character.
+ * @returns True if it matches.
+ */
+static int class_match(const char *p, int len, unsigned char c) {
+    int negate = p[1] == '!' || p[1] == '^';
+    int i = 1 + negate;
+    int found = 0;
+
+    /* the first character is never the closing ']' */
+    for (; i < len - 1 && !found; ++i) {
+        if (i + 2 < len - 1 && p[i + 1] == '-') {
+            found = (unsigned char)p[i] <= c && c <= (unsigned char)p[i + 2];
+            i += 2;
+        } else {
+            found = (unsigned char)p[i] == c;
+        }
+    }
+    return found != negate;
+}
+
+/**
+ * @brief match one character of a name against the pattern at a position.
+ * @param g the part.
+ * @param i the position, not a '*'.
+ * @param c the character.
+ * @returns the number of pattern bytes consumed, 0 if the character does not match.
+ */
+static int match_one(const glob_part *g, int i, unsigned char c) {
+    int end;
+
+    if (g->active[i] && g->pat[i] == '?') {
+        return 1;
+    }
+    if (g->active[i] && g->pat[i] == '[' && (end = class_end(g, i)) != 0) {
+        return class_match(g->pat + i, end - i, c) ? end - i : 0;
+    }
+    return (unsigned char)g->pat[i] == c;
+}
+
+/**
+ * @brief match a name against a part.
+ * @param g the part.
+ * @param name the name.
+ * @returns True if it matches.
+ *
+ * Every '*' remembers where it started, on a mismatch the last one takes one more character.
+ * That is enough because an earlier '*' never needs to take more than the last one can.
+ */
+static int match(const glob_part *g, const char *name) {
+    const char *s = name, *star_s = NULL;
+    int p = 0, star_p = -1, k;
+
+    while (*s) {
+        if (p < g->len && g->active[p] && g->pat[p] == '*') {
+            star_p = ++p;
+            star_s = s;
+        } else if (p < g->len && (k = match_one(g, p, *s)) > 0) {
+            p += k;
+            s++;
+        } else if (star_p != -1) {
+            p = star_p;
+            s = ++star_s;
+        } else {
+            return 0;
+        }
+    }
+    while (p < g->len && g->active[p] && g->pat[p] == '*') {
+        p++;
+    }
+    return p == g->len;
+}
+
+/**
+ * @brief find the literal prefix and suffix and the length bounds of a part.
+ * @param g the part. \a pat, \a active and \a len must be set.
+ */
+static void prepare_part(glob_part *g) {
+    int i = 0, end;
+    int first = -1, last = 0;
+
+    g->min_len = 0;
+    g->fixed = 1;
+    while (i < g->len) {
+        end = i + 1;
+        if (g->active[i] && g->pat[i] == '[' && (end = class_end(g, i)) == 0)
+            end = i + 1;
+        else if (g->active[i]) {
+            if (first == -1)
+                first = i;
+            last = end;
+            if (g->pat[i] == '*')
+                g->fixed = 0;
+        }
+        if (!(g->active[i] && g->pat[i] == '*'))
+            g->min_len++;
+        i = end;
+    }
+    g->is_pattern = first != -1;
+    g->prefix = first == -1 ? g->len : first;
+    g->suffix = first == -1 ? 0 : g->len - last;
+}
+
+/**
+ * @brief check a name with the prefilter, then the matcher.
+ * @param g the part.
+ * @param name the name.
+ * @returns True if the name matches.
+ */
+static int name_matches(const glob_part *g, const char *name) {
+    size_t len;
+
+    if (name[0] == '.' && (g->pat[0] != '.' || name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        return 0;
+    }
+    /* strncmp() stops at the end of a shorter name */
+    if (strncmp(name, g->pat, g->prefix) != 0) {
+        return 0;
+    }
+    len = strlen(name);
+    if (len < (size_t)g->min_len || (g->fixed && len != (size_t)g->min_len)) {
+        return 0;
+    }
+    if (g->suffix && memcmp(name + len - g->suffix, g->pat + g->len - g->suffix, g->suffix) != 0) {
+        return 0;
+    }
+    return match(g, name);
+}
+
+/**
+ * @brief add a path to a vector in the arena.
+ * @param a the arena.
+ * @param v pointer to the vector.
+ * @param n pointer to the number of elements.
+ * @param cap pointer to the capacity.
+ * @param path the path, copied.
+ * @param len length of \a path.
+ */
+static void add_path(arena *a, char ***v, size_t *n, size_t *cap, const char *path, size_t len) {
+    char *s;
+
+    if (*n == *cap) {
+        size_t c = *cap ? *cap * 2 : GLOB_MATCHES_INITIAL_SIZE;
+        *v = arena_grow(a, *v, *cap * sizeof(char *), c * sizeof(char *));
+        *cap = c;
+    }
+    s = arena_alloc(a, len + 1);
+    memcpy(s, path, len);
+    s[len] = '\0';
+    (*v)[(*n)++] = s;
+}
+
+/**
+ * @brief add a path that matches the last part to the results.
+ * @param st the expansion.
+ * @param path the path. PATH_MAX long.
+ * @param len length of \a path.
+ * @param type the d_type of its directory entry, DT_UNKNOWN if it was not read from a directory.
+ *
+ * When the pattern ends with '/', a path that is not a directory, or a link to one, is left out
+ * and the others get the '/'.
+ */
+static void add_match(glob_state *st, char *path, size_t len, unsigned char type) {
+    struct stat sb;
+
+    if (st->dirs_only) {
+        if (type != DT_DIR && type != DT_LNK && type != DT_UNKNOWN)
+            return;
+        path[len] = '\0';
+        if (type != DT_DIR && (stat(path, &sb) == -1 || !S_ISDIR(sb.st_mode)))
+            return;
+        if (len + 1 >= PATH_MAX)
+            return;
+        path[len++] = '/';
+    }
+    add_path(st->a, &st->matches, &st->n, &st->cap, path, len);
+}
+
+static void expand(glob_state *st, char *path, size_t len, int part);
+
+/**
+ * @brief match a part against the names of a directory and go on with each match.
+ * @param st the expansion.
+ * @param path the directory followed by '/', or empty for the current directory. PATH_MAX long.
+ * @param len length of \a path.
+ * @param part index of the part.
+ *
+ * The matching names are collected first and the directory is closed before going deeper, so
+ * only one directory is open and one getdents64() buffer is used at any time.
+ */
+static void match_dir(glob_state *st, char *path, size_t len, int part) {
+    const glob_part *g = &st->parts[part];
+    const dirent64_record *d;
+    char **names = NULL;
+    size_t n = 0, cap = 0, i, name_len;
+    long got, off;
+    int fd;
+
+    path[len] = '\0';
+    if ((fd = open(len ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        return;
+    }
+    while ((got = syscall(SYS_getdents64, fd, dents, GLOB_DENTS_SIZE)) > 0) {
+        for (off = 0; off < got; off += d->d_reclen) {
+            d = (const dirent64_record *)(dents + off);
+            /* only directories can hold the next part */
+            if (part + 1 < st->count && d->d_type != DT_DIR && d->d_type != DT_LNK && d->d_type != DT_UNKNOWN)
+                continue;
+            if (!name_matches(g, d->d_name))
+                continue;
+            name_len = strlen(d->d_name);
+            if (part + 1 < st->count) {
+                add_path(st->a, &names, &n, &cap, d->d_name, name_len);
+            } else if (len + name_len < PATH_MAX) {
+                memcpy(path + len, d->d_name, name_len);
+                add_match(st, path, len + name_len, d->d_type);
+            }
+        }
+    }
+    close(fd);
+    for (i = 0; i < n; ++i) {
+        name_len = strlen(names[i]);
+        if (len + name_len + 1 >= PATH_MAX)
+            continue;
+        memcpy(path + len, names[i], name_len);
+        path[len + name_len] = '/';
+        expand(st, path, len + name_len + 1, part + 1);
+    }
+}
+
+/**
+ * @brief expand the parts of a pattern from one on, below a directory.
+ * @param st the expansion.
+ * @param path the directory followed by '/', or empty for the current directory. PATH_MAX long.
+ * @param len length of \a path.
+ * @param part index of the next part.
+ */
+static void expand(glob_state *st, char *path, size_t len, int part) {
+    const glob_part *g;
+    struct stat sb;
+
+    /* plain parts are appended without reading their directory */
+    while (part < st->count && !st->parts[part].is_pattern) {
+        g = &st->parts[part];
+        if (len + g->len + 1 >= PATH_MAX) {
+            return;
+        }
+        memcpy(path + len, g->pat, g->len);
+        len += g->len;
+        if (part + 1 < st->count)
+            path[len++] = '/';
+        part++;
+    }
+    if (part < st->count) {
+        match_dir(st, path, len, part);
+        return;
+    }
+    /* a plain last part must exist */
+    path[len] = '\0';
+    if (st->dirs_only) {
+        add_match(st, path, len, DT_UNKNOWN);
+    } else if (lstat(path, &sb) == 0) {
+        add_path(st->a, &st->matches, &st->n, &st->cap, path, len);
+    }
+}
+
+/**
+ * @brief compare two paths for qsort().
+ * @param a pointer to the first path.
+ * @param b pointer to the second path.
+ * @returns like strcmp().
+ */
+static int compare_paths(const void *a, const void *b) { return strcmp(*(char *const *)a, *(char *const *)b); }
+
+/**
+ * @brief expand a pattern to the paths that match it.
+ * @param word the pattern, already unquoted.
+ * @param active for each byte of \a word, True if it is an unquoted '*', '?' or '['.
+ * @param a the arena of the results.
+ * @param matches where the vector of the results is stored.
+ * @returns the number of results. 0 if nothing matches, the word is then used as it is.
+ *
+ * A '/' ends a part. A pattern that starts with '/' is absolute, else it is relative to the
+ * current directory and so are the results. A pattern that ends with '/' only matches directories,
+ * which keep the '/'.
+ */
+size_t glob_expand(const char *word, const char *active, arena *a, char ***matches) {
+    char path[PATH_MAX];
+    glob_state st;
+    size_t len = 0;
+    int i, start;
+
+    if (dents == NULL && (dents = malloc(GLOB_DENTS_SIZE)) == NULL) {
+        return 0;
+    }
+    st.a = a;
+    st.matches = NULL;
+    st.n = st.cap = 0;
+    st.count = 0;
+    st.parts = arena_alloc(a, (strlen(word) / 2 + 1) * sizeof(glob_part));
+    for (i = 0; word[i]; i = start) {
+        while (word[i] == '/') {
+            i++;
+        }
+        for (start = i; word[start] && word[start] != '/'; ++start) {
+        }
+        if (start == i)
+            break;
+        st.parts[st.count].pat = word + i;
+        st.parts[st.count].active = active + i;
+        st.parts[st.count].len = start - i;
+        prepare_part(&st.parts[st.count++]);
+    }
+    st.dirs_only = st.count > 0 && word[strlen(word) - 1] == '/';
+    if (word[0] == '/') {
+        path[len++] = '/';
+    }
+    expand(&st, path, len, 0);
+    if (glob_sort && st.n > 1) {
+        qsort(st.matches, st.n, sizeof(char *), compare_paths);
+    }
+    *matches = st.matches;
+    return st.n;
+}
+
+/**
+ * @brief free the buffer of the directory reader.
+ */
+void glob_free() {
+    free(dents);
+    dents = NULL;
+}
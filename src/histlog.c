@@ -0,0 +1,357 @@
+/** \file histlog.c
+* \brief the history log: an append-only file of accepted lines and a memory mapped index of it.
+*
+* Every accepted line is appended to ~/.history with a single writev() while the shell runs, so
+* a crash loses nothing and nothing is rewritten at exit. ~/.history.idx holds a header and the
+* offset of the start of every line in the log. Both files are mapped read-only, line i of the
+* log is found without reading the ones before it.
+*
+* The index is derived from the log. It records how many bytes of the log it covers, and whatever
+* lies beyond, e.g. lines appended by another shell, is indexed when the next line is appended or
+* at startup. Only an index that does not match its log, or a missing one, costs a full scan.
+* Startup maps both files and gives readline only the last HISTORY_RECENT lines, so it costs the
+* same for any size of history.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#include <readline/history.h>
+
+/**
+ * @brief the header at the start of the index file. The offsets of the lines follow it.
+ */
+typedef struct hlog_header {
+    uint64_t magic;    /**< HLOG_MAGIC. */
+    uint64_t count;    /**< number of indexed lines. */
+    uint64_t log_size; /**< bytes of the log covered by the index. Always the end of a line. */
+    uint64_t reserved; /**< zero. */
+} hlog_header;
+
+/**
+ * @brief a read-only shared mapping of a file that follows its growth.
+ */
+typedef struct mapped_file {
+    int fd;     /**< the file, -1 if not open. */
+    char *addr; /**< start of the mapping, NULL if nothing is mapped. */
+    size_t len; /**< length of the mapping. */
+} mapped_file;
+
+/** the log. */
+static mapped_file log_file = {-1, NULL, 0};
+/** the index. */
+static mapped_file index_file = {-1, NULL, 0};
+/** lines in the log before the last one this shell appended. */
+static size_t accepted = 0;
+/** indexed lines that both mappings cover. The header is shared with other shells and may be ahead. */
+static size_t mapped_count = 0;
+/** bytes of the log taken by the first \a mapped_count lines. */
+static size_t mapped_size = 0;
+
+/**
+ * @brief make a mapping cover at least the first bytes of its file.
+ * @param m the mapping.
+ * @param len number of bytes that must be mapped. The file must be at least that long.
+ * @returns 0 on success, -1 on failure.
+ *
+ * The mapping is rounded up to HLOG_MAP_STEP so a growing file is not remapped on every line.
+ * Pages past the end of the file are never touched.
+ */
+static int map_to(mapped_file *m, size_t len) {
+    size_t want;
+    void *addr;
+
+    if (len <= m->len) {
+        return 0;
+    }
+    want = (len + HLOG_MAP_STEP - 1) / HLOG_MAP_STEP * HLOG_MAP_STEP;
+    if (m->addr)
+        addr = mremap(m->addr, m->len, want, MREMAP_MAYMOVE);
+    else
+        addr = mmap(NULL, want, PROT_READ, MAP_SHARED, m->fd, 0);
+    if (addr == MAP_FAILED) {
+        return -1;
+    }
+    m->addr = addr;
+    m->len = want;
+    return 0;
+}
+
+/**
+ * @brief close a mapped file.
+ * @param m the mapping.
+ */
+static void unmap(mapped_file *m) {
+    if (m->addr)
+        munmap(m->addr, m->len);
+    if (m->fd != -1)
+        close(m->fd);
+    m->fd = -1;
+    m->addr = NULL;
+    m->len = 0;
+}
+
+/**
+ * @brief the header of the index.
+ * @returns the header in the mapping of the index.
+ */
+static const hlog_header *header() { return (const hlog_header *)index_file.addr; }
+
+/**
+ * @brief the offsets of the indexed lines.
+ * @returns the offsets in the mapping of the index.
+ */
+static const uint64_t *offsets() { return (const uint64_t *)(index_file.addr + sizeof(hlog_header)); }
+
+/**
+ * @brief write the header of the index.
+ * @param count number of indexed lines.
+ * @param log_size bytes of the log covered.
+ * @returns 0 on success, -1 on failure.
+ */
+static int write_header(uint64_t count, uint64_t log_size) {
+    hlog_header h;
+
+    h.magic = HLOG_MAGIC;
+    h.count = count;
+    h.log_size = log_size;
+    h.reserved = 0;
+    return pwrite(index_file.fd, &h, sizeof(h), 0) == sizeof(h) ? 0 : -1;
+}
+
+/**
+ * @brief write line offsets to the index.
+ * @param batch the offsets.
+ * @param n number of offsets.
+ * @param first number of the line of the first offset.
+ * @returns 0 on success, -1 on failure.
+ */
+static int write_offsets(const uint64_t *batch, int n, uint64_t first) {
+    ssize_t size = n * sizeof(uint64_t);
+    off_t at = sizeof(hlog_header) + first * sizeof(uint64_t);
+    return n == 0 || pwrite(index_file.fd, batch, size, at) == size ? 0 : -1;
+}
+
+/**
+ * @brief map the indexed lines and make them the ones this shell reads.
+ * @param count number of indexed lines.
+ * @param size bytes of the log they take.
+ * @returns 0 on success, -1 if a mapping can not grow: the lines read so far stay the same.
+ */
+static int cover(uint64_t count, uint64_t size) {
+    if (map_to(&log_file, size) == -1 || map_to(&index_file, sizeof(hlog_header) + count * sizeof(uint64_t)) == -1) {
+        return -1;
+    }
+    mapped_count = count;
+    mapped_size = size;
+    return 0;
+}
+
+/**
+ * @brief index the lines of the log that the index does not cover yet.
+ * @param rebuild True to drop the index and scan the whole log.
+ * @returns 0 on success, -1 on failure.
+ *
+ * Must be called with the index locked. A trailing line without '\n', e.g. one that is still
+ * being written by another shell, is left for the next call. The lines that other shells indexed
+ * are mapped too, see cover().
+ */
+static int catch_up(int rebuild) {
+    uint64_t batch[HLOG_INDEX_BATCH];
+    uint64_t count = 0, size = 0, pos;
+    struct stat st;
+    const char *nl;
+    int n = 0;
+
+    if (fstat(log_file.fd, &st) == -1) {
+        return -1;
+    }
+    if (!rebuild) {
+        count = header()->count;
+        size = header()->log_size;
+    }
+    if (!rebuild && size == (uint64_t)st.st_size) {
+        return cover(count, size);
+    }
+    if (map_to(&log_file, st.st_size) == -1) {
+        return -1;
+    }
+    /* the first line starts at 0, every other one after a '\n' */
+    pos = size;
+    while (pos < (uint64_t)st.st_size && (nl = memchr(log_file.addr + pos, '\n', st.st_size - pos)) != NULL) {
+        batch[n++] = pos;
+        pos = nl - log_file.addr + 1;
+        if (n == HLOG_INDEX_BATCH) {
+            if (write_offsets(batch, n, count) == -1)
+                return -1;
+            count += n;
+            n = 0;
+        }
+    }
+    if (write_offsets(batch, n, count) == -1)
+        return -1;
+    count += n;
+    /* the header goes last: a crash before it leaves the old, still valid, index */
+    if (write_header(count, pos) == -1) {
+        return -1;
+    }
+    return cover(count, pos);
+}
+
+/**
+ * @brief check that the index describes the log.
+ * @returns True if the header is valid and the log is at least as long as the indexed part.
+ *
+ * A log that was truncated or rewritten, e.g. by an older shell that saved the whole history
+ * at exit, fails the check and is indexed again.
+ */
+static int index_valid() {
+    struct stat st;
+    const hlog_header *h = header();
+
+    if (index_file.len < sizeof(hlog_header) || h->magic != HLOG_MAGIC || fstat(log_file.fd, &st) == -1 ||
+        h->log_size > (uint64_t)st.st_size || fstat(index_file.fd, &st) == -1 ||
+        (uint64_t)st.st_size < sizeof(hlog_header) + h->count * sizeof(uint64_t)) {
+        return 0;
+    }
+    /* the covered part must end with a complete line */
+    return h->log_size == 0 || (map_to(&log_file, h->log_size) == 0 && log_file.addr[h->log_size - 1] == '\n');
+}
+
+/**
+ * @brief give a line of the log to readline.
+ * @param line the line in the mapping of the log.
+ * @param len length of the line.
+ *
+ * readline wants a string and the log has no terminators, so the line is copied on the stack.
+ */
+static void add_recent(const char *line, size_t len) {
+    add_history(strndupa(line, len));
+}
+
+/**
+ * @brief open the history log and give its last lines to readline.
+ * @returns 0 on success, -1 if the log can not be used, after printing why.
+ *
+ * The log and its index are created if they do not exist. An index that is missing or does not
+ * match the log is built from the log, once.
+ */
+int hlog_open() {
+    char path[PATH_MAX];
+    const char *home = var_get("HOME");
+    struct stat st;
+    size_t i, count, len;
+    const char *line;
+
+    if (home == NULL || snprintf(path, sizeof(path), "%s/.history", home) >= (int)sizeof(path)) {
+        return -1;
+    }
+    if ((log_file.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+        perror(path);
+        return -1;
+    }
+    strcat(path, ".idx");
+    if ((index_file.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1 || fstat(index_file.fd, &st) == -1) {
+        perror(path);
+        hlog_close();
+        return -1;
+    }
+
+    flock(index_file.fd, LOCK_EX);
+    if ((st.st_size < (off_t)sizeof(hlog_header) && write_header(0, 0) == -1) ||
+        map_to(&index_file, st.st_size > (off_t)sizeof(hlog_header) ? (size_t)st.st_size : sizeof(hlog_header)) == -1 ||
+        catch_up(!index_valid()) == -1) {
+        flock(index_file.fd, LOCK_UN);
+        fprintf(stderr, "history: can not index %s\n", path);
+        hlog_close();
+        return -1;
+    }
+    flock(index_file.fd, LOCK_UN);
+
+    accepted = count = hlog_count();
+    for (i = count > HISTORY_RECENT ? count - HISTORY_RECENT : 0; i < count; ++i) {
+        line = hlog_line(i, &len);
+        add_recent(line, len);
+    }
+    return 0;
+}
+
+/**
+ * @brief append an accepted line to the log.
+ * @param line the line.
+ *
+ * Does nothing if the log is not open or 'hoff' was used. The line and its '\n' are written by
+ * one writev(), which O_APPEND keeps whole even when other shells append at the same time.
+ * The line is indexed for search right away, unless the lines found at startup are still being
+ * indexed: then it waits its turn.
+ */
+void hlog_append(const char *line) {
+    struct iovec iov[2];
+
+    accepted = hlog_count();
+    if (!save_history_to_file || log_file.fd == -1) {
+        return;
+    }
+    iov[0].iov_base = (void *)line;
+    iov[0].iov_len = strlen(line);
+    iov[1].iov_base = "\n";
+    iov[1].iov_len = 1;
+    if (writev(log_file.fd, iov, 2) == -1) {
+        perror("history");
+        return;
+    }
+    flock(index_file.fd, LOCK_EX);
+    catch_up(0);
+    flock(index_file.fd, LOCK_UN);
+    histsearch_step();
+}
+
+/**
+ * @brief number of lines in the history log.
+ * @returns the number of indexed lines this shell mapped, 0 if the log is not open. Lines that other
+ * shells appended since this shell last appended one are not counted.
+ */
+size_t hlog_count() { return mapped_count; }
+
+/**
+ * @brief number of lines in the history log before the line that is running.
+ * @returns hlog_count() as it was when the running line was accepted. Lines that other shells
+ * appended later are not counted.
+ */
+size_t hlog_accepted() { return accepted; }
+
+/**
+ * @brief get a line of the history log.
+ * @param i the line number, from 0 (the oldest) to hlog_count() - 1.
+ * @param len where the length of the line is stored.
+ * @returns the start of the line in the mapping of the log. It is not '\0' terminated.
+ */
+const char *hlog_line(size_t i, size_t *len) {
+    uint64_t start = offsets()[i];
+    uint64_t end = i + 1 < mapped_count ? offsets()[i + 1] : mapped_size;
+
+    *len = end - start - 1; /* without the '\n' */
+    return log_file.addr + start;
+}
+
+/**
+ * @brief close the history log.
+ */
+void hlog_close() {
+    unmap(&log_file);
+    unmap(&index_file);
+    mapped_count = mapped_size = 0;
+}
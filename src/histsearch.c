@@ -0,0 +1,524 @@
+/** \file histsearch.c
+* \brief search of the history log through a trigram index.
+*
+* Every distinct line of the history log is an entry that remembers how often it was accepted and
+* when last. For every trigram (three consecutive lowercase characters) the index keeps the
+* sorted list of the entries that contain it. A query is split in words, and an entry matches if
+* it contains every word, in any order and case. The candidates are the intersection of the lists
+* of all trigrams of the words, so only a few lines are compared with the query. Matches are ranked
+* by frecency: how often a line was used, weighted down by how long ago it was last used.
+*
+* The index follows the lines this shell mapped. The lines found at startup are indexed a step at a
+* time while the shell waits for input, and every accepted line is indexed when it is appended. A
+* search made before the startup lines are done indexes the rest first.
+*
+* The 'hsearch' builtin prints the best matches. Ctrl-R replaces the typed line with the best
+* match for it, pressing it again goes to the next one.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "utils.h"
+
+#include <readline/readline.h>
+
+/**
+ * @brief a distinct line of the history log.
+ */
+typedef struct hs_entry {
+    uint32_t last;  /**< number of the last line of the log with this text. */
+    uint32_t count; /**< how many lines of the log have this text. */
+    uint32_t hash;  /**< hash of the text. */
+} hs_entry;
+
+/**
+ * @brief the sorted list of the entries that contain a trigram.
+ */
+typedef struct hs_posting {
+    uint32_t *ids; /**< entry ids, ascending. */
+    uint32_t n;    /**< number of ids. */
+    uint32_t cap;  /**< capacity of \a ids. */
+} hs_posting;
+
+/** all entries, by id. */
+static hs_entry *entries = NULL;
+/** number of entries. */
+static uint32_t entries_n = 0;
+/** capacity of \a entries. */
+static uint32_t entries_cap = 0;
+
+/** open addressing table of entry ids + 1 keyed by the text, 0 for an empty slot. Length is a power of 2. */
+static uint32_t *by_text = NULL;
+/** number of slots in \a by_text. */
+static size_t by_text_size = 0;
+
+/** open addressing table of trigrams + 1, 0 for an empty slot. Parallel to \a postings. */
+static uint32_t *trigrams = NULL;
+/** the posting list of the trigram in the same slot of \a trigrams. */
+static hs_posting *postings = NULL;
+/** number of slots in \a trigrams. */
+static size_t trigrams_size = 0;
+/** number of used slots in \a trigrams. */
+static size_t trigrams_used = 0;
+
+/** number of lines of the log that are indexed. */
+static size_t indexed = 0;
+
+/**
+ * @brief lowercase an ASCII character, other bytes are left alone.
+ * @param c the character.
+ * @returns the lowercase character.
+ */
+static unsigned char lower(unsigned char c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c; }
+
+/**
+ * @brief FNV-1a hash of a text.
+ * @param s the text.
+ * @param len its length.
+ * @returns the hash.
+ */
+static uint32_t hash_text(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief slot of a text in \a by_text.
+ * @param s the text.
+ * @param len its length.
+ * @param h its hash.
+ * @returns the slot that holds its entry, or the empty slot where it goes.
+ */
+static size_t text_slot(const char *s, size_t len, uint32_t h) {
+    size_t i = h & (by_text_size - 1);
+    const char *t;
+    size_t n;
+
+    while (by_text[i]) {
+        hs_entry *e = &entries[by_text[i] - 1];
+        if (e->hash == h) {
+            t = hlog_line(e->last, &n);
+            if (n == len && memcmp(t, s, len) == 0)
+                return i;
+        }
+        i = (i + 1) & (by_text_size - 1);
+    }
+    return i;
+}
+
+/**
+ * @brief double \a by_text and rehash all entries.
+ */
+static void grow_by_text() {
+    size_t old_size = by_text_size;
+    uint32_t *old = by_text;
+    size_t i, j;
+
+    by_text_size = old_size ? old_size * 2 : HSEARCH_TABLE_INITIAL_SIZE;
+    by_text = calloc(by_text_size, sizeof(uint32_t));
+    for (i = 0; i < old_size; ++i) {
+        if (old[i]) {
+            for (j = entries[old[i] - 1].hash & (by_text_size - 1); by_text[j]; j = (j + 1) & (by_text_size - 1)) {
+            }
+            by_text[j] = old[i];
+        }
+    }
+    free(old);
+}
+
+/**
+ * @brief slot of a trigram in \a trigrams.
+ * @param key the trigram + 1.
+ * @returns the slot that holds it, or the empty slot where it goes.
+ */
+static size_t trigram_slot(uint32_t key) {
+    /* Fibonacci hashing, the keys are 24 bit */
+    size_t i = (key * 2654435769u) & (trigrams_size - 1);
+    while (trigrams[i] && trigrams[i] != key) {
+        i = (i + 1) & (trigrams_size - 1);
+    }
+    return i;
+}
+
+/**
+ * @brief double \a trigrams and rehash all posting lists.
+ */
+static void grow_trigrams() {
+    size_t old_size = trigrams_size;
+    uint32_t *old_keys = trigrams;
+    hs_posting *old_postings = postings;
+    size_t i, j;
+
+    trigrams_size = old_size ? old_size * 2 : HSEARCH_TABLE_INITIAL_SIZE;
+    trigrams = calloc(trigrams_size, sizeof(uint32_t));
+    postings = calloc(trigrams_size, sizeof(hs_posting));
+    for (i = 0; i < old_size; ++i) {
+        if (old_keys[i]) {
+            j = trigram_slot(old_keys[i]);
+            trigrams[j] = old_keys[i];
+            postings[j] = old_postings[i];
+        }
+    }
+    free(old_keys);
+    free(old_postings);
+}
+
+/**
+ * @brief key of the trigram that starts at a position.
+ * @param s the text, at least 3 characters from the position.
+ * @returns the lowercase trigram + 1, never 0.
+ */
+static uint32_t trigram_key(const char *s) {
+    return ((uint32_t)lower(s[0]) << 16 | (uint32_t)lower(s[1]) << 8 | lower(s[2])) + 1;
+}
+
+/**
+ * @brief add an entry to the posting lists of all trigrams of its text.
+ * @param id the entry id. Larger than every id added before, so the lists stay sorted.
+ * @param s the text.
+ * @param len its length.
+ */
+static void index_trigrams(uint32_t id, const char *s, size_t len) {
+    hs_posting *p;
+    size_t i, slot;
+    uint32_t key;
+
+    for (i = 0; i + 3 <= len; ++i) {
+        if ((trigrams_used + 1) * 2 > trigrams_size)
+            grow_trigrams();
+        key = trigram_key(s + i);
+        slot = trigram_slot(key);
+        if (trigrams[slot] == 0) {
+            trigrams[slot] = key;
+            trigrams_used++;
+        }
+        p = &postings[slot];
+        if (p->n && p->ids[p->n - 1] == id)
+            continue; /* the trigram appears twice in the line */
+        if (p->n == p->cap) {
+            p->cap = p->cap ? p->cap * 2 : 4;
+            p->ids = realloc(p->ids, p->cap * sizeof(uint32_t));
+        }
+        p->ids[p->n++] = id;
+    }
+}
+
+/**
+ * @brief index the lines appended to the history log since the last call.
+ * @param total number of lines of the log to index.
+ */
+static void catch_up(size_t total) {
+    const char *s;
+    size_t len, slot;
+    uint32_t h;
+
+    for (; indexed < total; ++indexed) {
+        s = hlog_line(indexed, &len);
+        h = hash_text(s, len);
+        if ((entries_n + 1) * 2 > by_text_size)
+            grow_by_text();
+        slot = text_slot(s, len, h);
+        if (by_text[slot]) {
+            /* a line used before: only its rank changes */
+            entries[by_text[slot] - 1].last = indexed;
+            entries[by_text[slot] - 1].count++;
+            continue;
+        }
+        if (entries_n == entries_cap) {
+            entries_cap = entries_cap ? entries_cap * 2 : HSEARCH_TABLE_INITIAL_SIZE;
+            entries = realloc(entries, entries_cap * sizeof(hs_entry));
+        }
+        entries[entries_n].last = indexed;
+        entries[entries_n].count = 1;
+        entries[entries_n].hash = h;
+        by_text[slot] = entries_n + 1;
+        index_trigrams(entries_n, s, len);
+        entries_n++;
+    }
+}
+
+/**
+ * @brief check if lines of the history log are waiting to be indexed.
+ * @returns True if the log has lines that are not indexed.
+ */
+int histsearch_pending() { return indexed < hlog_count(); }
+
+/**
+ * @brief index the next HSEARCH_INDEX_STEP lines of the history log, or fewer if the log ends.
+ */
+void histsearch_step() {
+    size_t count = hlog_count();
+    catch_up(count - indexed > HSEARCH_INDEX_STEP ? indexed + HSEARCH_INDEX_STEP : count);
+}
+
+/**
+ * @brief check if a text contains a word, ignoring case.
+ * @param s the text.
+ * @param len its length.
+ * @param word the word, lowercase.
+ * @param wlen its length.
+ * @returns True if \a word is a substring of \a s.
+ */
+static int contains(const char *s, size_t len, const char *word, size_t wlen) {
+    size_t i, j;
+    for (i = 0; i + wlen <= len; ++i) {
+        for (j = 0; j < wlen && lower(s[i + j]) == (unsigned char)word[j]; ++j) {
+        }
+        if (j == wlen)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief check if a sorted posting list holds an entry.
+ * @param p the list.
+ * @param id the entry id.
+ * @returns True if \a id is in \a p.
+ */
+static int posting_has(const hs_posting *p, uint32_t id) {
+    uint32_t lo = 0, hi = p->n;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (p->ids[mid] < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < p->n && p->ids[lo] == id;
+}
+
+/**
+ * @brief a query split in words.
+ */
+typedef struct hs_query {
+    char *words[HSEARCH_MAX_WORDS]; /**< the words, lowercase and '\0' terminated. */
+    size_t lens[HSEARCH_MAX_WORDS]; /**< their lengths. */
+    int n;                          /**< number of words. */
+    size_t lines;                   /**< number of lines of the log that are searched. */
+} hs_query;
+
+/**
+ * @brief check if an entry matches every word of a query.
+ * @param q the query.
+ * @param id the entry id.
+ * @returns True if the text of the entry contains all words. An entry last used after the
+ * searched lines does not match.
+ */
+static int matches(const hs_query *q, uint32_t id) {
+    const char *s;
+    size_t len;
+    int i;
+
+    if (entries[id].last >= q->lines)
+        return 0;
+    s = hlog_line(entries[id].last, &len);
+    for (i = 0; i < q->n; ++i) {
+        if (!contains(s, len, q->words[i], q->lens[i]))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief the rank of an entry.
+ * @param id the entry id.
+ * @returns how often the line was used, divided by how long ago it was last used.
+ */
+static double frecency(uint32_t id) {
+    double age = (double)(indexed - 1 - entries[id].last);
+    return entries[id].count * HSEARCH_RECENCY_SCALE / (HSEARCH_RECENCY_SCALE + age);
+}
+
+/**
+ * @brief keep an entry among the best results if it ranks high enough.
+ * @param best ids of the best entries so far, best first.
+ * @param scores their ranks.
+ * @param n pointer to the number of results so far.
+ * @param max capacity of \a best.
+ * @param id the entry id.
+ */
+static void consider(hs_result *best, double *scores, int *n, int max, uint32_t id) {
+    double score = frecency(id);
+    int i;
+
+    if (*n == max && score <= scores[max - 1])
+        return;
+    i = *n < max ? (*n)++ : max - 1;
+    for (; i > 0 && scores[i - 1] < score; --i) {
+        best[i] = best[i - 1];
+        scores[i] = scores[i - 1];
+    }
+    best[i].line = hlog_line(entries[id].last, &best[i].len);
+    best[i].count = entries[id].count;
+    scores[i] = score;
+}
+
+/**
+ * @brief search the history log.
+ * @param lines number of lines of the log to search, from the oldest. At most hlog_count().
+ * @param query the words to look for, separated by blanks.
+ * @param best where the results are stored, best first.
+ * @param max capacity of \a best, at most HSEARCH_MAX_RESULTS.
+ * @returns the number of results.
+ *
+ * Words of fewer than three characters have no trigram. A query made only of such words
+ * compares every distinct line.
+ */
+int histsearch_query(size_t lines, const char *query, hs_result *best, int max) {
+    double scores[HSEARCH_MAX_RESULTS];
+    const hs_posting *lists[HSEARCH_MAX_TRIGRAMS];
+    const hs_posting *shortest = NULL;
+    char buffer[HSEARCH_MAX_QUERY];
+    hs_query q;
+    size_t i, slot;
+    uint32_t id;
+    int nlists = 0, n = 0, w, k;
+    char *tok, *save;
+
+    catch_up(lines);
+    q.lines = lines;
+    /* lowercase copy, split in words */
+    snprintf(buffer, sizeof(buffer), "%s", query);
+    for (i = 0; buffer[i]; ++i) {
+        buffer[i] = lower(buffer[i]);
+    }
+    q.n = 0;
+    for (tok = strtok_r(buffer, " \t", &save); tok && q.n < HSEARCH_MAX_WORDS; tok = strtok_r(NULL, " \t", &save)) {
+        q.words[q.n] = tok;
+        q.lens[q.n++] = strlen(tok);
+    }
+    if (q.n == 0 || entries_n == 0) {
+        return 0;
+    }
+
+    for (w = 0; w < q.n; ++w) {
+        for (i = 0; i + 3 <= q.lens[w] && nlists < HSEARCH_MAX_TRIGRAMS; ++i) {
+            if (trigrams_size == 0)
+                return 0; /* no line is three characters long */
+            slot = trigram_slot(trigram_key(q.words[w] + i));
+            if (trigrams[slot] == 0)
+                return 0; /* no line has this trigram */
+            lists[nlists++] = &postings[slot];
+            if (shortest == NULL || postings[slot].n < shortest->n)
+                shortest = &postings[slot];
+        }
+    }
+
+    if (shortest == NULL) {
+        for (id = 0; id < entries_n; ++id) {
+            if (matches(&q, id))
+                consider(best, scores, &n, max, id);
+        }
+        return n;
+    }
+    for (i = 0; i < shortest->n; ++i) {
+        id = shortest->ids[i];
+        for (k = 0; k < nlists && (lists[k] == shortest || posting_has(lists[k], id)); ++k) {
+        }
+        /* the trigrams only narrow the candidates down, the words may still be apart */
+        if (k == nlists && matches(&q, id))
+            consider(best, scores, &n, max, id);
+    }
+    return n;
+}
+
+/**
+ * @brief the hsearch builtin: print the history lines that contain all words, best first.
+ * @param argc argument count.
+ * @param argv 'hsearch [-n N] word...'.
+ */
+void hsearch_builtin(int argc, char **argv) {
+    hs_result best[HSEARCH_MAX_RESULTS];
+    char query[HSEARCH_MAX_QUERY];
+    size_t len = 0;
+    int max = HSEARCH_DEFAULT_RESULTS;
+    int i = 1, n;
+
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        max = atoi(argv[2]);
+        i = 3;
+    }
+    if (i >= argc || max <= 0 || max > HSEARCH_MAX_RESULTS) {
+        printf("%s: invalid usage\n", argv[0]);
+        last_status = W_EXITCODE(2, 0);
+        return;
+    }
+    for (query[0] = '\0'; i < argc && len < sizeof(query); ++i) {
+        len += snprintf(query + len, sizeof(query) - len, "%s ", argv[i]);
+    }
+    /* the line that runs hsearch is in the log already, it must not find itself */
+    n = histsearch_query(hlog_accepted(), query, best, max);
+    for (i = 0; i < n; ++i) {
+        printf("%6u  %.*s\n", best[i].count, (int)best[i].len, best[i].line);
+    }
+    if (n == 0)
+        last_status = W_EXITCODE(EXIT_FAILURE, 0);
+}
+
+/** the query of the current run of Ctrl-R presses. */
+static char key_query[HSEARCH_MAX_QUERY];
+/** the result shown by the last Ctrl-R press. */
+static int key_next = 0;
+
+/**
+ * @brief readline command bound to Ctrl-R.
+ * @param count unused.
+ * @param key unused.
+ * @returns 0.
+ *
+ * The first press searches for the typed line and replaces it with the best match. Each
+ * following press shows the next match. The terminal bell rings when there are no more.
+ */
+int histsearch_key(int count, int key) {
+    hs_result best[HSEARCH_MAX_RESULTS];
+    char line[HSEARCH_MAX_QUERY];
+    int n;
+
+    (void)count;
+    (void)key;
+    if (rl_last_func != histsearch_key) {
+        snprintf(key_query, sizeof(key_query), "%s", rl_line_buffer);
+        key_next = 0;
+    }
+    /* the lines this shell mapped, those of other shells come with the next accepted line */
+    n = histsearch_query(hlog_count(), key_query, best, HSEARCH_MAX_RESULTS);
+    if (key_next >= n) {
+        rl_ding();
+        return 0;
+    }
+    snprintf(line, sizeof(line), "%.*s", (int)best[key_next].len, best[key_next].line);
+    key_next++;
+    rl_replace_line(line, 0);
+    rl_point = rl_end;
+    return 0;
+}
+
+/**
+ * @brief free the index.
+ */
+void histsearch_free() {
+    size_t i;
+    for (i = 0; i < trigrams_size; ++i) {
+        free(postings[i].ids);
+    }
+    free(postings);
+    free(trigrams);
+    free(by_text);
+    free(entries);
+    postings = NULL;
+    trigrams = by_text = NULL;
+    entries = NULL;
+    trigrams_size = trigrams_used = by_text_size = indexed = 0;
+    entries_n = entries_cap = 0;
+}
@@ -0,0 +1,513 @@
+/** \file jobs.c
+* \brief the job table.
+*
+* Every launched process gets a \a process record. Records come from slabs of JOB_SLAB_SIZE
+* records that are never given back to malloc() while the shell runs. Free records are kept in a
+* free list. Live records are indexed by pid in an open addressing hash table and also linked in
+* launch order, so jobs_list() can print them in a stable order.
+*
+* Removing and releasing a record never allocates, so reaping thousands of children costs no
+* malloc()/free() calls. Allocating and inserting may grow the slabs or the table.
+*
+* Completed background records move to a list of finished jobs, so 'jobs' can still show how
+* they ended and what they used. The list keeps at most JOB_FINISHED_MAX records.
+*
+* With 'jobs -max N' at most N background pipelines run at once. Further '&' lines wait in a FIFO
+* queue of \a queued_job entries and are started by run_queued_jobs() when a running one is reaped.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/**
+ * @brief a block of preallocated process records.
+ */
+typedef struct job_slab {
+    struct job_slab *next;          /**< the previously allocated slab. */
+    process records[JOB_SLAB_SIZE]; /**< the records of this slab. */
+} job_slab;
+
+/** all allocated slabs, the latest first. */
+static job_slab *slabs = NULL;
+/** free records, linked through their \a next field. */
+static process *free_records = NULL;
+
+/** hash table of live records keyed by pid. Empty slots are NULL. Length is a power of 2. */
+static process **table = NULL;
+/** number of slots in \a table. */
+static size_t table_size = 0;
+/** number of live records in \a table. */
+static size_t table_used = 0;
+
+/** the oldest live record. The first element of the launch order list. */
+static process *oldest = NULL;
+/** the latest added record. The last element of the launch order list. */
+static process *newest = NULL;
+
+/** the oldest completed background record that was not listed yet. */
+static process *finished_oldest = NULL;
+/** the latest completed background record. */
+static process *finished_newest = NULL;
+/** number of records in the finished list. */
+static size_t finished_count = 0;
+
+/** max number of background pipelines running at once, 0 for no limit. */
+int bg_jobs_max = 0;
+
+/** the oldest queued background pipeline, the next to start. */
+static queued_job *queue_oldest = NULL;
+/** the latest queued background pipeline. */
+static queued_job *queue_newest = NULL;
+/** number of queued pipelines. */
+static size_t queue_length = 0;
+/** id of the next queued pipeline. */
+static int queue_next_id = 1;
+
+/**
+ * @brief home slot of a pid.
+ * @param pid the process ID.
+ * @returns the index of the slot where the probe sequence of \a pid starts.
+ */
+static size_t home_slot(pid_t pid) {
+    /* Fibonacci hashing spreads the consecutive pids the kernel hands out */
+    return ((size_t)pid * 2654435769u) & (table_size - 1);
+}
+
+/**
+ * @brief index of the slot that holds a pid, or the empty slot where it should go.
+ * @param pid the process ID.
+ * @returns index in \a table.
+ */
+static size_t find_slot(pid_t pid) {
+    size_t i = home_slot(pid);
+    while (table[i] && table[i]->pid != pid) {
+        i = (i + 1) & (table_size - 1);
+    }
+    return i;
+}
+
+/**
+ * @brief double the size of the hash table and rehash all records.
+ */
+static void grow_table() {
+    process **old = table;
+    size_t old_size = table_size;
+    size_t i;
+
+    table_size = old_size ? old_size * 2 : JOB_TABLE_INITIAL_SIZE;
+    table = calloc(table_size, sizeof(process *));
+    for (i = 0; i < old_size; ++i) {
+        if (old[i]) {
+            table[find_slot(old[i]->pid)] = old[i];
+        }
+    }
+    free(old);
+}
+
+/**
+ * @brief get a new zeroed process record.
+ * @returns the record. It is not in the table until job_insert() is called.
+ *
+ * A new slab is allocated when no free record is left.
+ */
+process *job_alloc() {
+    process *p;
+    if (free_records == NULL) {
+        job_slab *s = malloc(sizeof(job_slab));
+        int i;
+        s->next = slabs;
+        slabs = s;
+        for (i = 0; i < JOB_SLAB_SIZE; ++i) {
+            s->records[i].next = free_records;
+            free_records = &s->records[i];
+        }
+    }
+    p = free_records;
+    free_records = p->next;
+    memset(p, 0, sizeof(process));
+    return p;
+}
+
+/**
+ * @brief give a record back to the free list.
+ * @param p a record that is not in the table.
+ */
+void job_release(process *p) {
+    p->next = free_records;
+    free_records = p;
+}
+
+/**
+ * @brief add a record to the table. Its pid must be set.
+ * @param p the record.
+ *
+ * The table is grown to keep its load factor under 1/2.
+ */
+void job_insert(process *p) {
+    if ((table_used + 1) * 2 > table_size) {
+        grow_table();
+    }
+    table[find_slot(p->pid)] = p;
+    table_used++;
+
+    p->next = NULL;
+    p->prev = newest;
+    if (newest) {
+        newest->next = p;
+    } else {
+        oldest = p;
+    }
+    newest = p;
+}
+
+/**
+ * @brief find the record of a process.
+ * @param pid the process ID.
+ * @returns the record, NULL if no process with the given id is in the table.
+ */
+process *job_find(pid_t pid) {
+    size_t i;
+    if (table_used == 0) {
+        return NULL;
+    }
+    i = find_slot(pid);
+    return table[i];
+}
+
+/**
+ * @brief Removes the record of a process with a specific id from the table.
+ * @param id_to_match the id to search for.
+ * @returns a pointer to the process that matches the given id.
+ * @returns NULL if no process with the given id is found.
+ *
+ * The entries after the freed slot are shifted back so the table needs no tombstones.
+ * The record is not released, the caller decides when it can be reused.
+ */
+process *pop_from_pid(pid_t id_to_match) {
+    process *p;
+    size_t i, j, k;
+
+    if (table_used == 0) {
+        return NULL;
+    }
+    i = find_slot(id_to_match);
+    if ((p = table[i]) == NULL) {
+        return NULL;
+    }
+    table[i] = NULL;
+    table_used--;
+    for (j = (i + 1) & (table_size - 1); table[j]; j = (j + 1) & (table_size - 1)) {
+        k = home_slot(table[j]->pid);
+        /* move the entry back unless its home slot lies cyclically in (i, j] */
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        table[i] = table[j];
+        table[j] = NULL;
+        i = j;
+    }
+
+    /* unlink from the launch order list */
+    if (p->prev) {
+        p->prev->next = p->next;
+    } else {
+        oldest = p->next;
+    }
+    if (p->next) {
+        p->next->prev = p->prev;
+    } else {
+        newest = p->prev;
+    }
+    p->next = p->prev = NULL;
+    return p;
+}
+
+/**
+ * @brief the oldest live record, to iterate the table in launch order.
+ * @returns the record, NULL if the table is empty. Follow the \a next field for the rest.
+ */
+process *job_oldest() { return oldest; }
+
+/**
+ * @brief number of live records.
+ * @returns the number of processes in the table.
+ */
+size_t job_count() { return table_used; }
+
+/**
+ * @brief keep a completed background record until 'jobs' lists it.
+ * @param p the record, already removed from the table with pop_from_pid().
+ *
+ * The oldest finished record is released when the list is full.
+ */
+void job_finish(process *p) {
+    process *old;
+
+    if (finished_count == JOB_FINISHED_MAX) {
+        old = finished_oldest;
+        finished_oldest = old->next;
+        finished_oldest->prev = NULL;
+        job_release(old);
+        finished_count--;
+    }
+    p->next = NULL;
+    p->prev = finished_newest;
+    if (finished_newest) {
+        finished_newest->next = p;
+    } else {
+        finished_oldest = p;
+    }
+    finished_newest = p;
+    finished_count++;
+}
+
+/**
+ * @brief the oldest completed background record that was not listed yet.
+ * @returns the record, NULL if there is none. Follow the \a next field for the rest.
+ */
+process *job_finished_oldest() { return finished_oldest; }
+
+/**
+ * @brief release all completed background records, once they were listed.
+ */
+void job_finished_clear() {
+    process *p;
+    while ((p = finished_oldest) != NULL) {
+        finished_oldest = p->next;
+        job_release(p);
+    }
+    finished_newest = NULL;
+    finished_count = 0;
+}
+
+/**
+ * @brief number of background pipelines that are running.
+ * @returns the number of process groups with a live background record.
+ *
+ * The processes of a pipeline are launched one after the other, so its records are neighbours in
+ * the launch order list and each group is counted once.
+ */
+size_t job_bg_running() {
+    process *p;
+    pid_t last = 0;
+    size_t n = 0;
+
+    for (p = oldest; p != NULL; p = p->next) {
+        if (p->bg && p->pgid != last) {
+            last = p->pgid;
+            n++;
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief append a background pipeline to the queue.
+ * @param pl the pipeline. Its vectors and strings usually live in line_arena, so all of them are
+ * copied into one block that belongs to the queue.
+ * @returns the queue entry.
+ */
+queued_job *job_queue_push(const pipeline *pl) {
+    int n = pl->stages + pl->consumers;
+    size_t size = sizeof(queued_job) + n * (sizeof(char **) + sizeof(int));
+    queued_job *q;
+    char **words;
+    char *text;
+    int i, j;
+
+    for (i = 0; i < n; ++i) {
+        size += (pl->argc[i] + 1) * sizeof(char *);
+        for (j = 0; j < pl->argc[i]; ++j) {
+            size += strlen(pl->argv[i][j]) + 1;
+        }
+    }
+    /* pointers first, then the counts, then the characters: every part stays aligned */
+    q = malloc(size);
+    q->pl = *pl;
+    q->pl.argv = (char ***)(q + 1);
+    words = (char **)(q->pl.argv + n);
+    for (i = 0; i < n; ++i) {
+        q->pl.argv[i] = words;
+        words += pl->argc[i] + 1;
+    }
+    q->pl.argc = (int *)words;
+    text = (char *)(q->pl.argc + n);
+    for (i = 0; i < n; ++i) {
+        q->pl.argc[i] = pl->argc[i];
+        for (j = 0; j < pl->argc[i]; ++j) {
+            q->pl.argv[i][j] = text;
+            text = stpcpy(text, pl->argv[i][j]) + 1;
+        }
+        q->pl.argv[i][j] = NULL;
+    }
+
+    q->id = queue_next_id++;
+    q->next = NULL;
+    if (queue_newest) {
+        queue_newest->next = q;
+    } else {
+        queue_oldest = q;
+    }
+    queue_newest = q;
+    queue_length++;
+    return q;
+}
+
+/**
+ * @brief the oldest queued pipeline.
+ * @returns the entry, NULL if the queue is empty. Follow the \a next field for the rest.
+ */
+queued_job *job_queue_oldest() { return queue_oldest; }
+
+/**
+ * @brief remove the oldest queued pipeline.
+ * @returns the entry, NULL if the queue is empty. The caller frees it with free().
+ */
+queued_job *job_queue_pop() {
+    queued_job *q = queue_oldest;
+    if (q) {
+        if ((queue_oldest = q->next) == NULL)
+            queue_newest = NULL;
+        queue_length--;
+    }
+    return q;
+}
+
+/**
+ * @brief number of queued pipelines.
+ * @returns the length of the queue.
+ */
+size_t job_queue_length() { return queue_length; }
+
+/**
+ * @brief seconds between two times.
+ * @param from the earlier time.
+ * @param to the later time.
+ * @returns \a to - \a from in seconds.
+ */
+static double elapsed(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief seconds of a timeval.
+ * @param tv the timeval.
+ * @returns the time in seconds.
+ */
+static double seconds(const struct timeval *tv) { return tv->tv_sec + tv->tv_usec / 1e6; }
+
+/**
+ * @brief read the resources used so far by a running process from /proc.
+ * @param pid the process ID.
+ * @param s where the CPU times, max RSS and context switches are stored. Left as they are if
+ * the process is gone.
+ */
+static void read_proc_stats(pid_t pid, job_stats *s) {
+    char path[sizeof("/proc//status") + MAX_PID_LENGTH];
+    char line[256];
+    unsigned long utime, stime;
+    char *p;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if ((f = fopen(path, "r")) != NULL) {
+        /* the command name may hold spaces and ')', the fields start after its last ')' */
+        if (fgets(line, sizeof(line), f) && (p = strrchr(line, ')')) != NULL &&
+            sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2) {
+            s->user = (double)utime / sysconf(_SC_CLK_TCK);
+            s->sys = (double)stime / sysconf(_SC_CLK_TCK);
+        }
+        fclose(f);
+    }
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    if ((f = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), f)) {
+            /* a line matches at most one of the patterns, the others leave the fields alone */
+            sscanf(line, "VmHWM: %ld", &s->maxrss);
+            sscanf(line, "voluntary_ctxt_switches: %ld", &s->nvcsw);
+            sscanf(line, "nonvoluntary_ctxt_switches: %ld", &s->nivcsw);
+        }
+        fclose(f);
+    }
+}
+
+/**
+ * @brief the resources used by a process.
+ * @param p the record.
+ * @param s the result.
+ *
+ * A completed process reports what wait4() returned. A running process reports the time since
+ * it was launched and what /proc knows about it so far.
+ */
+void job_stats_of(const process *p, job_stats *s) {
+    struct timespec now;
+
+    memset(s, 0, sizeof(job_stats));
+    if (p->completed) {
+        s->wall = elapsed(&p->start, &p->end);
+        s->user = seconds(&p->usage.ru_utime);
+        s->sys = seconds(&p->usage.ru_stime);
+        s->maxrss = p->usage.ru_maxrss;
+        s->nvcsw = p->usage.ru_nvcsw;
+        s->nivcsw = p->usage.ru_nivcsw;
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        s->wall = elapsed(&p->start, &now);
+        read_proc_stats(p->pid, s);
+    }
+}
+
+/**
+ * @brief add the resources of one process to the total of a pipeline.
+ * @param total the total. Its wall time is the longest wall time, its max RSS the largest one.
+ * @param s the resources of the process.
+ */
+void job_stats_add(job_stats *total, const job_stats *s) {
+    if (s->wall > total->wall)
+        total->wall = s->wall;
+    if (s->maxrss > total->maxrss)
+        total->maxrss = s->maxrss;
+    total->user += s->user;
+    total->sys += s->sys;
+    total->nvcsw += s->nvcsw;
+    total->nivcsw += s->nivcsw;
+}
+
+/**
+ * @brief print resources on one line, without a newline.
+ * @param f the stream.
+ * @param s the resources.
+ */
+void job_stats_print(FILE *f, const job_stats *s) {
+    fprintf(f, "real %.3fs user %.3fs sys %.3fs maxrss %ldKB csw %ld/%ld", s->wall, s->user, s->sys, s->maxrss,
+            s->nvcsw, s->nivcsw);
+}
+
+/**
+ * @brief free all memory allocated by the job table.
+ *
+ * usually called by shell_exit(). Every record lives in a slab, so freeing the slabs and the
+ * hash table is enough.
+ */
+void free_all() {
+    job_slab *s;
+    while ((s = slabs) != NULL) {
+        slabs = s->next;
+        free(s);
+    }
+    free(table);
+    table = NULL;
+    table_size = table_used = 0;
+    free_records = oldest = newest = NULL;
+    finished_oldest = finished_newest = NULL;
+    finished_count = 0;
+    while (queue_oldest) {
+        free(job_queue_pop());
+    }
+}
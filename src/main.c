@@ -1,16 +1,17 @@
 /** \file main.c
 * \brief the main program.
 *
-* contains the main loop in main() and important functions related to input,
-* handling processes and signals.
+* contains the main loop in main() and the functions related to input. Signals and
+* children are handled in signals.c.
 */
 
 #include <errno.h>
-#include <pwd.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -19,445 +20,240 @@
 #include <readline/history.h>
 #include <readline/readline.h>
 
-/** Sets to True if a user uses ctrl-c (interruption / escape) while typing.
- *  Once set the main loop will skip the current line, free it and reset the prompt.
- *  Default value is False and it is reset at every loop. */
-int interrupt_called = 0;
-
-/** pointer to the current process struct */
-process *current;
-
-/**
- * @brief Get the current workind directory.
- * @returns a char* with the current working directory malloced for a length of PATH_MAX.
- * @returns NULL on failure.
- */
-char *shell_get_cwd() {
-    char *cwd = malloc(PATH_MAX * sizeof(char));
-    if (getcwd(cwd, PATH_MAX * sizeof(char)))
-        return cwd;
-    else {
-        perror("cwd");
-        return NULL;
-    }
-}
-
-/**
- * @brief Get the current hostname.
- * @returns a char* with the current hostname malloced for HOST_NAME_MAX bytes.
- * @returns NULL on failure.
- */
-char *shell_get_host() {
-    char *hostname = malloc(HOST_NAME_MAX);
-    if (gethostname(hostname, HOST_NAME_MAX) == 0)
-        return hostname;
-    else {
-        perror("gethostname");
-        return NULL;
-    }
-}
-
-/**
- * @brief Get the current username.
- * @returns a char* with the current username.
- * @returns NULL on failure.
- *
- * Uses the getpwuid() function that returns a pointer to a structure containing the info that interest us.
- * No need to free anything returned by this function.
- */
-char *shell_get_user() {
-    struct passwd *p = getpwuid(getuid());
-    if (!p) {
-        perror("getuid");
-        return NULL;
-    } else
-        return p->pw_name;
-}
-
 /**
- * @brief Build the prompt message on a buffer.
- * @param buffer the buffer where the output is stored.
+ * @brief free memory of line.
+ * @param line Pointer to the line string that needs to be freed.
  */
-void create_prompt_message(char **buffer) {
-    size_t needed;
-    char *host;
-    char *user;
-    char *cwd;
-
-    /* get the strings we need using the shell_get*() functions */
-    user = shell_get_user();
-    host = shell_get_host();
-    cwd = shell_get_cwd();
-    /* calculate the bytes we need to allocate using snprintf. */
-    needed = snprintf(NULL, 0, "%s@%s:%s$ ", user, host, cwd);
-    *buffer = realloc(*buffer, needed + 1);
-    sprintf(*buffer, "%s@%s:%s$ ", user, host, cwd);
-
-    /* free host and cwd.
-     * No need to free anything from the structure returned by getpwuid() (used by shell_get_user()). */
-    free(host);
-    free(cwd);
+void continue_clear(char **line) {
+    free(*line);
+    *line = NULL;
 }
 
 /**
- * @brief Handles interrupts (e.g. ctrl-c) that happen while the main process is running without a foreground process
- * active.
+ * @brief Print the welcoming message.
  */
-void interrupt_handle() {
+void welcoming_message() {
+    printf("\n");
+    printf("------------------------------------\n");
+    printf("Aristotle University of Thessaloniki\n");
+    printf("School of Electrical and Computer Engineering\n");
+    printf("\n");
+    printf("Creating a Unix shell assignment for \"Operating Systems\" course (7th semester)\n");
+    printf("Creator: Orestis Floros-Malivitsis\n");
+    printf("----------------------------------\n");
+    printf("Ctrl-D or 'exit' to exit\n");
+    printf("Type 'help [cmd]' for help on a specific command\n");
+    printf("Type 'help' for a list of all available commands\n");
+    printf("\n");
+    printf("This shell uses by default a history log located at $HOME/.history\n");
+    printf("Use the UP/DOWN arrow keys to navigate through history\n");
+    printf("Press TAB to complete command names, or the pids of jobs after kill\n");
+    printf("Type hoff if you want to disable the history log file\n");
+    printf("Type hon if you want to reenable the history log file\n");
+    printf("Type pdead [on|off] to enable/disable printing the status of foreground processes on their death (always "
+           "on for background processes)\n");
+    printf("----------------------------------------------------\n");
     printf("\n");
-    fflush(stdin);
-    fflush(stdout);
-    /* set global variable to True because this function is called on interruption signals */
-    interrupt_called = 1;
 }
 
-/** the prompt shown when the user is asked to confirm the process kill */
-#define KILL_MSG "terminate foreground process with pid %d? (Y/N/a - always)\n"
-
-/** if false the active process is always killed when ctrl-c is pressed */
-int ask_to_kill = 1;
-
 /**
- * @brief Handles interrupts (e.g. ctrl-c) that happen while the main process is running with a foreground process
- * active.
- *
- * asks the user to confirm killing the foreground process. If \a ask_to_kill is set to false, the foreground process is
- * always killed.
+ * @brief print the command line usage of the shell.
+ * @param name the name the shell was called with.
  */
-void killer_interrupt_handle() {
-    char *line;
-    char msg[sizeof(KILL_MSG) + MAX_PID_LENGTH];
-    int no_kill = 1;
-    while (ask_to_kill && no_kill) {
-        sprintf(msg, KILL_MSG, current->pid);
-        line = readline(msg);
-        if (line == NULL)
-            continue;
-        else if (strcasecmp(line, "y") == 0)
-            no_kill = 0;
-        else if (strcasecmp(line, "n") == 0)
-            return;
-        else if (strcasecmp(line, "a") == 0)
-            ask_to_kill = no_kill = 0;
-        else
-            printf("wrong option\n");
-    }
-    if (current->completed) {
-        printf("process already dead\n");
-    } else
-        kill(current->pid, SIGTERM);
+void print_usage(const char *name) {
+    fprintf(stderr, "usage: %s [-e spawn|vfork|fork] [-c command | script]\n", name);
+    fprintf(stderr, "  -e engine  how child processes are launched (default: spawn)\n");
+    fprintf(stderr, "  -c command run the given command lines and exit\n");
+    fprintf(stderr, "  script     run the lines of the script file and exit\n");
+    fprintf(stderr, "Without -c or a script, lines are read from stdin. readline is only used if it is a terminal.\n");
 }
 
-/**
- * @brief Sets the behavior for some interrupting signals.
- * @param handler_code set to SET_DFL or SET_IGN.
- */
-void mass_signal_set(int handler_code) {
-    switch (handler_code) {
-        /* default behavior */
-        case SET_DFL:
-            signal(SIGINT, SIG_DFL);
-            signal(SIGQUIT, SIG_DFL);
-            signal(SIGTSTP, SIG_DFL);
-            signal(SIGTTIN, SIG_DFL);
-            signal(SIGTTOU, SIG_DFL);
-        case SET_IGN:
-            signal(SIGINT, interrupt_handle);
-            signal(SIGQUIT, SIG_IGN);
-            signal(SIGTSTP, SIG_IGN);
-            signal(SIGTTIN, SIG_IGN);
-            signal(SIGTTOU, SIG_IGN);
-    }
-}
+/** the argument of the -c option, NULL if not given. */
+char *command_string = NULL;
+
+/** the script file given after the options, NULL if not given. */
+char *script_path = NULL;
 
 /**
- * @brief check if the command inputed by the user must be run in the bacground.
- * @param s is the string that is searched.
- * @returns the position of the ampersand if found.
- * @returns -1 if not found.
+ * @brief parse the command line options of the shell.
+ * @param argc argument count of main().
+ * @param argv argument vector of main().
  *
- * Search for an ampersand ('&') in the string \a s passed as an argument.
- * If such a character is found replace it with the '\0' character.
+ * Exits on invalid options.
  */
-int check_background(char *s) {
-    /* if the last char is an ampersand replace it with '\0' */
-    int i = 0;
-    while (1) {
-        if (s[i] == '\0')
-            return -1;
-        else if (s[i] == '&') {
-            s[i] = 0;
-            return i;
+void parse_options(int argc, char *argv[]) {
+    int opt;
+    /* '+': stop at the script name, whatever follows belongs to the script */
+    while ((opt = getopt(argc, argv, "+c:e:h")) != -1) {
+        switch (opt) {
+            case 'c':
+                command_string = optarg;
+                break;
+            case 'e':
+                if (set_spawn_engine(optarg) == -1) {
+                    fprintf(stderr, "%s: unknown engine '%s'\n", argv[0], optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
         }
-        i++;
+    }
+    if (command_string == NULL && optind < argc) {
+        script_path = argv[optind];
     }
 }
 
 /**
- * @brief Tries to find a process in the linked list with a specific id.
- * @param id_to_match the id to search for.
- * @returns a pointer to the process that matches the given id.
- * @returns NULL if no process with the given id is found.
+ * @brief readline callback, called with every complete line.
+ * @param line the line typed by the user, NULL on EOF. Must be freed.
  *
- * Pointer p iterates throughout the linked list.
- * Once it finds the target the previous process is linked with the next.
+ * The callback handler is removed while the line runs, so the terminal is left alone for the
+ * foreground process, and installed again with a fresh prompt afterwards.
  */
-process *pop_from_pid(pid_t id_to_match) {
-    process *p;        /* Pointer that will iterate throughout the linked list */
-    process *previous; /* Pointer to the process behind p */
-
-    /* start with the head */
-    previous = head;
-    if (head->pid == id_to_match) {
-        /* The head process (1st element in the linked list) has the targeted id.
-         * The next process now becomes the head. */
-        head = head->next;
-        return previous;
+void line_handler(char *line) {
+    const char *prompt;
+
+    rl_callback_handler_remove();
+    readline_active = 0;
+
+    if (line == NULL && block_open()) {
+        /* ctrl-d inside a block: it is incomplete */
+        printf("\n");
+        run_input("", 0);
+    } else if (line == NULL) {
+        printf("\n");
+        call_builtin(EXIT_CMD, 1, NULL); /*ctrl-d <=> EOT etc... */
     }
-
-    for (p = head->next; p != NULL; previous = p, p = p->next) {
-        if (p->pid == id_to_match) {
-            previous->next = p->next;
-            return p;
-        }
+    ALLOC_COUNT_START();
+    if (line && strcmp(line, "") != 0) {
+        add_history(line);
+        ALLOC_COUNT_START(); /* the history entry belongs to readline */
+        hlog_append(line);
+        run_input(line, 1);
     }
-    return NULL;
+    /* else: empty line. User just pressed 'enter' (?) */
+    continue_clear(&line);
+
+    /* the lines of an open block get the continuation prompt */
+    prompt = block_open() ? "> " : create_prompt_message();
+    ALLOC_COUNT_REPORT();
+    rl_callback_handler_install(prompt, line_handler);
+    readline_active = 1;
 }
 
-/*! If True all processes that die are printed (not only bg). */
-int always_print_dead = 0;
-
 /**
- * @brief handle dead processes.
+ * @brief run lines from a script, a '-c' string or piped input until the end, then exit.
+ * @param r the reader the lines come from.
  *
- * This handler is called once a child process that was running in the background dies.
- * It will only find and mark as complete one process from the linked list.
+ * No prompt, welcoming message or history. Background children that died meanwhile are
+ * harvested before each line. At the end the shell waits until every queued background pipeline
+ * has started, like the running ones they are not waited for.
  */
-void harvest_dead_child() {
-    process *p;
-    pid_t target_id;
-    int status;
+void run_noninteractive(line_reader *r) {
+    struct pollfd pfd;
+    char *line;
 
-    /* waitpid() will find the process that exited. */
-    while ((target_id = waitpid(-1, &status, WNOHANG)) < 0) {
+    while (!script_interrupted && (line = reader_next_line(r)) != NULL) {
+        handle_signals(0);
+        ALLOC_COUNT_START();
+        run_input(line, 1);
+        ALLOC_COUNT_REPORT();
     }
-    if (WIFSIGNALED(status)) {
-        /* child process was terminated by a signal
-         * print to stderr the termination signal message */
-        char msg[SIGNAL_MSG_LENGTH];
-        sprintf(msg, "[%d] exited with status %d", target_id, status);
-        psignal(WTERMSIG(status), msg);
-    } else if (always_print_dead)
-        printf("[%d] exited with status %d\n", target_id, status);
-
-    if ((p = pop_from_pid(target_id)) == NULL)
-        fprintf(stderr, "ERROR: terminated child not found in process linked list\n");
-    else {
-        p->completed = 1;
-        p->status = status;
-        if (p->bg) {
-            free(p); /* don't free fg processes, main() does it. */
-            if (!always_print_dead && !WIFSIGNALED(status)) {
-                printf("[%d] exited with status %d\n", target_id, status);
-            }
-            /* reset the display once printing is done. */
-            rl_forced_update_display();
-        }
+    if (block_open() && !script_interrupted) {
+        run_input("", 0);
     }
-}
-
-/**
- * @brief parses the PATH environmental variable. Currently useless.
- */
-void parse_path() {
-    char *path_variable;
-    char *r;
-    char **paths = NULL;
-    int path_count = 0;
-
-    r = malloc(PATH_MAX * sizeof(char));
-    path_variable = malloc(PATH_MAX * sizeof(char));
-
-    strcpy(path_variable, getenv("PATH"));
-    while ((r = strtok(path_count ? NULL : path_variable, ":")) != NULL) {
-        paths = (char **)realloc(paths, (path_count + 1) * sizeof(char *));
-        paths[path_count++] = r;
+    reader_close(r);
+    pfd.fd = signal_fd;
+    pfd.events = POLLIN;
+    /* queued background pipelines were accepted, they start before the shell leaves */
+    while (!script_interrupted && job_queue_length() > 0) {
+        if (poll(&pfd, 1, -1) > 0)
+            handle_signals(0);
     }
-
-    /* do stuff with path or return it */
-    while (path_count--)
-        free(paths[path_count]);
-    free(r);
-    free(path_variable);
-}
-
-/**
- * @brief free memory of line and reset some flags.
- * @param line Pointer to the line string that needs to be freed.
- */
-void continue_clear(char **line) {
-    interrupt_called = 0;
-    free(*line);
-    *line = NULL;
-}
-
-/**
- * @brief Print the welcoming message.
- */
-void welcoming_message() {
-    printf("\n");
-    printf("------------------------------------\n");
-    printf("Aristotle University of Thessaloniki\n");
-    printf("School of Electrical and Computer Engineering\n");
-    printf("\n");
-    printf("Creating a Unix shell assignment for \"Operating Systems\" course (7th semester)\n");
-    printf("Creator: Orestis Floros-Malivitsis\n");
-    printf("----------------------------------\n");
-    printf("Ctrl-D or 'exit' to exit\n");
-    printf("Type 'help [cmd]' for help on a specific command\n");
-    printf("Type 'help' for a list of all available commands\n");
-    printf("\n");
-    printf("This shell uses by default a history log located at $HOME/.history\n");
-    printf("Use the UP/DOWN arrow keys to navigate through history\n");
-    printf("Type hoff if you want to disable the history log file\n");
-    printf("Type hon if you want to reenable the history log file\n");
-    printf("Type pdead [on|off] to enable/disable printing the status of foreground processes on their death (always "
-           "on for background processes)\n");
-    printf("----------------------------------------------------\n");
-    printf("\n");
+    shell_quit(script_interrupted ? 128 + SIGINT : WIFSIGNALED(last_status) ? 128 + WTERMSIG(last_status)
+                                                                             : WEXITSTATUS(last_status));
 }
 
 /**
  * @brief main function containing the main loop.
  * @returns when 1==False...
  *
- * contains the main loop, initializes head, passes arguments to new processes,
- * handles signals, asks for user input through the readline library,
- * keep history, parses user input, splits it with strtok(),
- * checks for builtin commands, forks and handles processes.
+ * contains the event loop. It waits with poll() on the terminal and on signal_fd, feeds
+ * typed characters to readline through its callback interface and handles signals. Whole
+ * lines are passed to run_input() by line_handler(). While nothing waits, the history is
+ * indexed for search a step at a time.
  */
-int main(/*int argc, char *argv[]*/) {
-    pid_t pid;        /* pid value used in fork() */
-    char *line;       /* the current line read */
-    int builtin_code; /* used when a builtin command is detected */
-    int argc = 0;     /* number of args, strtok found */
-    /* argv is an array of strings where the args from strtok are passed.
-     * we don't need to call free() on argv array elements. */
-    char *argv[ARGS_ARRAY_LEN];
-    int run_background; /* flag set to True when the command needs to be run at the background */
-    sigset_t mask;      /* signal mask used by sigsupsend() */
-    char *prompt_buffer = NULL;
-
-    /* initialize the new signal mask */
-    sigemptyset(&mask);
-    sigdelset(&mask, SIGCHLD);
+int main(int main_argc, char *main_argv[]) {
+    struct pollfd fds[2];
+    line_reader reader;
+    int ready;
+
+    parse_options(main_argc, main_argv);
+    vars_init();
+
+    setup_signals();
+
+    if (command_string || script_path || !isatty(STDIN_FILENO)) {
+        interactive = 0;
+        save_history_to_file = 0;
+        if (command_string) {
+            reader_open_string(&reader, command_string);
+        } else if (script_path) {
+            int fd = open(script_path, O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                perror(script_path);
+                exit(127);
+            }
+            reader_open_fd(&reader, fd);
+        } else {
+            reader_open_fd(&reader, STDIN_FILENO);
+        }
+        run_noninteractive(&reader);
+    }
 
     /* welcoming message */
     welcoming_message();
 
-    /* master process entry */
-    head = malloc(sizeof(process));
-    head->pid = 0;
-    head->next = NULL;
-    current = head;
+    /* signals are read from signal_fd, readline must not install its own handlers */
+    rl_catch_signals = 0;
 
-    /* handle child death */
-    signal(SIGCHLD, harvest_dead_child);
-    rl_getc_function = getc;
+    if (save_history_to_file && hlog_open() == -1) {
+        save_history_to_file = 0;
+    }
+    rl_bind_keyseq("\\C-r", histsearch_key);
+    completion_init();
 
-    read_history(NULL);
+    rl_callback_handler_install(create_prompt_message(), line_handler);
+    readline_active = 1;
 
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = signal_fd;
+    fds[1].events = POLLIN;
     while (1) {
-        /* Shell shouldn't terminate on signals */
-        mass_signal_set(SET_IGN);
-
-        create_prompt_message(&prompt_buffer);
-        line = readline(prompt_buffer);
-        if (line == NULL) {
-            if (!interrupt_called)
-                call_builtin(EXIT_CMD, 1, NULL); /*ctrl-d <=> EOT etc... */
-        } else if (strcmp(line, "") == 0) {
-            /* empty line. User just pressed 'enter' (?) */
-            continue_clear(&line);
-            continue;
-        }
-
-        if (interrupt_called) {
-            /* happens on ctrl-c / interruption. Skip the whole line and don't add it in history log. */
-            continue_clear(&line);
+        /* the history is indexed for search while nothing else waits */
+        ready = poll(fds, 2, histsearch_pending() ? 0 : -1);
+        if (ready == -1) {
+            if (errno != EINTR) {
+                perror("poll");
+                exit(EXIT_FAILURE);
+            }
             continue;
-        } else
-            add_history(line);
-
-        /* check if process should be run in the background before we edit 'line' *
-         * run_background holds the value of check_background(). */
-        if ((run_background = check_background(line)) == -1) {
-            /* not a background_process set the flag to zero.*/
-            run_background = 0;
-        } else {
-            run_background = 1; /* just set to True and use as a flag from now on */
-        }
-
-        argc = 0;
-        /* WARNING! strtok modifies the initial string */
-        /* " \n" is the delimiter. Split the string on ' ' and '\n' although readline() does not include '\n' */
-        argv[argc++] = strtok(
-                line, " \n"); /* line must be used as an argument for strtok(), then passing NULL uses line again */
-        while ((argv[argc++] = strtok(NULL, " \n")) && argc <= MAX_ARGS) {
-            /* Splitting stops once the max number of arguments is reached or once strtok() returns NULL */
         }
-
-        /* check if command is a builtin
-         * argv[0] currently holds the 'main' command */
-        if ((builtin_code = check_if_builtin(argv[0])) >= 0) {
-            if (run_background)
-                fprintf(stderr, "WARNING: builtin commands cannot be run in the background! Ignoring...\n");
-            call_builtin(builtin_code, argc - 1, argv);
-            continue_clear(&line);
+        if (ready == 0) {
+            histsearch_step();
             continue;
         }
-
-        /* allocate space for a new process struct. */
-        current = malloc(sizeof(process));
-        current->completed = 0;
-        current->bg = run_background;
-        current->next = head;
-        head = current;
-
-        pid = current->pid = fork();
-        if (pid == -1) {
-            perror("fork");
-            exit(1);
-        } else if (pid == 0) {
-            /* child */
-            mass_signal_set(SET_DFL);
-            if (execvp(argv[0], argv) < 0) {
-                /* execv returns error */
-                perror(argv[0]);
-                _exit(EXIT_FAILURE); /* exec shouldn't return */
-            }
-        } else {
-            /* parent */
-            setpgid(pid, pid);
-            if (!run_background) {
-                /* foreground process, handle child death */
-                /* This is NOT a race condition:
-                 * if the child process dies before this point of the code is reached,
-                 * current->complete is already TRUE because harvest_dead_child() has already been called and the while
-                 * loop is never executed */
-                signal(SIGINT, killer_interrupt_handle);
-                while (!(current->completed)) {
-                    /* suspends until SIGCHLD signal is received
-                     * but does not block the signal, so the handler is executed normally
-                     * sigsupsend() always returns -1 */
-                    sigsuspend(&mask);
-                }
-                free(current); /* free the finished process. bg processes are freed by harvest_dead_child() */
-            } else {
-                printf("[%d] started\n", pid);
-            }
-        }
-        continue_clear(&line);
+        if (fds[1].revents & POLLIN)
+            handle_signals(0);
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+            rl_callback_read_char();
     }
     return -1;
 }
@@ -0,0 +1,546 @@
+/** \file parallel.c
+* \brief the parallel builtin: run a command once per input, a bounded number at a time.
+*
+* 'parallel -j N cmd {} ::: a b c' runs 'cmd a', 'cmd b' and 'cmd c' with at most N of them
+* alive at once. Without ':::' the inputs are the lines of stdin. A finished job is reaped by
+* harvest_dead_child() like any other child, and its slot is refilled at once.
+*
+* The stdout of every job goes to a memfd. Outputs are written to the real stdout whole and
+* in input order, as soon as all jobs before them are done, so the output of two jobs never
+* mixes. stderr is not captured.
+*
+* 'batch cmd arg...' uses the same machinery to run cmd over its arguments in as few execs as
+* the ARG_MAX of the kernel allows, like xargs. With 'autobatch on' the parser rewrites a command
+* whose expanded patterns would make exec fail with E2BIG into a batch command.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/** True if commands too long for exec because of expanded patterns are run with 'batch'. */
+int batch_auto = 0;
+
+/**
+ * @brief one input of the parallel builtin.
+ */
+typedef struct parallel_job {
+    char *input;   /**< the input, substituted for '{}'. Lives in line_arena. */
+    int output;    /**< memfd holding the stdout of the job, -1 if not captured. */
+    process *proc; /**< the record of the running job, NULL before launch and after it is done. */
+    int status;    /**< the exit status, in the format of waitpid(). */
+    int done;      /**< True once the job exited, or could not be launched. */
+} parallel_job;
+
+/**
+ * @brief the state of one parallel run.
+ */
+typedef struct parallel_run {
+    const char *name;    /**< name of the builtin, used in messages. */
+    char **tmpl;         /**< the command template, NULL terminated. */
+    int tmpl_argc;       /**< number of words in \a tmpl. */
+    int has_braces;      /**< True if a word of \a tmpl contains '{}'. Else the input is appended. */
+    char **inputs;       /**< the inputs after ':::', NULL to read stdin. */
+    size_t batch_room;   /**< bytes of arguments a batch may add to \a tmpl, 0 for one job per input. */
+    line_reader *reader; /**< the reader of stdin when \a inputs is NULL. */
+    parallel_job *jobs;  /**< all jobs so far, in input order. */
+    int count;           /**< number of jobs in \a jobs. */
+    int cap;             /**< capacity of \a jobs. */
+    int running;         /**< jobs alive right now. */
+    int flushed;         /**< jobs whose output is written. */
+    int failed;          /**< jobs that did not exit with 0. */
+    int worst;           /**< the highest exit code of the jobs, 128 + the signal for a killed one. */
+    pid_t pgid;          /**< process group for all jobs, 0 to give each its own. */
+} parallel_run;
+
+/**
+ * @brief substitute every '{}' of a word with the input.
+ * @param word the template word.
+ * @param input the input.
+ * @returns \a word itself if it has no '{}', else a new string in line_arena.
+ */
+static char *substitute(char *word, const char *input) {
+    size_t in_len = strlen(input);
+    size_t n = 0;
+    const char *s;
+    char *result, *w;
+
+    for (s = word; (s = strstr(s, "{}")) != NULL; s += 2) {
+        n++;
+    }
+    if (n == 0) {
+        return word;
+    }
+    w = result = arena_alloc(&line_arena, strlen(word) + n * in_len - n * 2 + 1);
+    for (s = word; *s;) {
+        if (s[0] == '{' && s[1] == '}') {
+            memcpy(w, input, in_len);
+            w += in_len;
+            s += 2;
+        } else {
+            *w++ = *s++;
+        }
+    }
+    *w = '\0';
+    return result;
+}
+
+/**
+ * @brief get the next input.
+ * @param r the run.
+ * @returns the input, NULL when there are no more.
+ */
+static char *next_input(parallel_run *r) {
+    char *line;
+
+    if (r->inputs) {
+        return *r->inputs ? *r->inputs++ : NULL;
+    }
+    if ((line = reader_next_line(r->reader)) == NULL) {
+        return NULL;
+    }
+    /* the line is only valid until the next read */
+    return arena_strdup(&line_arena, line);
+}
+
+/**
+ * @brief the bytes an argument takes in the argument area of exec.
+ * @param s the argument.
+ * @returns its length with the terminator, plus its pointer.
+ */
+static size_t arg_size(const char *s) { return strlen(s) + 1 + sizeof(char *); }
+
+/**
+ * @brief the bytes of the argument area of exec a command takes.
+ * @param argv the arguments.
+ * @param argc number of arguments.
+ * @returns the sum of arg_size() of the arguments.
+ */
+size_t exec_args_size(char **argv, int argc) {
+    size_t size = 0;
+    int i;
+    for (i = 0; i < argc; ++i) {
+        size += arg_size(argv[i]);
+    }
+    return size;
+}
+
+/**
+ * @brief the bytes of the argument area of exec left for the arguments.
+ * @returns sysconf(_SC_ARG_MAX), at most BATCH_ARG_MAX, minus the environment and BATCH_HEADROOM.
+ */
+size_t exec_args_limit() {
+    long arg_max = sysconf(_SC_ARG_MAX);
+    size_t limit = arg_max <= 0 || arg_max > BATCH_ARG_MAX ? BATCH_ARG_MAX : (size_t)arg_max;
+    size_t env = 0;
+    char **e;
+
+    for (e = vars_envp(); *e; ++e) {
+        env += arg_size(*e);
+    }
+    return limit > env + BATCH_HEADROOM ? limit - env - BATCH_HEADROOM : 0;
+}
+
+/**
+ * @brief take the arguments of the next batch.
+ * @param r the run.
+ * @param argc where the argument count of the batch command is stored.
+ * @returns the argument vector, template first, in line_arena. NULL when the inputs are exhausted.
+ *
+ * A batch takes at least one argument, even one that alone is too long: exec reports it then.
+ * Only the first batch may be empty.
+ */
+static char **next_batch(parallel_run *r, int *argc) {
+    size_t used = 0, size;
+    char **argv;
+    int n;
+
+    for (n = 0; r->inputs[n]; ++n) {
+        size = arg_size(r->inputs[n]);
+        if (n > 0 && used + size > r->batch_room)
+            break;
+        used += size;
+    }
+    /* without arguments the command still runs once, like with xargs */
+    if (n == 0 && r->count > 0) {
+        return NULL;
+    }
+    *argc = r->tmpl_argc + n;
+    argv = arena_alloc(&line_arena, (*argc + 1) * sizeof(char *));
+    memcpy(argv, r->tmpl, r->tmpl_argc * sizeof(char *));
+    memcpy(argv + r->tmpl_argc, r->inputs, n * sizeof(char *));
+    argv[*argc] = NULL;
+    r->inputs += n;
+    return argv;
+}
+
+/**
+ * @brief build the command of the next input.
+ * @param r the run.
+ * @param input where the input is stored.
+ * @param argc where the argument count is stored.
+ * @returns the argument vector in line_arena, NULL when the inputs are exhausted.
+ */
+static char **next_command(parallel_run *r, char **input, int *argc) {
+    char **argv;
+    int i;
+
+    if (r->batch_room) {
+        /* a batch is shown by its first argument */
+        argv = next_batch(r, argc);
+        *input = argv ? argv[argv[r->tmpl_argc] ? r->tmpl_argc : 0] : NULL;
+        return argv;
+    }
+    if ((*input = next_input(r)) == NULL) {
+        return NULL;
+    }
+    *argc = r->tmpl_argc + !r->has_braces;
+    argv = arena_alloc(&line_arena, (*argc + 1) * sizeof(char *));
+    for (i = 0; i < r->tmpl_argc; ++i) {
+        argv[i] = substitute(r->tmpl[i], *input);
+    }
+    if (!r->has_braces) {
+        argv[i] = *input;
+    }
+    argv[*argc] = NULL;
+    return argv;
+}
+
+/**
+ * @brief launch the job for the next input.
+ * @param r the run.
+ * @returns 1 if a job was added, 0 when the inputs are exhausted.
+ *
+ * A job that can not be launched is added as done and failed.
+ */
+static int launch_next(parallel_run *r) {
+    launch_spec spec;
+    parallel_job *j;
+    char **argv;
+    char *input;
+    int argc;
+    int n = 0;
+
+    if ((argv = next_command(r, &input, &argc)) == NULL) {
+        return 0;
+    }
+    if (r->count == r->cap) {
+        int c = r->cap ? r->cap * 2 : PARALLEL_JOBS_INITIAL_SIZE;
+        r->jobs = arena_grow(&line_arena, r->jobs, r->cap * sizeof(parallel_job), c * sizeof(parallel_job));
+        r->cap = c;
+    }
+    j = &r->jobs[r->count++];
+    j->input = input;
+    j->proc = NULL;
+    j->status = 0;
+    j->done = 0;
+
+    /* without a memfd, e.g. out of file descriptors, the output goes straight to stdout */
+    j->output = memfd_create("parallel", MFD_CLOEXEC);
+    launch_spec_init(&spec, argv);
+    spec.pgid = r->pgid;
+    spec.fd_out = j->output;
+    launch_one(&spec, argc, 0, &j->proc, &n);
+    if (n == 0) {
+        /* launch_one() printed the error */
+        j->status = W_EXITCODE(127, 0);
+        j->done = 1;
+        r->failed++;
+        r->worst = r->worst > 127 ? r->worst : 127;
+    } else {
+        r->running++;
+        current = j->proc;
+    }
+    return 1;
+}
+
+/**
+ * @brief copy captured output to stdout and close it.
+ * @param fd pointer to the memfd holding the output, -1 if nothing was captured. Set to -1.
+ */
+void write_captured(int *fd) {
+    char buffer[READ_BLOCK_SIZE];
+    off_t offset = 0;
+    off_t size;
+    ssize_t n;
+
+    if (*fd == -1) {
+        return;
+    }
+    size = lseek(*fd, 0, SEEK_END);
+    while (offset < size) {
+        if ((n = sendfile(STDOUT_FILENO, *fd, &offset, size - offset)) > 0)
+            continue;
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno == EINVAL) {
+            /* stdout does not take sendfile(), copy through user space */
+            while ((n = pread(*fd, buffer, sizeof(buffer), offset)) > 0 && write(STDOUT_FILENO, buffer, n) == n) {
+                offset += n;
+            }
+        }
+        break;
+    }
+    close(*fd);
+    *fd = -1;
+}
+
+/**
+ * @brief report the exit status of a failed job to stderr.
+ * @param r the run.
+ * @param index the position of the job in the input.
+ * @param j the job.
+ */
+static void report_failure(const parallel_run *r, int index, const parallel_job *j) {
+    if (WIFSIGNALED(j->status)) {
+        fprintf(stderr, "%s: job %d '%s' killed by signal %d\n", r->name, index + 1, j->input, WTERMSIG(j->status));
+    } else {
+        fprintf(stderr, "%s: job %d '%s' exited with status %d\n", r->name, index + 1, j->input,
+                WEXITSTATUS(j->status));
+    }
+}
+
+/**
+ * @brief collect the jobs that harvest_dead_child() marked completed and write the outputs that are next in order.
+ * @param r the run.
+ */
+static void collect(parallel_run *r) {
+    parallel_job *j;
+    int i, code;
+
+    for (i = r->flushed; i < r->count; ++i) {
+        j = &r->jobs[i];
+        if (j->proc && j->proc->completed) {
+            j->status = j->proc->status;
+            j->done = 1;
+            if (j->status != 0)
+                r->failed++;
+            code = WIFSIGNALED(j->status) ? 128 + WTERMSIG(j->status) : WEXITSTATUS(j->status);
+            r->worst = r->worst > code ? r->worst : code;
+            if (current == j->proc)
+                current = NULL;
+            job_release(j->proc);
+            j->proc = NULL;
+            r->running--;
+        }
+    }
+    /* ctrl-c names the process in current, it must be a job that still runs */
+    for (i = r->flushed; current == NULL && i < r->count; ++i) {
+        current = r->jobs[i].proc;
+    }
+    while (r->flushed < r->count && r->jobs[r->flushed].done) {
+        j = &r->jobs[r->flushed];
+        write_captured(&j->output);
+        if (j->status != 0)
+            report_failure(r, r->flushed, j);
+        r->flushed++;
+    }
+}
+
+/**
+ * @brief terminate all running jobs.
+ * @param r the run.
+ */
+static void kill_running(parallel_run *r) {
+    int i;
+    for (i = r->flushed; i < r->count; ++i) {
+        if (r->jobs[i].proc && !r->jobs[i].proc->completed)
+            kill(r->pgid ? r->jobs[i].proc->pid : -r->jobs[i].proc->pgid, SIGTERM);
+    }
+}
+
+/**
+ * @brief launch the jobs of a run, at most a number at a time, and write their outputs.
+ * @param r the run, with its template and inputs.
+ * @param max_jobs how many jobs may be alive at once.
+ * @returns 0 when all jobs are done, -1 if the run could not start, after printing why.
+ *
+ * Inside the shell every job gets its own process group and ctrl-c stops the whole run. As a
+ * pipeline stage the jobs join the group of the stage, so killing the pipeline kills them too.
+ */
+static int run_jobs(parallel_run *r, long max_jobs) {
+    struct pollfd pfd;
+    sigset_t chld, old_mask;
+    int stopped = 0;
+
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old_mask);
+    /* a pipeline stage reaps its own children. signal_fd of the shell was closed in the stage */
+    if (getpid() != shell_pid) {
+        r->pgid = getpgrp();
+        if (setup_child_signals() == -1)
+            return -1;
+    }
+
+    foreground_interrupted = 0;
+    pfd.fd = signal_fd;
+    pfd.events = POLLIN;
+    fflush(stdout);
+    while (1) {
+        while (!stopped && r->running < max_jobs && r->count - r->flushed < max_jobs + PARALLEL_BACKLOG &&
+               launch_next(r)) {
+        }
+        collect(r);
+        if (r->running == 0 && (stopped || r->count - r->flushed < max_jobs + PARALLEL_BACKLOG)) {
+            /* nothing runs and nothing more can be launched */
+            if (stopped || !launch_next(r))
+                break;
+            continue;
+        }
+        if (poll(&pfd, 1, -1) > 0) {
+            handle_signals(1);
+        }
+        if (!stopped && foreground_interrupted) {
+            stopped = 1;
+            kill_running(r);
+        }
+    }
+    fflush(stdout);
+
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    current = NULL;
+    if (r->failed) {
+        fprintf(stderr, "%s: %d of %d jobs failed\n", r->name, r->failed, r->count);
+    }
+    return 0;
+}
+
+/**
+ * @brief read the '-j N' option of parallel and batch.
+ * @param argc argument count.
+ * @param argv argument vector.
+ * @param max_jobs where N is stored, if given.
+ * @returns the index of the first argument after the option, -1 if N is invalid after printing it.
+ */
+static int jobs_option(int argc, char **argv, long *max_jobs) {
+    char *end;
+
+    if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+        *max_jobs = strtol(argv[2], &end, 10);
+        if (*end != '\0' || *max_jobs <= 0) {
+            fprintf(stderr, "%s: -j needs a positive number\n", argv[0]);
+            return -1;
+        }
+        return 3;
+    }
+    return 1;
+}
+
+/**
+ * @brief the parallel builtin.
+ * @param argc argument count.
+ * @param argv 'parallel [-j N] cmd [arg]... [::: input...]'.
+ *
+ * The exit status is the number of failed jobs, at most 101.
+ */
+void parallel_builtin(int argc, char **argv) {
+    parallel_run r;
+    line_reader reader;
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if ((i = jobs_option(argc, argv, &max_jobs)) == -1) {
+        last_status = W_EXITCODE(2, 0);
+        return;
+    }
+    memset(&r, 0, sizeof(r));
+    r.name = argv[0];
+    r.tmpl = argv + i;
+    for (; i < argc && strcmp(argv[i], ":::") != 0; ++i) {
+        r.has_braces |= strstr(argv[i], "{}") != NULL;
+    }
+    r.tmpl_argc = argv + i - r.tmpl;
+    if (r.tmpl_argc == 0) {
+        printf("%s: invalid usage\n", argv[0]);
+        last_status = W_EXITCODE(2, 0);
+        return;
+    }
+    if (i < argc) {
+        argv[i] = NULL; /* ends the template */
+        r.inputs = argv + i + 1;
+    } else {
+        reader_open_fd(&reader, STDIN_FILENO);
+        r.reader = &reader;
+    }
+    i = run_jobs(&r, max_jobs);
+    if (r.reader) {
+        reader_close(r.reader);
+    }
+    last_status = W_EXITCODE(i == -1 ? EXIT_FAILURE : r.failed > 101 ? 101 : r.failed, 0);
+}
+
+/**
+ * @brief the batch builtin.
+ * @param argc argument count.
+ * @param argv 'batch [-j N] cmd [arg]... [::: arg...]'.
+ *
+ * The arguments after ':::', or after cmd without ':::', are split in the fewest batches that
+ * exec accepts. Each batch runs as cmd with its fixed arguments followed by the batch, one at a
+ * time, or N at a time with -j. The exit status is the highest one of the batches.
+ */
+void batch_builtin(int argc, char **argv) {
+    parallel_run r;
+    long max_jobs = 1;
+    size_t limit, fixed;
+    int i, sep;
+
+    if ((i = jobs_option(argc, argv, &max_jobs)) == -1) {
+        last_status = W_EXITCODE(2, 0);
+        return;
+    }
+    memset(&r, 0, sizeof(r));
+    r.name = argv[0];
+    r.tmpl = argv + i;
+    for (sep = i; sep < argc && strcmp(argv[sep], ":::") != 0; ++sep) {
+    }
+    /* without ':::' only the command is fixed */
+    r.tmpl_argc = sep < argc ? sep - i : (i < argc);
+    r.inputs = sep < argc ? argv + sep + 1 : argv + i + r.tmpl_argc;
+    if (r.tmpl_argc == 0) {
+        printf("%s: invalid usage\n", argv[0]);
+        last_status = W_EXITCODE(2, 0);
+        return;
+    }
+    limit = exec_args_limit();
+    fixed = exec_args_size(r.tmpl, r.tmpl_argc);
+    /* at least one byte, so every batch takes at least one argument */
+    r.batch_room = limit > fixed ? limit - fixed : 1;
+    if (run_jobs(&r, max_jobs) == -1) {
+        last_status = W_EXITCODE(EXIT_FAILURE, 0);
+        return;
+    }
+    last_status = W_EXITCODE(r.worst, 0);
+}
+
+/**
+ * @brief enable/disable running commands that are too long for exec with batch.
+ * @param argc argument count, should be 2.
+ * @param argv argv[1] should contain "on" or "off" string.
+ */
+void batch_auto_set(int argc, char **argv) {
+    if (argc != 2) {
+        printf("%s: invalid usage\n", argv[0]);
+        return;
+    }
+    if (strcmp(argv[1], "on") == 0) {
+        printf("automatic batches: %s -> ENABLED\n", batch_auto ? "ENABLED" : "DISABLED");
+        batch_auto = 1;
+    } else if (strcmp(argv[1], "off") == 0) {
+        printf("automatic batches: %s -> DISABLED\n", batch_auto ? "ENABLED" : "DISABLED");
+        batch_auto = 0;
+    } else {
+        fprintf(stderr, "%s: invalid option\n", argv[0]);
+    }
+}
@@ -0,0 +1,646 @@
+/** \file parser.c
+* \brief the lexer and the parser of command lines.
+*
+* The lexer splits a line in words and operators. It understands single quotes, double quotes
+* and backslash escapes. Words are unquoted in place: the unquoted text is never longer than
+* the quoted one, so every word is written inside the line buffer itself and no string is
+* copied. The token and argv vectors grow inside an arena, there is no limit on the number of
+* arguments other than the ARG_MAX of exec.
+*
+* Words with unquoted pattern characters are replaced by the paths they match, see glob.c.
+*/
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "utils.h"
+
+/** printable form of the token types, used in syntax errors. */
+static const char *token_names[] = {"word", "|", "|&", ",", "&"};
+
+/** printable form of the list operators, used in syntax errors. */
+const char *list_names[] = {"end of line", ";", "&", "&&", "||"};
+
+/**
+ * @brief append a token to a vector that grows inside an arena.
+ * @param a the arena.
+ * @param tokens pointer to the vector.
+ * @param count pointer to the number of tokens, incremented.
+ * @param cap pointer to the capacity of the vector.
+ * @returns the new token.
+ */
+static token *push_token(arena *a, token **tokens, int *count, int *cap) {
+    if (*count == *cap) {
+        int n = *cap ? *cap * 2 : TOKENS_INITIAL_SIZE;
+        *tokens = arena_grow(a, *tokens, *cap * sizeof(token), n * sizeof(token));
+        *cap = n;
+    }
+    return &(*tokens)[(*count)++];
+}
+
+/**
+ * @brief check if a character ends an unquoted word.
+ * @param c the character.
+ * @param fanout True after '|&', where ',' separates the consumers.
+ * @returns True if \a c is a blank, the end of the line or starts an operator.
+ */
+static int ends_word(char c, int fanout) {
+    return c == '\0' || c == ' ' || c == '\t' || c == '\n' || c == '|' || c == '&' || (c == ',' && fanout);
+}
+
+/**
+ * @brief measure a variable reference.
+ * @param p the text after '$'.
+ * @returns the length of the reference after '$', 0 if \a p is not a reference.
+ *
+ * References are $NAME, ${NAME}, $? (the exit status of the last command) and $$ (the pid of
+ * the shell).
+ */
+static size_t reference_length(const char *p) {
+    const char *end;
+
+    if (*p == '?' || *p == '$') {
+        return 1;
+    }
+    if (*p == '{') {
+        return (end = strchr(p, '}')) != NULL && var_name_valid(p + 1, end - p - 1) ? (size_t)(end - p + 1) : 0;
+    }
+    for (end = p; var_name_valid(p, end - p + 1); ++end) {
+    }
+    return end - p;
+}
+
+/**
+ * @brief get the value of a variable reference.
+ * @param p the text after '$'.
+ * @param len the length of the reference after '$', from reference_length().
+ * @returns the value, "" for a variable that is not set. $? and $$ share a static buffer.
+ */
+static const char *reference_value(const char *p, size_t len) {
+    static char number[3 * sizeof(int) + 2];
+    const char *value;
+
+    if (*p == '?' || *p == '$') {
+        snprintf(number, sizeof(number), "%d",
+                 *p == '$' ? (int)shell_pid
+                           : WIFSIGNALED(last_status) ? 128 + WTERMSIG(last_status) : WEXITSTATUS(last_status));
+        return number;
+    }
+    value = *p == '{' ? var_lookup(p + 1, len - 2) : var_lookup(p, len);
+    return value ? value : "";
+}
+
+/**
+ * @brief mark a byte of a word.
+ * @param a the arena.
+ * @param marks the marks of the word, t->glob or t->refs. Allocated at the first mark.
+ * @param t the token of the word.
+ * @param w where the byte is written.
+ * @param r where it is read, the rest of the line follows.
+ * @param value the mark.
+ *
+ * The word can not get longer than what is already written plus the rest of the line.
+ */
+static void mark(arena *a, char **marks, const token *t, const char *w, const char *r, char value) {
+    size_t len;
+
+    if (*marks == NULL) {
+        len = (w - t->text) + strlen(r) + 1;
+        *marks = arena_alloc(a, len);
+        memset(*marks, 0, len);
+    }
+    (*marks)[w - t->text] = value;
+}
+
+/**
+ * @brief copy a variable reference into a word and mark it.
+ * @param a the arena.
+ * @param t the token of the word.
+ * @param w pointer to the write position, advanced.
+ * @param r pointer to the '$' of the reference, advanced past it.
+ * @returns True if \a r starts a reference, False if its '$' is a plain character.
+ *
+ * The reference is kept as it is and expanded each time the word is used, see expand_word().
+ * The mark is its length with the '$', so one longer than UCHAR_MAX stays plain text.
+ */
+static int copy_reference(arena *a, token *t, char **w, char **r) {
+    size_t n = reference_length(*r + 1) + 1;
+
+    if (n == 1 || n > UCHAR_MAX) {
+        return 0;
+    }
+    mark(a, &t->refs, t, *w, *r, (char)n);
+    memmove(*w, *r, n);
+    *w += n;
+    *r += n;
+    return 1;
+}
+
+/**
+ * @brief substitute the variable references of a word.
+ * @param t the word.
+ * @param a the arena of the result.
+ * @param glob where the pattern marks of the result are stored, NULL if it has none.
+ * @returns the word itself if it has no references, else a new string in \a a. NULL if the word
+ * expanded to nothing and had no quotes: like in other shells it is then no word at all.
+ *
+ * Values are taken literally: they are not split in words and their pattern characters are not
+ * marked.
+ */
+char *expand_word(const token *t, arena *a, char **glob) {
+    const unsigned char *refs = (const unsigned char *)t->refs;
+    const char *value;
+    size_t len = 0, i, n;
+    char *result, *g;
+
+    *glob = t->glob;
+    if (refs == NULL) {
+        return t->text;
+    }
+    for (i = 0; t->text[i]; i += refs[i] ? refs[i] : 1) {
+        len += refs[i] ? strlen(reference_value(t->text + i + 1, refs[i] - 1)) : 1;
+    }
+    if (len == 0 && !t->quoted) {
+        return NULL;
+    }
+    result = arena_alloc(a, len + 1);
+    g = t->glob ? arena_alloc(a, len + 1) : NULL;
+    for (i = len = 0; t->text[i]; i += n) {
+        if (refs[i]) {
+            value = reference_value(t->text + i + 1, refs[i] - 1);
+            n = strlen(value);
+            memcpy(result + len, value, n);
+            if (g)
+                memset(g + len, 0, n);
+            len += n;
+            n = refs[i];
+        } else {
+            if (g)
+                g[len] = t->glob[i];
+            result[len++] = t->text[i];
+            n = 1;
+        }
+    }
+    result[len] = '\0';
+    *glob = g;
+    return result;
+}
+
+/**
+ * @brief split a line in tokens.
+ * @param line the line. Words are unquoted in place and '\0' terminated inside it.
+ * @param a the arena the token vector is allocated from.
+ * @param tokens where the token vector is stored.
+ * @returns the number of tokens, -1 on a syntax error after printing it.
+ *
+ * A '#' at the start of a word starts a comment that runs to the end of the line. Unquoted '*', '?'
+ * and '[' are marked in token.glob, quoted ones are plain characters. Variable references outside
+ * of single quotes are kept in the words and marked in token.refs. They are expanded by
+ * expand_word() each time the tokens are used, so tokens can be built once and used again, e.g.
+ * by the body of a loop.
+ * Each word is compacted from its own start, which lies after the end of the previous word, so
+ * the terminators are only written once the whole line is read: writing one earlier could
+ * overwrite an operator that directly follows a word.
+ */
+int lex_line(char *line, arena *a, token **tokens) {
+    char *r = line; /* read position */
+    char *w;        /* write position of the current word */
+    int fanout = 0;
+    int count = 0;
+    int cap = 0;
+    token *t;
+    int i;
+
+    *tokens = NULL;
+    while (1) {
+        while (*r == ' ' || *r == '\t' || *r == '\n') {
+            r++;
+        }
+        if (*r == '\0' || *r == '#') {
+            break;
+        }
+        t = push_token(a, tokens, &count, &cap);
+        t->text = t->end = t->glob = t->refs = NULL;
+        t->quoted = 0;
+        if (*r == '|' && r[1] == '&') {
+            t->type = TOK_FANOUT;
+            fanout = 1;
+            r += 2;
+            continue;
+        } else if (*r == '|') {
+            t->type = TOK_PIPE;
+            r++;
+            continue;
+        } else if (*r == '&') {
+            t->type = TOK_AMP;
+            r++;
+            continue;
+        } else if (*r == ',' && fanout) {
+            t->type = TOK_COMMA;
+            r++;
+            continue;
+        }
+
+        t->type = TOK_WORD;
+        t->text = w = r;
+        while (!ends_word(*r, fanout)) {
+            if (*r == '\\') {
+                /* escaped character. A backslash at the end of the line stays as it is */
+                if (r[1] != '\0') {
+                    t->quoted = 1;
+                    r++;
+                }
+                *w++ = *r++;
+            } else if (*r == '\'') {
+                /* everything up to the next quote is literal */
+                t->quoted = 1;
+                for (r++; *r != '\'' && *r != '\0'; *w++ = *r++) {
+                }
+                if (*r++ == '\0') {
+                    fprintf(stderr, "syntax error: unterminated quote '\n");
+                    return -1;
+                }
+            } else if (*r == '"') {
+                /* only \\, \", \$ and \` are escapes inside double quotes */
+                t->quoted = 1;
+                for (r++; *r != '"' && *r != '\0';) {
+                    if (*r == '$' && copy_reference(a, t, &w, &r))
+                        continue;
+                    if (*r == '\\' && r[1] != '\0' && strchr("\\\"$`", r[1]))
+                        r++;
+                    *w++ = *r++;
+                }
+                if (*r++ == '\0') {
+                    fprintf(stderr, "syntax error: unterminated quote \"\n");
+                    return -1;
+                }
+            } else if (*r != '$' || !copy_reference(a, t, &w, &r)) {
+                if (*r == '*' || *r == '?' || *r == '[')
+                    mark(a, &t->glob, t, w, r, 1);
+                *w++ = *r++;
+            }
+        }
+        t->end = w;
+    }
+    for (i = 0; i < count; ++i) {
+        if ((*tokens)[i].type == TOK_WORD)
+            *(*tokens)[i].end = '\0';
+    }
+    return count;
+}
+
+/**
+ * @brief split a line in the pipelines of a list.
+ * @param line the line. The operators between the pipelines are overwritten with '\0'.
+ * @param a the arena the vector is allocated from.
+ * @param items where the vector of the pipelines is stored.
+ * @returns the number of pipelines, 0 for a blank line, -1 on a syntax error after printing it.
+ *
+ * grammar: pipeline [(';' | '\n' | '&' | '&&' | '||') pipeline]... [';' | '\n' | '&']
+ *
+ * Follows the quoting rules of lex_line(), so quoted operators stay in their words. An unquoted
+ * newline is a ';', but blank lines are skipped, also after '&&' and '||'. A comment runs to the
+ * end of its line. Nothing is expanded here: the variables and patterns of a pipeline are
+ * expanded when it runs, after the pipelines before it, so 'X=1; echo $X' prints 1.
+ */
+int split_list(char *line, arena *a, list_item **items) {
+    char *r = line;
+    char *start = line;
+    int in_single = 0, in_double = 0;
+    int word_start = 1;
+    int blank = 1; /* True while the current pipeline has no words */
+    int count = 0, cap = 0;
+    int op;
+
+    *items = NULL;
+    while (1) {
+        op = -1;
+        if (*r == '\0') {
+            op = LIST_END;
+        } else if (*r == '#' && word_start) {
+            r += strcspn(r, "\n");
+            continue;
+        } else if (in_single) {
+            in_single = *r != '\'';
+        } else if (*r == '\\' && r[1] != '\0') {
+            /* an escaped character is part of a word, even a blank one */
+            r += 2;
+            blank = word_start = 0;
+            continue;
+        } else if (in_double) {
+            in_double = *r != '"';
+        } else if (*r == ';' || *r == '\n') {
+            op = LIST_SEQ;
+        } else if (*r == '|' && r[1] == '&') {
+            r++; /* fan-out, not a background '&' */
+        } else if (*r == '&' || (*r == '|' && r[1] == '|')) {
+            op = r[1] != *r ? LIST_BG : *r == '&' ? LIST_AND : LIST_OR;
+        } else {
+            in_double = *r == '"';
+            in_single = *r == '\'';
+        }
+        if (op == -1) {
+            blank = blank && (*r == ' ' || *r == '\t' || *r == '\n');
+            word_start = !in_single && !in_double && strchr(" \t\n|&", *r) != NULL;
+            r++;
+            continue;
+        }
+
+        if (blank && *r == '\n') {
+            start = ++r;
+            word_start = 1;
+            continue;
+        }
+        if (blank) {
+            if (op != LIST_END) {
+                fprintf(stderr, "syntax error near unexpected token '%s'\n", list_names[op]);
+                return -1;
+            }
+            if (count > 0 && (*items)[count - 1].op >= LIST_AND) {
+                fprintf(stderr, "syntax error: missing command after '%s'\n", list_names[(*items)[count - 1].op]);
+                return -1;
+            }
+            return count;
+        }
+        if (count == cap) {
+            int n = cap ? cap * 2 : LIST_INITIAL_SIZE;
+            *items = arena_grow(a, *items, cap * sizeof(list_item), n * sizeof(list_item));
+            cap = n;
+        }
+        (*items)[count].text = start;
+        (*items)[count++].op = op;
+        if (op == LIST_END) {
+            return count;
+        }
+        *r = '\0';
+        start = r += op >= LIST_AND ? 2 : 1;
+        blank = word_start = 1;
+    }
+}
+
+/**
+ * @brief a command under construction.
+ */
+typedef struct command_builder {
+    char **argv;    /**< the argument vector, not yet NULL terminated. */
+    int argc;       /**< number of arguments. */
+    int cap;        /**< capacity of \a argv. */
+    int first_glob; /**< index of the first argument that came from a pattern, 0 if none did. */
+} command_builder;
+
+/**
+ * @brief append an argument to the command being built.
+ * @param a the arena.
+ * @param cmd the command.
+ * @param arg the argument.
+ */
+static void push_arg(arena *a, command_builder *cmd, char *arg) {
+    if (cmd->argc == cmd->cap) {
+        int n = cmd->cap ? cmd->cap * 2 : ARGV_INITIAL_SIZE;
+        cmd->argv = arena_grow(a, cmd->argv, cmd->cap * sizeof(char *), n * sizeof(char *));
+        cmd->cap = n;
+    }
+    cmd->argv[cmd->argc++] = arg;
+}
+
+/**
+ * @brief append an expanded word to the command being built.
+ * @param a the arena.
+ * @param cmd the command.
+ * @param t the word, its references already substituted.
+ *
+ * A pattern is replaced by the paths it matches. One without matches stays as it is.
+ */
+static void push_word(arena *a, command_builder *cmd, const token *t) {
+    char **matches;
+    size_t n, j;
+
+    n = t->glob ? glob_expand(t->text, t->glob, a, &matches) : 0;
+    if (n == 0) {
+        push_arg(a, cmd, t->text);
+    } else if (cmd->first_glob == 0) {
+        cmd->first_glob = cmd->argc;
+    }
+    for (j = 0; j < n; ++j) {
+        push_arg(a, cmd, matches[j]);
+    }
+}
+
+/**
+ * @brief expand words like the arguments of a command.
+ * @param tokens the words. Other tokens are skipped.
+ * @param count number of tokens.
+ * @param a the arena of the result.
+ * @param words where the NULL terminated vector of the expanded words is stored.
+ * @returns the number of words.
+ */
+int expand_words(const token *tokens, int count, arena *a, char ***words) {
+    command_builder cmd = {NULL, 0, 0, 0};
+    token t;
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        t = tokens[i];
+        if (t.type == TOK_WORD && (t.text = expand_word(&tokens[i], a, &t.glob)) != NULL)
+            push_word(a, &cmd, &t);
+    }
+    push_arg(a, &cmd, NULL);
+    *words = cmd.argv;
+    return cmd.argc - 1;
+}
+
+/**
+ * @brief run a command with batch if its expanded patterns make it too long for exec.
+ * @param a the arena.
+ * @param cmd the command, NULL terminated.
+ *
+ * 'rm -f *.tmp' becomes 'batch rm -f ::: a.tmp b.tmp...': the words before the first pattern
+ * are given to every batch. Only done with 'autobatch on', and never for builtins.
+ */
+static void auto_batch(arena *a, command_builder *cmd) {
+    char **argv;
+    int fixed = cmd->first_glob;
+
+    if (!batch_auto || fixed == 0 || check_if_builtin(cmd->argv[0]) >= 0 ||
+        exec_args_size(cmd->argv, cmd->argc) <= exec_args_limit()) {
+        return;
+    }
+    argv = arena_alloc(a, (cmd->argc + 3) * sizeof(char *));
+    argv[0] = "batch";
+    memcpy(argv + 1, cmd->argv, fixed * sizeof(char *));
+    argv[fixed + 1] = ":::";
+    memcpy(argv + fixed + 2, cmd->argv + fixed, (cmd->argc - fixed + 1) * sizeof(char *));
+    cmd->argv = argv;
+    cmd->argc += 2;
+}
+
+/**
+ * @brief finish the command being built and append it to the pipeline.
+ * @param a the arena.
+ * @param pl the pipeline.
+ * @param cmd the command. It is emptied.
+ * @param cap pointer to the capacity of the argc/argv vectors of \a pl.
+ * @returns 0 on success, -1 if the command has no words.
+ */
+static int end_command(arena *a, pipeline *pl, command_builder *cmd, int *cap) {
+    int n = pl->stages + pl->consumers;
+    if (cmd->argc == 0) {
+        return -1;
+    }
+    if (n == *cap) {
+        int c = *cap ? *cap * 2 : COMMANDS_INITIAL_SIZE;
+        pl->argc = arena_grow(a, pl->argc, *cap * sizeof(int), c * sizeof(int));
+        pl->argv = arena_grow(a, pl->argv, *cap * sizeof(char **), c * sizeof(char **));
+        *cap = c;
+    }
+    cmd->argv = arena_grow(a, cmd->argv, cmd->cap * sizeof(char *), (cmd->argc + 1) * sizeof(char *));
+    cmd->argv[cmd->argc] = NULL;
+    auto_batch(a, cmd);
+    pl->argc[n] = cmd->argc;
+    pl->argv[n] = cmd->argv;
+    cmd->argv = NULL;
+    cmd->argc = cmd->cap = cmd->first_glob = 0;
+    return 0;
+}
+
+/**
+ * @brief parse the 'place' prefix of a line.
+ * @param tokens the tokens of the line.
+ * @param count number of tokens.
+ * @param i index of the first token after the 'time' prefix.
+ * @param pl the pipeline. Its placement is filled in.
+ * @returns the index of the first token of the command, -1 on an invalid option after printing it.
+ *
+ * 'place' is a prefix only when option/value pairs are followed by a command. Without a command
+ * it is the builtin that sets the shell-wide placement, and \a i is returned unchanged.
+ */
+static int parse_place_prefix(token *tokens, int count, int i, pipeline *pl) {
+    int j, k;
+
+    if (i >= count || tokens[i].type != TOK_WORD || strcmp(tokens[i].text, "place") != 0) {
+        return i;
+    }
+    for (j = i + 1; j + 1 < count && tokens[j].type == TOK_WORD && tokens[j].text[0] == '-' &&
+                    tokens[j + 1].type == TOK_WORD;
+         j += 2) {
+    }
+    if (j == i + 1 || j == count || tokens[j].type != TOK_WORD || tokens[j].text[0] == '-') {
+        return i;
+    }
+    for (k = i + 1; k < j; k += 2) {
+        if (placement_option(&pl->place, tokens[k].text, tokens[k + 1].text) == -1)
+            return -1;
+    }
+    return j;
+}
+
+/**
+ * @brief build a pipeline from the tokens of a line.
+ * @param tokens the tokens, from lex_line(). They are not modified and can be built again.
+ * @param count number of tokens.
+ * @param pl the result.
+ * @param a the arena all vectors and expanded words are allocated from. They live until it is reset.
+ * @returns 0 on success. pl->stages is 0 if no command is left.
+ * @returns -1 on a syntax error, after printing it.
+ *
+ * grammar: ['time'] ['place' option value...] stage ['|' stage]... ['|&' consumer [',' consumer]...] ['&']
+ *
+ * The tokens are a single pipeline of a list, see split_list(), which also takes its '&'. The
+ * variables and patterns of the words are expanded first. A leading 'time' followed by a
+ * command is a prefix of the whole line, not a command. So is 'place' with its options, see
+ * parse_place_prefix().
+ */
+int build_pipeline(const token *tokens, int count, pipeline *pl, arena *a) {
+    command_builder cmd = {NULL, 0, 0, 0};
+    token *words;
+    int cap = 0;
+    int in_consumers = 0; /* True after '|&' */
+    int i, n;
+
+    pl->stages = pl->consumers = pl->background = pl->timed = pl->place.set = 0;
+    pl->argc = NULL;
+    pl->argv = NULL;
+    pl->builtin = BUILTIN_UNKNOWN;
+    if (count <= 0) {
+        return 0;
+    }
+    words = arena_alloc(a, count * sizeof(token));
+    for (i = n = 0; i < count; ++i) {
+        words[n] = tokens[i];
+        /* a word that expanded to nothing is dropped */
+        if (tokens[i].type != TOK_WORD || (words[n].text = expand_word(&tokens[i], a, &words[n].glob)) != NULL)
+            n++;
+    }
+
+    pl->timed = n > 1 && words[0].type == TOK_WORD && words[1].type == TOK_WORD && strcmp(words[0].text, "time") == 0;
+    if ((i = parse_place_prefix(words, n, pl->timed, pl)) == -1) {
+        return -1;
+    }
+    for (; i < n; ++i) {
+        token *t = &words[i];
+        int bad = 0;
+        switch (t->type) {
+            case TOK_WORD:
+                push_word(a, &cmd, t);
+                break;
+            case TOK_PIPE:
+            case TOK_FANOUT:
+                /* no '|' or second '|&' among the consumers */
+                if (!(bad = in_consumers || end_command(a, pl, &cmd, &cap) == -1)) {
+                    pl->stages++;
+                    in_consumers = t->type == TOK_FANOUT;
+                }
+                break;
+            case TOK_COMMA:
+                if (!(bad = end_command(a, pl, &cmd, &cap) == -1))
+                    pl->consumers++;
+                break;
+            case TOK_AMP:
+                /* only allowed at the end */
+                bad = i != n - 1;
+                pl->background = 1;
+                break;
+        }
+        if (bad) {
+            fprintf(stderr, "syntax error near unexpected token '%s'\n", token_names[t->type]);
+            return -1;
+        }
+    }
+
+    if (end_command(a, pl, &cmd, &cap) == -1) {
+        if (pl->stages == 0) {
+            /* only an '&', or words that expanded to nothing */
+            return 0;
+        }
+        fprintf(stderr, "syntax error: missing command at the end of the line\n");
+        return -1;
+    }
+    if (in_consumers) {
+        pl->consumers++;
+    } else {
+        pl->stages++;
+    }
+    return 0;
+}
+
+/**
+ * @brief parse a line into a pipeline.
+ * @param line the line. It is modified and the arguments point inside it.
+ * @param pl the result.
+ * @param a the arena all vectors are allocated from. They live until it is reset.
+ * @returns 0 on success. pl->stages is 0 if the line is blank.
+ * @returns -1 on a syntax error, after printing it.
+ *
+ * Lexes the line and builds its pipeline at once, see build_pipeline().
+ */
+int parse_pipeline(char *line, pipeline *pl, arena *a) {
+    token *tokens;
+    int count;
+
+    if ((count = lex_line(line, a, &tokens)) == -1) {
+        return -1;
+    }
+    return build_pipeline(tokens, count, pl, a);
+}
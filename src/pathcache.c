@@ -0,0 +1,326 @@
+/** \file pathcache.c
+* \brief resolved command cache.
+*
+* holds a hash table that maps command names to the absolute path of the executable found
+* in one of the PATH directories. The table is filled on the first lookup of each command and
+* flushed whenever the value of PATH changes, so each command only scans PATH once. A command
+* found after a relative PATH entry, like '.' or an empty one, is not cached: the directory it
+* is in depends on the working directory at the time it runs.
+*
+* The strings of the entries come from an arena of the cache. They are released together when
+* the table is flushed, a forgotten or replaced entry keeps its memory until then.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/**
+ * @brief a single entry of the command hash table.
+ */
+typedef struct path_entry {
+    char *name;    /**< command name, the key. NULL if the slot is empty. */
+    char *path;    /**< absolute path of the executable. */
+    unsigned hits; /**< number of lookups answered by this entry. */
+} path_entry;
+
+/** open addressing table, always a power of 2 in length. */
+static path_entry *table = NULL;
+/** number of slots in \a table. */
+static size_t table_size = 0;
+/** number of used slots in \a table. */
+static size_t table_used = 0;
+/** the names and paths of the entries. */
+static arena strings;
+
+/** copy of the PATH value \a path_dirs was built from. NULL if PATH was never parsed. */
+static char *path_copy = NULL;
+/** the PATH directories. The strings point inside \a path_dirs_buf. */
+static char **path_dirs = NULL;
+/** number of elements in \a path_dirs. */
+static int path_count = 0;
+/** buffer holding the ':' separated PATH value, split with '\0'. */
+static char *path_dirs_buf = NULL;
+
+/**
+ * @brief FNV-1a hash of a string.
+ * @param s the string to hash.
+ * @returns the hash value.
+ */
+static size_t hash_string(const char *s) {
+    size_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief find the slot for a name.
+ * @param name the command name.
+ * @returns the slot that holds \a name or the empty slot where it should be inserted.
+ *
+ * The table must never be full, path_hash_insert() grows it before that happens.
+ */
+static path_entry *find_slot(const char *name) {
+    size_t i = hash_string(name) & (table_size - 1);
+    while (table[i].name && strcmp(table[i].name, name) != 0) {
+        i = (i + 1) & (table_size - 1);
+    }
+    return &table[i];
+}
+
+/**
+ * @brief double the size of the table and rehash all entries.
+ */
+static void grow_table() {
+    path_entry *old = table;
+    size_t old_size = table_size;
+    size_t i;
+
+    table_size = old_size ? old_size * 2 : PATH_HASH_INITIAL_SIZE;
+    table = calloc(table_size, sizeof(path_entry));
+    for (i = 0; i < old_size; ++i) {
+        if (old[i].name) {
+            *find_slot(old[i].name) = old[i];
+        }
+    }
+    free(old);
+}
+
+/**
+ * @brief add or replace an entry in the table.
+ * @param name the command name.
+ * @param path the absolute path of the command.
+ * @returns the stored entry.
+ */
+static path_entry *path_hash_insert(const char *name, const char *path) {
+    path_entry *e;
+    /* keep the load factor under 1/2 */
+    if ((table_used + 1) * 2 > table_size) {
+        grow_table();
+    }
+    e = find_slot(name);
+    if (e->name == NULL) {
+        e->name = arena_strdup(&strings, name);
+        table_used++;
+    }
+    e->path = arena_strdup(&strings, path);
+    e->hits = 0;
+    return e;
+}
+
+/**
+ * @brief remove a command from the table.
+ * @param name the command name.
+ *
+ * Used when the cached file no longer exists. The entries that follow in the same probe
+ * sequence are moved back so lookups never stop at the freed slot too early.
+ */
+void path_forget(const char *name) {
+    size_t i, j, k;
+
+    if (table_size == 0) {
+        return;
+    }
+    i = find_slot(name) - table;
+    if (table[i].name == NULL) {
+        return;
+    }
+    table[i].name = NULL;
+    table_used--;
+    for (j = (i + 1) & (table_size - 1); table[j].name; j = (j + 1) & (table_size - 1)) {
+        k = hash_string(table[j].name) & (table_size - 1);
+        /* move the entry back unless its home slot lies cyclically in (i, j] */
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        table[i] = table[j];
+        table[j].name = NULL;
+        i = j;
+    }
+}
+
+/**
+ * @brief remove all entries from the table.
+ *
+ * Memory of the table itself is kept for reuse, except when called from shell_exit().
+ */
+void path_hash_flush() {
+    size_t i;
+    for (i = 0; i < table_size; ++i) {
+        table[i].name = NULL;
+    }
+    table_used = 0;
+    arena_reset(&strings);
+}
+
+/**
+ * @brief free all memory held by the command cache.
+ */
+void path_hash_free() {
+    path_hash_flush();
+    free(table);
+    table = NULL;
+    table_size = 0;
+    arena_free(&strings);
+    free(path_copy);
+    free(path_dirs_buf);
+    free(path_dirs);
+    path_copy = path_dirs_buf = NULL;
+    path_dirs = NULL;
+    path_count = 0;
+}
+
+/**
+ * @brief parses the PATH environmental variable.
+ *
+ * Splits PATH on ':' into \a path_dirs. Nothing is done if PATH did not change since the
+ * last call. When it did change, the command cache is flushed because the resolved paths
+ * may no longer be the ones execvp() would find.
+ */
+void parse_path() {
+    const char *path_variable = var_get("PATH");
+    char *r;
+
+    if (path_variable == NULL) {
+        path_variable = "";
+    }
+    if (path_copy && strcmp(path_copy, path_variable) == 0) {
+        return;
+    }
+
+    path_hash_flush();
+    free(path_copy);
+    free(path_dirs_buf);
+    path_copy = strdup(path_variable);
+    path_dirs_buf = strdup(path_variable);
+    path_count = 0;
+
+    /* empty elements mean the current directory, so strtok() can not be used here. */
+    path_dirs = realloc(path_dirs, (strlen(path_dirs_buf) + 1) * sizeof(char *));
+    path_dirs[path_count++] = path_dirs_buf;
+    for (r = path_dirs_buf; *r; ++r) {
+        if (*r == ':') {
+            *r = '\0';
+            path_dirs[path_count++] = r + 1;
+        }
+    }
+}
+
+/**
+ * @brief search the PATH directories for an executable.
+ * @param name the command name.
+ * @param buffer where the full path is written. Must be at least PATH_MAX bytes long.
+ * @param relative set to True if a relative directory was searched, the one it was found in included.
+ * @returns 1 if found, 0 if not.
+ */
+static int search_path(const char *name, char *buffer, int *relative) {
+    struct stat st;
+    int i;
+
+    *relative = 0;
+    for (i = 0; i < path_count; ++i) {
+        const char *dir = path_dirs[i][0] ? path_dirs[i] : ".";
+        if (dir[0] != '/')
+            *relative = 1;
+        if (snprintf(buffer, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX) {
+            continue;
+        }
+        if (stat(buffer, &st) == 0 && S_ISREG(st.st_mode) && access(buffer, X_OK) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief resolve a command name to the path of its executable.
+ * @param name the command name, usually argv[0].
+ * @returns the absolute path of the command. The string belongs to the cache.
+ * @returns NULL if \a name contains a '/' or is not found in PATH.
+ *
+ * On a miss the PATH directories are scanned once and the result is cached. Failed lookups
+ * are not cached, so commands installed later are still found. Neither are the ones that depend
+ * on the working directory: NULL is returned, and execvpe() searches PATH when the command runs.
+ */
+char *path_lookup(const char *name) {
+    char buffer[PATH_MAX];
+    path_entry *e;
+    int relative;
+
+    if (strchr(name, '/')) {
+        return NULL;
+    }
+    parse_path();
+    if (table_size) {
+        e = find_slot(name);
+        if (e->name) {
+            e->hits++;
+            return e->path;
+        }
+    }
+    if (!search_path(name, buffer, &relative) || relative) {
+        return NULL;
+    }
+    e = path_hash_insert(name, buffer);
+    e->hits++;
+    return e->path;
+}
+
+/**
+ * @brief the hash builtin. Lists, adds or flushes cached command paths.
+ * @param argc argument count.
+ * @param argv 'hash' lists the cache, 'hash -r' flushes it, 'hash cmd...' adds commands.
+ */
+void hash_builtin(int argc, char **argv) {
+    size_t i;
+    int a;
+
+    if (argc == 1) {
+        parse_path();
+        if (table_used == 0) {
+            printf("hash: hash table empty\n");
+            return;
+        }
+        printf("hits\tcommand\n");
+        for (i = 0; i < table_size; ++i) {
+            if (table[i].name) {
+                printf("%4u\t%s\n", table[i].hits, table[i].path);
+            }
+        }
+        return;
+    }
+    if (strcmp(argv[1], "-r") == 0) {
+        if (argc > 2) {
+            printf("%s: invalid usage\n", argv[0]);
+            return;
+        }
+        path_hash_flush();
+        return;
+    }
+    parse_path();
+    for (a = 1; a < argc; ++a) {
+        char buffer[PATH_MAX];
+        int relative;
+        if (strchr(argv[a], '/')) {
+            continue;
+        }
+        if (!search_path(argv[a], buffer, &relative)) {
+            fprintf(stderr, "%s: %s: not found\n", argv[0], argv[a]);
+            last_status = W_EXITCODE(EXIT_FAILURE, 0);
+        } else if (relative) {
+            fprintf(stderr, "%s: %s: found through a relative PATH directory, not remembered\n", argv[0], argv[a]);
+            last_status = W_EXITCODE(EXIT_FAILURE, 0);
+        } else {
+            path_hash_insert(argv[a], buffer);
+        }
+    }
+}
@@ -0,0 +1,401 @@
+/** \file pipeline.c
+* \brief functions that run pipelines.
+*
+* The stages of a pipeline are connected with '|'. All processes of a pipeline share one process
+* group and the pipes between them are enlarged with F_SETPIPE_SZ. After '|&' comes a comma separated list
+* of consumers that all read a copy of the output of the last stage. The copies are made inside
+* the kernel by relay processes of the shell, using tee() and splice().
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/**
+ * @brief create a close-on-exec pipe of PIPE_SIZE bytes.
+ * @param fds where the read and the write end are stored.
+ * @returns 0 on success, -1 on failure after printing the error.
+ *
+ * A failing F_SETPIPE_SZ (e.g. over /proc/sys/fs/pipe-max-size) leaves the default size.
+ */
+static int make_pipe(int fds[2]) {
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    fcntl(fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+    return 0;
+}
+
+/**
+ * @brief close a file descriptor if it is open and mark it closed.
+ * @param fd pointer to the file descriptor.
+ */
+static void close_fd(int *fd) {
+    if (*fd != -1) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+/**
+ * @brief arguments of a builtin that runs as a pipeline stage.
+ */
+typedef struct builtin_stage {
+    int code;    /**< builtin command code. */
+    int argc;    /**< argument count. */
+    char **argv; /**< argument vector. */
+} builtin_stage;
+
+/**
+ * @brief child entry of a builtin that runs as a pipeline stage.
+ * @param arg pointer to a \a builtin_stage.
+ * @returns the exit code of the child, from the status the builtin left in last_status.
+ */
+static int run_builtin_stage(void *arg) {
+    builtin_stage *b = arg;
+    last_status = 0;
+    call_builtin(b->code, b->argc, b->argv);
+    return WIFSIGNALED(last_status) ? 128 + WTERMSIG(last_status) : WEXITSTATUS(last_status);
+}
+
+/**
+ * @brief child entry of a fan-out relay.
+ * @param arg unused.
+ * @returns the exit code of the relay.
+ *
+ * Reads stdin and writes every byte both to fd 3 and to stdout. tee() duplicates the data
+ * waiting in stdin into fd 3 without consuming it, then splice() moves the same amount to
+ * stdout. No byte is copied through user space. A consumer that exits early is dropped and
+ * the relay goes on for the other one.
+ */
+static int relay_main(void *arg) {
+    int copy = 3;
+    int pass = STDOUT_FILENO;
+    int pass_gone = 0; /* True if \a pass was replaced by /dev/null */
+    ssize_t n, m;
+
+    (void)arg;
+    signal(SIGPIPE, SIG_IGN);
+    while (copy != -1) {
+        n = tee(STDIN_FILENO, copy, RELAY_CHUNK, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno == EPIPE) {
+            close_fd(&copy);
+            if (pass_gone)
+                return EXIT_SUCCESS; /* both consumers are gone */
+            break;
+        }
+        if (n <= 0)
+            return n == 0 ? EXIT_SUCCESS : EXIT_FAILURE; /* end of input, or a real error */
+        /* move exactly what was copied */
+        while (n > 0) {
+            m = splice(STDIN_FILENO, NULL, pass, NULL, n, SPLICE_F_MOVE);
+            if (m == -1 && errno == EINTR)
+                continue;
+            if (m == -1 && errno == EPIPE && !pass_gone) {
+                /* the copied bytes must still be consumed */
+                close(pass);
+                if ((pass = open("/dev/null", O_WRONLY)) == -1)
+                    return EXIT_FAILURE;
+                pass_gone = 1;
+                continue;
+            }
+            if (m <= 0)
+                return m == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+            n -= m;
+        }
+    }
+    /* only the pass consumer is left, move everything to it */
+    while ((m = splice(STDIN_FILENO, NULL, pass, NULL, RELAY_CHUNK, SPLICE_F_MOVE)) != 0) {
+        if (m == -1 && errno != EINTR)
+            return errno == EPIPE ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief launch one process of a pipeline and record it in the job table.
+ * @param spec the launch spec. argv and the file descriptors must be set, pgid is filled in. Without
+ * a placement it gets the shell-wide one.
+ * @param argc argument count of the command.
+ * @param bg True if the pipeline runs in the background.
+ * @param procs array where the new record is appended.
+ * @param count number of elements in \a procs, incremented on success.
+ * @returns 0 on success, -1 if the process could not be started: the error is printed and the status is
+ * 127, like a command that is not found.
+ */
+int launch_one(launch_spec *spec, int argc, int bg, process **procs, int *count) {
+    builtin_stage b;
+    struct timespec start;
+    process *p;
+    pid_t pid;
+
+    if (spec->child_fn == NULL) {
+        if ((b.code = check_if_builtin(spec->argv[0])) >= 0) {
+            b.argc = argc;
+            b.argv = spec->argv;
+            spec->child_fn = run_builtin_stage;
+            spec->child_arg = &b;
+        } else {
+            /* resolve the command in the parent so the result stays in the cache */
+            spec->path = path_lookup(spec->argv[0]);
+        }
+    }
+    if (spec->place == NULL && default_placement.set)
+        spec->place = &default_placement;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((pid = spawn_command(spec)) == -1) {
+        perror(spec->argv[0]);
+        last_status = W_EXITCODE(127, 0);
+        return -1;
+    }
+    if (spec->pgid == 0) {
+        /* the first process leads the group of the whole pipeline */
+        spec->pgid = pid;
+    }
+    /* take a new process record from the job table. */
+    p = job_alloc();
+    p->pid = pid;
+    p->pgid = spec->pgid;
+    p->bg = bg;
+    p->start = start;
+    job_insert(p);
+    procs[(*count)++] = p;
+    return 0;
+}
+
+/**
+ * @brief run a builtin inside the shell and print the resources it used.
+ * @param code the builtin command code.
+ * @param argc argument count.
+ * @param argv argument vector.
+ *
+ * The CPU time and context switches are the difference in the usage of the shell itself.
+ */
+static void time_builtin_call(int code, int argc, char **argv) {
+    struct rusage before, after;
+    process p;
+    job_stats s;
+
+    memset(&p, 0, sizeof(p));
+    getrusage(RUSAGE_SELF, &before);
+    clock_gettime(CLOCK_MONOTONIC, &p.start);
+    call_builtin(code, argc, argv);
+    clock_gettime(CLOCK_MONOTONIC, &p.end);
+    getrusage(RUSAGE_SELF, &after);
+
+    p.completed = 1;
+    timersub(&after.ru_utime, &before.ru_utime, &p.usage.ru_utime);
+    timersub(&after.ru_stime, &before.ru_stime, &p.usage.ru_stime);
+    p.usage.ru_maxrss = after.ru_maxrss;
+    p.usage.ru_nvcsw = after.ru_nvcsw - before.ru_nvcsw;
+    p.usage.ru_nivcsw = after.ru_nivcsw - before.ru_nivcsw;
+    job_stats_of(&p, &s);
+    fflush(stdout);
+    job_stats_print(stderr, &s);
+    fprintf(stderr, "\n");
+}
+
+/**
+ * @brief launch the processes of a pipeline.
+ * @param pl the pipeline, with at least one stage.
+ *
+ * Foreground pipelines are waited for, background ones are only reported.
+ * The 'place' prefix of the line overrides the shell-wide placement for all of its processes.
+ * With the 'time' prefix the resources used by a foreground pipeline are printed to stderr once
+ * it is done. CPU times and context switches are summed over its processes.
+ */
+static void launch_pipeline(pipeline *pl) {
+    launch_spec spec;
+    process **procs;
+    int count = 0;
+    int prev_read = -1; /* read end of the pipe from the previous stage */
+    int fds[2] = {-1, -1};
+    int copy[2] = {-1, -1};
+    int relays;
+    int last_started = 0; /* True if the last process of the pipeline runs, its status is the one of the pipeline */
+    pid_t pgid = 0;
+    job_stats total, s;
+    placement merged;
+    const placement *place = NULL; /* NULL: launch_one() uses the shell-wide placement */
+    int i, c;
+
+    if (pl->place.set) {
+        placement_merge(&merged, &pl->place);
+        place = &merged;
+    }
+    /* one relay less than consumers: each relay splits off one copy, the last one passes the rest */
+    relays = pl->consumers > 1 ? pl->consumers - 1 : 0;
+    procs = arena_alloc(&line_arena, (pl->stages + pl->consumers + relays) * sizeof(process *));
+
+    for (i = 0; i < pl->stages; ++i) {
+        fds[0] = fds[1] = -1;
+        if ((i < pl->stages - 1 || pl->consumers) && make_pipe(fds) == -1)
+            break;
+        launch_spec_init(&spec, pl->argv[i]);
+        spec.pgid = pgid;
+        spec.place = place;
+        spec.fd_in = prev_read;
+        spec.fd_out = fds[1];
+        last_started = launch_one(&spec, pl->argc[i], pl->background, procs, &count) == 0;
+        pgid = spec.pgid;
+        close_fd(&prev_read);
+        close_fd(&fds[1]);
+        prev_read = fds[0];
+    }
+
+    for (c = 0; i == pl->stages && c < pl->consumers; ++c) {
+        launch_spec_init(&spec, NULL);
+        spec.pgid = pgid;
+        spec.place = place;
+        if (c < relays) {
+            /* relay: prev_read goes to consumer c through copy[] and to the next relay through fds[] */
+            if (make_pipe(copy) == -1)
+                break;
+            if (make_pipe(fds) == -1) {
+                close_fd(&copy[0]);
+                close_fd(&copy[1]);
+                break;
+            }
+            spec.argv = (char *[]){"relay", NULL};
+            spec.fd_in = prev_read;
+            spec.fd_out = fds[1];
+            spec.fd_extra = copy[1];
+            spec.child_fn = relay_main;
+            launch_one(&spec, 1, pl->background, procs, &count);
+            pgid = spec.pgid;
+            close_fd(&prev_read);
+            close_fd(&fds[1]);
+            close_fd(&copy[1]);
+            prev_read = fds[0];
+
+            launch_spec_init(&spec, pl->argv[pl->stages + c]);
+            spec.pgid = pgid;
+            spec.place = place;
+            spec.fd_in = copy[0];
+            last_started = launch_one(&spec, pl->argc[pl->stages + c], pl->background, procs, &count) == 0;
+            close_fd(&copy[0]);
+        } else {
+            /* the last consumer reads what is left */
+            spec.argv = pl->argv[pl->stages + c];
+            spec.fd_in = prev_read;
+            last_started = launch_one(&spec, pl->argc[pl->stages + c], pl->background, procs, &count) == 0;
+            close_fd(&prev_read);
+        }
+    }
+    close_fd(&prev_read);
+
+    if (count > 0) {
+        if (!pl->background) {
+            /* foreground pipeline, handle child death */
+            wait_for_processes(procs, count, last_started);
+            memset(&total, 0, sizeof(total));
+            for (i = 0; i < count; ++i) {
+                if (pl->timed) {
+                    job_stats_of(procs[i], &s);
+                    job_stats_add(&total, &s);
+                }
+                job_release(procs[i]); /* bg processes are kept by harvest_dead_child() */
+            }
+            if (pl->timed) {
+                job_stats_print(stderr, &total);
+                fprintf(stderr, "\n");
+            }
+        } else {
+            if (interactive)
+                printf("[%d] started\n", pgid);
+            last_status = 0;
+        }
+    }
+}
+
+/**
+ * @brief set the variables of a command made only of NAME=value words.
+ * @param argc argument count.
+ * @param argv argument vector.
+ * @returns True if the words were assignments and are done, False if it is a command.
+ */
+static int run_assignments(int argc, char **argv) {
+    int i;
+
+    for (i = 0; i < argc; ++i) {
+        if (!is_assignment(argv[i]))
+            return 0;
+    }
+    for (i = 0; i < argc; ++i) {
+        assign(argv[i], 0);
+    }
+    last_status = 0;
+    return 1;
+}
+
+/**
+ * @brief run a parsed pipeline.
+ * @param pl the pipeline, with at least one stage.
+ *
+ * A single builtin, or a line of NAME=value words, runs inside the shell. Everything else gets its own process,
+ * builtins included. A background pipeline is queued instead when 'jobs -max' running ones are
+ * reached, or when others are queued already, so the queue stays in order. The name of a single command
+ * is not looked up again if the caller knew its builtin, see pipeline.builtin.
+ */
+void run_pipeline(pipeline *pl) {
+    queued_job *q;
+    int c;
+
+    if (pl->stages == 1 && pl->consumers == 0 && run_assignments(pl->argc[0], pl->argv[0])) {
+        return;
+    }
+    if (pl->stages > 1 || pl->consumers > 0)
+        c = -1;
+    else
+        c = pl->builtin != BUILTIN_UNKNOWN ? pl->builtin : builtin_code(pl->argv[0][0]);
+    if (c >= 0 && builtin_enabled(c)) {
+        if (pl->background)
+            fprintf(stderr, "WARNING: builtin commands cannot be run in the background! Ignoring...\n");
+        last_status = 0; /* builtins that fail, like parallel, set it themselves */
+        if (pl->timed)
+            time_builtin_call(c, pl->argc[0], pl->argv[0]);
+        else
+            call_builtin(c, pl->argc[0], pl->argv[0]);
+        return;
+    }
+    if (pl->background && bg_jobs_max > 0 && (job_queue_length() > 0 || job_bg_running() >= (size_t)bg_jobs_max)) {
+        q = job_queue_push(pl);
+        if (interactive)
+            printf("[q%d] queued\n", q->id);
+        last_status = 0;
+        return;
+    }
+    launch_pipeline(pl);
+}
+
+/**
+ * @brief start queued background pipelines while there are free slots.
+ *
+ * Called after children were reaped and when the limit changes. A pipeline stage that reaps
+ * its own children, like parallel, has a copy of the queue and must not start it.
+ */
+void run_queued_jobs() {
+    queued_job *q;
+
+    if (getpid() != shell_pid) {
+        return;
+    }
+    while (job_queue_oldest() && (bg_jobs_max == 0 || job_bg_running() < (size_t)bg_jobs_max)) {
+        q = job_queue_pop();
+        launch_pipeline(&q->pl);
+        free(q);
+    }
+}
@@ -0,0 +1,375 @@
+/** \file placement.c
+* \brief where and how launched processes run: CPU affinity, nice level, I/O priority and rlimits.
+*
+* A \a placement holds the scheduling attributes a child gets between its creation and exec. The
+* 'place' builtin sets shell-wide defaults that apply to every launched process, and as a line
+* prefix ('place -c 2-3 cmd | cmd') it overrides them for one pipeline. The attributes are
+* applied by child_setup() in spawn.c, posix_spawn() has no attributes for them.
+*
+* The 'ulimit' builtin changes the resource limits of the shell itself, which every child
+* inherits, the same way other shells do it.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/ioprio.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/** the shell-wide placement, set by the 'place' builtin. Nothing is set at startup. */
+placement default_placement;
+
+/** bits in one word of placement.cpus. */
+#define CPU_WORD_BITS (8 * sizeof(unsigned long))
+
+/** names of the I/O scheduling classes, indexed by IOPRIO_CLASS_*. */
+static const char *ioprio_classes[] = {"none", "rt", "be", "idle"};
+
+/**
+ * @brief parse a CPU list like "0-3,8,10-11".
+ * @param s the list.
+ * @param p the placement the CPUs are set in.
+ * @returns 0 on success, -1 if the list is malformed or names a CPU the machine does not have.
+ */
+static int parse_cpus(const char *s, placement *p) {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    long first, last, c;
+    char *end;
+
+    memset(p->cpus, 0, sizeof(p->cpus));
+    do {
+        first = last = strtol(s, &end, 10);
+        if (end == s || first < 0)
+            return -1;
+        if (*end == '-') {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            if (end == s || last < first)
+                return -1;
+        }
+        if (last >= cpus || last >= PLACE_MAX_CPUS)
+            return -1;
+        for (c = first; c <= last; ++c) {
+            p->cpus[c / CPU_WORD_BITS] |= 1UL << (c % CPU_WORD_BITS);
+        }
+        s = end + 1;
+    } while (*end == ',');
+    return *end == '\0' ? 0 : -1;
+}
+
+/**
+ * @brief parse an I/O priority like "idle", "be" or "be:4".
+ * @param s the priority. The level goes from 0 (highest) to 7 and defaults to 4.
+ * @param p the placement the priority is set in.
+ * @returns 0 on success, -1 if the priority is malformed.
+ */
+static int parse_ioprio(const char *s, placement *p) {
+    size_t len = strcspn(s, ":");
+    long level = 4;
+    char *end;
+    int c;
+
+    for (c = IOPRIO_CLASS_RT; c <= IOPRIO_CLASS_IDLE; ++c) {
+        if (strlen(ioprio_classes[c]) == len && strncmp(s, ioprio_classes[c], len) == 0)
+            break;
+    }
+    if (c > IOPRIO_CLASS_IDLE)
+        return -1;
+    if (s[len] == ':') {
+        level = strtol(s + len + 1, &end, 10);
+        if (c == IOPRIO_CLASS_IDLE || *end != '\0' || end == s + len + 1 || level < 0 || level > 7)
+            return -1;
+    }
+    p->ioprio = IOPRIO_PRIO_VALUE(c, c == IOPRIO_CLASS_IDLE ? 0 : level);
+    return 0;
+}
+
+/**
+ * @brief parse one option of 'place'.
+ * @param p the placement the option is set in.
+ * @param opt the option: "-c", "-n" or "-i".
+ * @param value the value of the option.
+ * @returns 0 on success, -1 after printing the error if the option or its value is invalid.
+ */
+int placement_option(placement *p, const char *opt, const char *value) {
+    char *end;
+    long n;
+    int ok = 0;
+
+    if (strcmp(opt, "-c") == 0) {
+        ok = parse_cpus(value, p) == 0;
+        p->set |= ok ? PLACE_CPUS : 0;
+    } else if (strcmp(opt, "-n") == 0) {
+        n = strtol(value, &end, 10);
+        ok = *end == '\0' && end != value && n >= -20 && n <= 19;
+        p->nice = n;
+        p->set |= ok ? PLACE_NICE : 0;
+    } else if (strcmp(opt, "-i") == 0) {
+        ok = parse_ioprio(value, p) == 0;
+        p->set |= ok ? PLACE_IOPRIO : 0;
+    } else {
+        fprintf(stderr, "place: unknown option '%s'\n", opt);
+        return -1;
+    }
+    if (!ok) {
+        fprintf(stderr, "place: invalid value '%s' for %s\n", value, opt);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief combine the shell-wide defaults with the placement of a line.
+ * @param result the combination.
+ * @param line the placement of the line. Its attributes win over the defaults.
+ */
+void placement_merge(placement *result, const placement *line) {
+    *result = default_placement;
+    if (line->set & PLACE_CPUS)
+        memcpy(result->cpus, line->cpus, sizeof(result->cpus));
+    if (line->set & PLACE_NICE)
+        result->nice = line->nice;
+    if (line->set & PLACE_IOPRIO)
+        result->ioprio = line->ioprio;
+    result->set |= line->set;
+}
+
+/**
+ * @brief apply a placement to the calling process.
+ * @param p the placement.
+ *
+ * Called in the child before exec, only system calls are made. An attribute that can not be set,
+ * e.g. a negative nice level without privileges, is skipped and the command runs anyway.
+ */
+void placement_apply(const placement *p) {
+    if (p->set & PLACE_CPUS)
+        sched_setaffinity(0, sizeof(p->cpus), (const cpu_set_t *)p->cpus);
+    if (p->set & PLACE_NICE)
+        setpriority(PRIO_PROCESS, 0, p->nice);
+    if (p->set & PLACE_IOPRIO)
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, p->ioprio);
+}
+
+/**
+ * @brief print a placement in the syntax of 'place'.
+ * @param p the placement.
+ */
+static void placement_print(const placement *p) {
+    int c, first = -1, sep = 0;
+
+    if (p->set == 0) {
+        printf("no placement\n");
+        return;
+    }
+    if (p->set & PLACE_CPUS) {
+        printf("-c ");
+        /* print runs of CPUs as ranges. One past the end closes the last run */
+        for (c = 0; c <= PLACE_MAX_CPUS; ++c) {
+            int on = c < PLACE_MAX_CPUS && (p->cpus[c / CPU_WORD_BITS] >> (c % CPU_WORD_BITS) & 1);
+            if (on && first == -1) {
+                first = c;
+            } else if (!on && first != -1) {
+                printf(c - 1 > first ? "%s%d-%d" : "%s%d", sep ? "," : "", first, c - 1);
+                first = -1;
+                sep = 1;
+            }
+        }
+        printf(" ");
+    }
+    if (p->set & PLACE_NICE)
+        printf("-n %d ", p->nice);
+    if (p->set & PLACE_IOPRIO) {
+        printf("-i %s", ioprio_classes[IOPRIO_PRIO_CLASS(p->ioprio)]);
+        if (IOPRIO_PRIO_CLASS(p->ioprio) != IOPRIO_CLASS_IDLE)
+            printf(":%lu", (unsigned long)IOPRIO_PRIO_DATA(p->ioprio));
+    }
+    printf("\n");
+}
+
+/**
+ * @brief the place builtin: show or set the shell-wide placement.
+ * @param argc argument count.
+ * @param argv 'place', 'place -r' or 'place [-c cpus] [-n nice] [-i class[:level]]'.
+ *
+ * Options that are not given keep their current value, '-r' removes all of them.
+ * 'place' followed by a command is a prefix handled by the parser, it never reaches this function.
+ */
+void place_builtin(int argc, char **argv) {
+    placement p = default_placement;
+    int i;
+
+    if (argc == 1) {
+        placement_print(&default_placement);
+        return;
+    }
+    if (argc == 2 && strcmp(argv[1], "-r") == 0) {
+        memset(&default_placement, 0, sizeof(default_placement));
+        return;
+    }
+    for (i = 1; i < argc; i += 2) {
+        if (i + 1 == argc) {
+            fprintf(stderr, "%s: %s needs a value\n", argv[0], argv[i]);
+            last_status = W_EXITCODE(2, 0);
+            return;
+        }
+        if (placement_option(&p, argv[i], argv[i + 1]) == -1) {
+            last_status = W_EXITCODE(2, 0);
+            return;
+        }
+    }
+    default_placement = p;
+}
+
+/**
+ * @brief a resource of the ulimit builtin.
+ */
+typedef struct ulimit_resource {
+    char option;      /**< the option that selects it. */
+    int resource;     /**< RLIMIT_* */
+    const char *name; /**< description shown by 'ulimit -a'. */
+    rlim_t unit;      /**< bytes (or seconds, or items) per unit of the value the user types. */
+} ulimit_resource;
+
+/** resources known by ulimit, the first one is the default. */
+static const ulimit_resource ulimit_resources[] = {
+    {'f', RLIMIT_FSIZE, "file size (blocks)", 512},
+    {'c', RLIMIT_CORE, "core file size (blocks)", 512},
+    {'d', RLIMIT_DATA, "data seg size (kbytes)", 1024},
+    {'l', RLIMIT_MEMLOCK, "max locked memory (kbytes)", 1024},
+    {'m', RLIMIT_RSS, "max memory size (kbytes)", 1024},
+    {'n', RLIMIT_NOFILE, "open files", 1},
+    {'s', RLIMIT_STACK, "stack size (kbytes)", 1024},
+    {'t', RLIMIT_CPU, "cpu time (seconds)", 1},
+    {'u', RLIMIT_NPROC, "max user processes", 1},
+    {'v', RLIMIT_AS, "virtual memory (kbytes)", 1024},
+};
+
+/** number of entries in \a ulimit_resources. */
+#define ULIMIT_RESOURCES_NUM (sizeof(ulimit_resources) / sizeof(ulimit_resources[0]))
+
+/**
+ * @brief print a limit.
+ * @param r the resource.
+ * @param hard True for the hard limit, else the soft one.
+ * @param name True to print the name of the resource first, like 'ulimit -a'.
+ */
+static void ulimit_print(const ulimit_resource *r, int hard, int name) {
+    struct rlimit rl;
+    rlim_t v;
+
+    getrlimit(r->resource, &rl);
+    v = hard ? rl.rlim_max : rl.rlim_cur;
+    if (name)
+        printf("%-28s (-%c) ", r->name, r->option);
+    if (v == RLIM_INFINITY)
+        printf("unlimited\n");
+    else
+        printf("%llu\n", (unsigned long long)(v / r->unit));
+}
+
+/**
+ * @brief the options of one ulimit call.
+ */
+typedef struct ulimit_args {
+    const ulimit_resource *r; /**< the selected resource. */
+    int soft;                 /**< True with -S. */
+    int hard;                 /**< True with -H. */
+    int all;                  /**< True with -a. */
+    char *value;              /**< the new limit, NULL to print it. */
+} ulimit_args;
+
+/**
+ * @brief parse the arguments of ulimit.
+ * @param argc argument count.
+ * @param argv argument vector.
+ * @param a the result.
+ * @returns 0 on success, -1 on invalid usage.
+ */
+static int ulimit_parse(int argc, char **argv, ulimit_args *a) {
+    size_t k;
+    int i;
+
+    memset(a, 0, sizeof(ulimit_args));
+    a->r = &ulimit_resources[0];
+    for (i = 1; i < argc; ++i) {
+        if (argv[i][0] != '-' || argv[i][1] == '\0' || argv[i][2] != '\0') {
+            /* the value comes last */
+            if (i != argc - 1)
+                return -1;
+            a->value = argv[i];
+        } else if (argv[i][1] == 'S') {
+            a->soft = 1;
+        } else if (argv[i][1] == 'H') {
+            a->hard = 1;
+        } else if (argv[i][1] == 'a') {
+            a->all = 1;
+        } else {
+            for (k = 0; k < ULIMIT_RESOURCES_NUM && ulimit_resources[k].option != argv[i][1]; ++k) {
+            }
+            if (k == ULIMIT_RESOURCES_NUM)
+                return -1;
+            a->r = &ulimit_resources[k];
+        }
+    }
+    return a->all && a->value ? -1 : 0;
+}
+
+/**
+ * @brief the ulimit builtin: show or set the resource limits of the shell and of its children.
+ * @param argc argument count.
+ * @param argv 'ulimit [-S|-H] [-a | -f|-c|-d|-l|-m|-n|-s|-t|-u|-v] [N|unlimited]'.
+ *
+ * Without -S or -H a new value sets both the soft and the hard limit, and the soft limit is
+ * printed. The default resource is -f.
+ */
+void ulimit_builtin(int argc, char **argv) {
+    ulimit_args a;
+    struct rlimit rl;
+    rlim_t n = RLIM_INFINITY;
+    char *end;
+    size_t k;
+
+    if (ulimit_parse(argc, argv, &a) == -1) {
+        printf("%s: invalid usage\n", argv[0]);
+        last_status = W_EXITCODE(2, 0);
+        return;
+    }
+    if (a.all) {
+        for (k = 0; k < ULIMIT_RESOURCES_NUM; ++k) {
+            ulimit_print(&ulimit_resources[k], a.hard && !a.soft, 1);
+        }
+        return;
+    }
+    if (a.value == NULL) {
+        ulimit_print(a.r, a.hard && !a.soft, 0);
+        return;
+    }
+
+    if (strcmp(a.value, "unlimited") != 0) {
+        n = strtoull(a.value, &end, 10);
+        if (*end != '\0' || end == a.value || a.value[0] == '-') {
+            printf("%s: invalid usage\n", argv[0]);
+            last_status = W_EXITCODE(2, 0);
+            return;
+        }
+        n *= a.r->unit;
+    }
+    getrlimit(a.r->resource, &rl);
+    if (a.soft || !a.hard)
+        rl.rlim_cur = n;
+    if (a.hard || !a.soft)
+        rl.rlim_max = n;
+    if (setrlimit(a.r->resource, &rl) == -1) {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], a.r->name, strerror(errno));
+        last_status = W_EXITCODE(EXIT_FAILURE, 0);
+    }
+}
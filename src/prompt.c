@@ -0,0 +1,135 @@
+/** \file prompt.c
+* \brief functions that build the prompt message.
+*
+* The user, host and current working directory are looked up once and cached. Looking up the
+* user can be slow when it goes through NSS (LDAP, sssd...). The cwd is only looked up again
+* after change_directory() succeeds and the prompt is only rebuilt when one of them changed.
+*/
+
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/** cached username, NULL until the first lookup. */
+static char *user_cache = NULL;
+/** cached hostname, empty until the first lookup. */
+static char host_cache[HOST_NAME_MAX + 1];
+/** cached current working directory. Only valid if \a cwd_valid is True. */
+static char cwd_cache[PATH_MAX];
+/** True if \a cwd_cache holds the current working directory. */
+static int cwd_valid = 0;
+
+/** the last built prompt. */
+static char *prompt_buffer = NULL;
+/** allocated size of \a prompt_buffer. */
+static size_t prompt_size = 0;
+/** True if \a prompt_buffer is up to date. */
+static int prompt_valid = 0;
+
+/**
+ * @brief Get the current workind directory.
+ * @returns a char* with the current working directory. The string belongs to the cache.
+ * @returns NULL on failure.
+ */
+const char *shell_get_cwd() {
+    if (!cwd_valid) {
+        if (getcwd(cwd_cache, sizeof(cwd_cache)) == NULL) {
+            perror("cwd");
+            return NULL;
+        }
+        cwd_valid = 1;
+    }
+    return cwd_cache;
+}
+
+/**
+ * @brief Get the current hostname.
+ * @returns a char* with the current hostname. The string belongs to the cache.
+ * @returns NULL on failure.
+ */
+const char *shell_get_host() {
+    if (host_cache[0] == '\0') {
+        if (gethostname(host_cache, HOST_NAME_MAX) != 0) {
+            perror("gethostname");
+            return NULL;
+        }
+        host_cache[HOST_NAME_MAX] = '\0';
+    }
+    return host_cache;
+}
+
+/**
+ * @brief Get the current username.
+ * @returns a char* with the current username. The string belongs to the cache.
+ * @returns NULL on failure.
+ *
+ * Uses the getpwuid() function that returns a pointer to a structure containing the info that interest us.
+ * The name is copied because the structure is overwritten by the next getpw*() call.
+ */
+const char *shell_get_user() {
+    if (user_cache == NULL) {
+        struct passwd *p = getpwuid(getuid());
+        if (!p) {
+            perror("getuid");
+            return NULL;
+        }
+        user_cache = strdup(p->pw_name);
+    }
+    return user_cache;
+}
+
+/**
+ * @brief forget the cached current working directory.
+ *
+ * Must be called every time the shell changes its working directory.
+ */
+void prompt_invalidate_cwd() {
+    cwd_valid = 0;
+    prompt_valid = 0;
+}
+
+/**
+ * @brief Build the prompt message.
+ * @returns the prompt. The string belongs to the cache and is valid until the next call.
+ *
+ * Nothing is looked up and the buffer is not touched if nothing changed since the last call.
+ */
+const char *create_prompt_message() {
+    size_t needed;
+    const char *host;
+    const char *user;
+    const char *cwd;
+
+    if (prompt_valid) {
+        return prompt_buffer;
+    }
+    /* get the strings we need using the shell_get*() functions */
+    user = shell_get_user();
+    host = shell_get_host();
+    cwd = shell_get_cwd();
+    /* calculate the bytes we need using snprintf, only grow the buffer. */
+    needed = snprintf(NULL, 0, "%s@%s:%s$ ", user, host, cwd) + 1;
+    if (needed > prompt_size) {
+        prompt_buffer = realloc(prompt_buffer, needed);
+        prompt_size = needed;
+    }
+    sprintf(prompt_buffer, "%s@%s:%s$ ", user, host, cwd);
+    /* a failed lookup is tried again next time */
+    prompt_valid = user && host && cwd;
+    return prompt_buffer;
+}
+
+/**
+ * @brief free all memory held by the prompt cache.
+ */
+void prompt_free() {
+    free(user_cache);
+    free(prompt_buffer);
+    user_cache = prompt_buffer = NULL;
+    prompt_size = 0;
+    prompt_valid = 0;
+}
@@ -0,0 +1,117 @@
+/** \file reader.c
+* \brief fast line reader for non-interactive input.
+*
+* Scripts, '-c' strings and piped input do not go through readline. They are read in blocks
+* of READ_BLOCK_SIZE bytes and split on '\n' in place, so every line costs one memchr() and no
+* copy. The buffer only grows for lines longer than itself.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/**
+ * @brief start reading from a file descriptor.
+ * @param r the reader.
+ * @param fd the file descriptor. It is not closed by the reader.
+ */
+void reader_open_fd(line_reader *r, int fd) {
+    r->fd = fd;
+    r->size = READ_BLOCK_SIZE;
+    r->buffer = malloc(r->size + 1);
+    r->start = r->end = 0;
+    r->eof = 0;
+}
+
+/**
+ * @brief read lines from a string, e.g. the argument of '-c'.
+ * @param r the reader.
+ * @param s the string. It is copied.
+ */
+void reader_open_string(line_reader *r, const char *s) {
+    r->fd = -1;
+    r->end = strlen(s);
+    r->size = r->end;
+    r->buffer = malloc(r->size + 1);
+    memcpy(r->buffer, s, r->end);
+    r->start = 0;
+    r->eof = 1;
+}
+
+/**
+ * @brief free the buffer of a reader.
+ * @param r the reader.
+ */
+void reader_close(line_reader *r) {
+    free(r->buffer);
+    r->buffer = NULL;
+}
+
+/**
+ * @brief read the next block of input.
+ * @param r the reader.
+ * @returns the number of bytes read, 0 on end of input.
+ *
+ * The unread part of the buffer is moved to its start first. The buffer is doubled if it is
+ * full, which only happens for a line longer than the buffer.
+ */
+static ssize_t fill(line_reader *r) {
+    ssize_t n;
+
+    if (r->start > 0) {
+        memmove(r->buffer, r->buffer + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    if (r->end == r->size) {
+        r->size *= 2;
+        r->buffer = realloc(r->buffer, r->size + 1);
+    }
+    while ((n = read(r->fd, r->buffer + r->end, r->size - r->end)) == -1 && errno == EINTR) {
+    }
+    if (n <= 0) {
+        if (n == -1)
+            perror("read");
+        r->eof = 1;
+        return 0;
+    }
+    r->end += n;
+    return n;
+}
+
+/**
+ * @brief get the next line.
+ * @param r the reader.
+ * @returns the line without its '\n', NULL on end of input.
+ *
+ * The line lives in the buffer of the reader and may be modified by the caller. It is valid
+ * until the next call. A last line without '\n' is returned too.
+ */
+char *reader_next_line(line_reader *r) {
+    char *line;
+    char *nl;
+
+    while (1) {
+        line = r->buffer + r->start;
+        if ((nl = memchr(line, '\n', r->end - r->start)) != NULL) {
+            *nl = '\0';
+            r->start = nl - r->buffer + 1;
+            return line;
+        }
+        if (r->eof || fill(r) == 0) {
+            break;
+        }
+    }
+    if (r->start == r->end) {
+        return NULL;
+    }
+    /* the buffer always has room for this terminator */
+    line = r->buffer + r->start;
+    r->buffer[r->end] = '\0';
+    r->start = r->end;
+    return line;
+}
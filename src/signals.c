@@ -0,0 +1,324 @@
+/** \file signals.c
+* \brief signals, reaping and waiting for children.
+*
+* SIGCHLD and SIGINT stay blocked and are read from signal_fd by the event loop, so nothing runs
+* in signal context. Dead children are reaped here and their records in the job table are
+* marked as complete.
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#include <readline/readline.h>
+
+/** pointer to the current process struct */
+process *current;
+
+/** file descriptor that receives SIGCHLD and SIGINT. Both signals stay blocked, the shell never runs handlers. */
+int signal_fd = -1;
+
+/** False when running a script, a '-c' string or input that is not a terminal. */
+int interactive = 1;
+
+/** the exit status of the last foreground command, in the format of waitpid(). */
+int last_status = 0;
+
+/** set by SIGINT in non-interactive mode. The shell stops once the foreground command is done. */
+int script_interrupted = 0;
+
+/** True while the readline callback handler is installed, i.e. the prompt is shown and the user may type. */
+int readline_active = 0;
+
+/**
+ * @brief Handles interrupts (e.g. ctrl-c) that happen while the main process is running without a foreground process
+ * active.
+ *
+ * Throws away what the user typed so far, with the lines of a block that is still open, and shows a fresh
+ * prompt. The line does not reach the history log.
+ */
+void interrupt_handle() {
+    printf("\n");
+    fflush(stdout);
+    rl_free_line_state();
+    rl_callback_sigcleanup();
+    rl_replace_line("", 0);
+    rl_on_new_line();
+    if (drop_open_block())
+        rl_set_prompt(create_prompt_message());
+    rl_redisplay();
+}
+
+/** the prompt shown when the user is asked to confirm the process kill */
+#define KILL_MSG "terminate foreground process group %d? (Y/N/a - always)\n"
+
+/** if false the active process is always killed when ctrl-c is pressed */
+int ask_to_kill = 1;
+
+/** set when ctrl-c killed the foreground process group. Commands that launch many groups, like parallel, stop. */
+int foreground_interrupted = 0;
+
+/** the pid of the shell. Builtins that run as a pipeline stage see a different getpid(). */
+pid_t shell_pid = 0;
+
+/**
+ * @brief Handles interrupts (e.g. ctrl-c) that happen while the main process is running with a foreground process
+ * active.
+ *
+ * asks the user to confirm killing the foreground process. If \a ask_to_kill is set to false, the foreground process is
+ * always killed. Without a current process, e.g. when all jobs of a parallel run just ended, there is nothing to ask
+ * about and the foreground work is only marked interrupted.
+ */
+void killer_interrupt_handle() {
+    char *line;
+    char msg[sizeof(KILL_MSG) + MAX_PID_LENGTH];
+    int no_kill = 1;
+
+    if (current == NULL) {
+        foreground_interrupted = 1;
+        return;
+    }
+    while (ask_to_kill && no_kill) {
+        sprintf(msg, KILL_MSG, current->pgid);
+        line = readline(msg);
+        if (line == NULL)
+            continue;
+        else if (strcasecmp(line, "y") == 0)
+            no_kill = 0;
+        else if (strcasecmp(line, "n") == 0)
+            return;
+        else if (strcasecmp(line, "a") == 0)
+            ask_to_kill = no_kill = 0;
+        else
+            printf("wrong option\n");
+    }
+    foreground_interrupted = 1;
+    if (current->completed) {
+        printf("process already dead\n");
+    } else
+        kill(-current->pgid, SIGTERM); /* the whole pipeline */
+}
+
+/**
+ * @brief Sets the behavior for some interrupting signals.
+ * @param handler_code set to SET_DFL or SET_IGN.
+ */
+void mass_signal_set(int handler_code) {
+    switch (handler_code) {
+        /* default behavior */
+        case SET_DFL:
+            signal(SIGINT, SIG_DFL);
+            signal(SIGQUIT, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+            signal(SIGTTIN, SIG_DFL);
+            signal(SIGTTOU, SIG_DFL);
+            break;
+        case SET_IGN:
+            /* SIGINT is read from signal_fd */
+            signal(SIGQUIT, SIG_IGN);
+            signal(SIGTSTP, SIG_IGN);
+            signal(SIGTTIN, SIG_IGN);
+            signal(SIGTTOU, SIG_IGN);
+    }
+}
+
+/*! If True all processes that die are printed (not only bg). */
+int always_print_dead = 0;
+
+/**
+ * @brief handle dead processes.
+ *
+ * Called from the event loop whenever signal_fd reports SIGCHLD. Signals coalesce, one SIGCHLD
+ * may stand for many dead children, so wait4() is called until no dead child is left and
+ * every one of them is marked as complete in the job table, together with the resources it
+ * used. Completed background records are kept for 'jobs', and queued background pipelines are
+ * started in the slots they free. Nothing here runs in signal context.
+ */
+void harvest_dead_child() {
+    process *p;
+    pid_t target_id;
+    int status;
+    struct rusage usage;
+    int printed = 0; /* True if a message was printed over the prompt */
+    int freed = 0;   /* True if a background process ended */
+
+    /* wait4() will find the processes that exited. */
+    while ((target_id = wait4(-1, &status, WNOHANG, &usage)) != 0) {
+        if (target_id < 0) {
+            if (errno == EINTR)
+                continue;
+            /* ECHILD: no children left, e.g. posix_spawn() already collected a child whose exec failed */
+            break;
+        }
+        if (WIFSIGNALED(status)) {
+            /* child process was terminated by a signal
+             * print to stderr the termination signal message */
+            char msg[SIGNAL_MSG_LENGTH];
+            sprintf(msg, "[%d] exited with status %d", target_id, status);
+            psignal(WTERMSIG(status), msg);
+            printed = 1;
+        } else if (always_print_dead) {
+            printf("[%d] exited with status %d\n", target_id, status);
+            printed = 1;
+        }
+
+        if ((p = pop_from_pid(target_id)) == NULL) {
+            fprintf(stderr, "ERROR: terminated child not found in the job table\n");
+            continue;
+        }
+        p->completed = 1;
+        p->status = status;
+        p->usage = usage;
+        clock_gettime(CLOCK_MONOTONIC, &p->end);
+        if (p->bg) {
+            job_finish(p); /* don't keep fg processes, run_pipeline() releases them. */
+            if (!always_print_dead && !WIFSIGNALED(status) && interactive) {
+                printf("[%d] exited with status %d\n", target_id, status);
+            }
+            printed = freed = 1;
+        }
+    }
+    if (freed && job_queue_length() > 0) {
+        /* a background job ended, its slot goes to the next queued one */
+        run_queued_jobs();
+    }
+    if (printed && readline_active) {
+        /* reset the display once printing is done. */
+        rl_forced_update_display();
+    }
+}
+
+/**
+ * @brief read and handle all pending signals from signal_fd.
+ * @param foreground True while a foreground process runs. SIGINT then asks to kill it.
+ */
+void handle_signals(int foreground) {
+    struct signalfd_siginfo info;
+    int chld = 0;
+
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGCHLD) {
+            chld = 1; /* reap once, after all pending signals are read */
+        } else if (info.ssi_signo == SIGINT) {
+            if (!interactive) {
+                /* nobody to ask: interrupt the foreground command and stop the script */
+                script_interrupted = foreground_interrupted = 1;
+                if (foreground && current)
+                    kill(-current->pgid, SIGINT);
+            } else if (foreground)
+                killer_interrupt_handle();
+            else if (readline_active)
+                interrupt_handle();
+        }
+    }
+    if (chld)
+        harvest_dead_child();
+}
+
+/**
+ * @brief handle pending signals without waiting, while the shell itself is busy.
+ * @returns True if ctrl-c was pressed.
+ *
+ * For work of the shell that starts no foreground process, like a loop of builtins: ctrl-c
+ * stops it as if it had killed a foreground pipeline.
+ */
+int poll_interrupt() {
+    struct signalfd_siginfo info;
+    int chld = 0, interrupted = 0;
+
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGINT)
+            interrupted = 1;
+        else
+            chld = 1;
+    }
+    if (chld)
+        harvest_dead_child();
+    if (interrupted) {
+        if (interactive)
+            printf("\n"); /* after the ^C of the terminal */
+        foreground_interrupted = 1;
+        script_interrupted = !interactive;
+        last_status = W_EXITCODE(128 + SIGINT, 0);
+    }
+    return interrupted;
+}
+
+/**
+ * @brief block until all processes of a foreground pipeline complete.
+ * @param procs the records of the processes. The caller releases them.
+ * @param count number of elements in \a procs.
+ * @param last_started True if the last process of the pipeline is the last of \a procs. Else it failed
+ * to start and the status it left, see launch_one(), is kept.
+ *
+ * Only signal_fd is watched, the user can not type while a foreground process runs.
+ */
+void wait_for_processes(process **procs, int count, int last_started) {
+    struct pollfd pfd;
+    int i = 0;
+
+    current = count > 0 ? procs[0] : NULL;
+    pfd.fd = signal_fd;
+    pfd.events = POLLIN;
+    /* if a child died already, SIGCHLD is waiting in signal_fd and the first poll() returns at once */
+    while (i < count) {
+        if (procs[i]->completed) {
+            i++;
+        } else if (poll(&pfd, 1, -1) > 0) {
+            handle_signals(1);
+        }
+    }
+    /* like a shell, the status of a pipeline is the status of its last process */
+    if (count > 0 && last_started)
+        last_status = procs[count - 1]->status;
+    current = NULL;
+}
+
+/**
+ * @brief block SIGCHLD and SIGINT and create signal_fd to receive them.
+ */
+void setup_signals() {
+    sigset_t mask;
+
+    /* Shell shouldn't terminate on signals */
+    mass_signal_set(SET_IGN);
+
+    shell_pid = getpid();
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    if ((signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief create signal_fd in a child of the shell that launches and waits for children of its own.
+ * @returns 0 on success, -1 after printing why.
+ *
+ * signal_fd of the shell is closed in its children, and they start with an empty signal mask.
+ * Only SIGCHLD is blocked, SIGINT keeps its default action.
+ */
+int setup_child_signals() {
+    sigset_t chld;
+
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+    if ((signal_fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+        perror("signalfd");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,610 @@
+/** \file source.c
+* \brief the source builtin and its cache of compiled scripts.
+*
+* 'source file' runs a script inside the shell, so the variables it sets stay set. The script is
+* compiled as a whole, see control.c, and the program is saved in ~/.source_cache, in a file
+* named after a hash of the real path of the script. The cache file records that path and the
+* mtime and size of the script. Sourcing the unchanged script again maps the cache file instead
+* of reading, splitting and lexing the script: the instructions are used in place, the pipelines
+* and tokens only get pointers into the mapping.
+*
+* A cache file is written under a temporary name and renamed, so a shell never maps a half
+* written one. A cache file that does not match its script, or is damaged, is compiled again.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/**
+ * @brief the header of a cache file.
+ *
+ * It is followed by the path of the script with its '\0', padded to 8 bytes, then the
+ * instructions, the pipelines, the for loops, the tokens and the strings.
+ */
+typedef struct source_header {
+    uint64_t magic;      /**< SOURCE_MAGIC. */
+    uint64_t mtime_sec;  /**< mtime of the script, seconds. */
+    uint64_t mtime_nsec; /**< mtime of the script, nanoseconds. */
+    uint64_t size;       /**< size of the script. */
+    uint64_t sum;        /**< FNV-1a hash of the rest of the file, to tell a damaged one. */
+    uint32_t path_len;   /**< length of the path, without its '\0'. */
+    uint32_t length;     /**< number of instructions. */
+    uint32_t commands;   /**< number of pipelines. */
+    uint32_t loops;      /**< number of for loops. */
+    uint32_t tokens;     /**< number of tokens. */
+    uint32_t strings;    /**< bytes of strings. */
+} source_header;
+
+/**
+ * @brief a pipeline in a cache file.
+ */
+typedef struct source_command {
+    int32_t first;      /**< index of its first token. */
+    int32_t count;      /**< number of tokens. */
+    int32_t background; /**< True if it ended with '&'. */
+} source_command;
+
+/**
+ * @brief a for loop in a cache file.
+ */
+typedef struct source_loop {
+    int32_t name;  /**< offset of the variable name in the strings. */
+    int32_t first; /**< index of the token of its first word. */
+    int32_t count; /**< number of words. */
+    int32_t end;   /**< the instruction after the loop. */
+} source_loop;
+
+/**
+ * @brief a token in a cache file. The offsets are in the strings, -1 for none.
+ */
+typedef struct source_token {
+    int32_t type;   /**< one of the values of \enum token_types. */
+    int32_t text;   /**< offset of the word. */
+    int32_t glob;   /**< offset of the pattern marks, as long as the word with its '\0'. */
+    int32_t refs;   /**< offset of the reference marks, as long as the word with its '\0'. */
+    int32_t quoted; /**< True if the word had quotes. */
+} source_token;
+
+/**
+ * @brief the sections of a cache file.
+ */
+typedef struct source_layout {
+    size_t code;     /**< offset of the instructions. */
+    size_t commands; /**< offset of the pipelines. */
+    size_t loops;    /**< offset of the for loops. */
+    size_t tokens;   /**< offset of the tokens. */
+    size_t strings;  /**< offset of the strings. */
+    size_t total;    /**< size of the file. */
+} source_layout;
+
+/** nesting depth of source, so a script that sources itself fails instead of overflowing the stack. */
+static int source_depth = 0;
+
+/**
+ * @brief compute where the sections of a cache file are.
+ * @param h the header.
+ * @param l the result.
+ */
+static void layout(const source_header *h, source_layout *l) {
+    l->code = sizeof(source_header) + ((h->path_len + 1 + 7) & ~(size_t)7);
+    l->commands = l->code + h->length * sizeof(instruction);
+    l->loops = l->commands + h->commands * sizeof(source_command);
+    l->tokens = l->loops + h->loops * sizeof(source_loop);
+    l->strings = l->tokens + h->tokens * sizeof(source_token);
+    l->total = l->strings + h->strings;
+}
+
+/**
+ * @brief hash bytes with FNV-1a.
+ * @param p the bytes.
+ * @param n number of bytes.
+ * @returns the hash.
+ */
+static uint64_t fnv1a(const void *p, size_t n) {
+    const unsigned char *s = p;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while (n--) {
+        hash = (hash ^ *s++) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief get the name of the cache file of a script.
+ * @param real the real path of the script.
+ * @param cache where the name is stored, PATH_MAX bytes.
+ * @returns 0 on success, -1 if there is no HOME or the name is too long.
+ *
+ * The cache directory is created if it does not exist. Its files are named after the FNV-1a hash
+ * of the path, the header tells the rare scripts that share one apart.
+ */
+static int cache_name(const char *real, char *cache) {
+    const char *home = var_get("HOME");
+    int n;
+
+    if (home == NULL || (n = snprintf(cache, PATH_MAX, "%s/.source_cache", home)) >= PATH_MAX - 20) {
+        return -1;
+    }
+    if (mkdir(cache, 0700) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    snprintf(cache + n, PATH_MAX - n, "/%016llx", (unsigned long long)fnv1a(real, strlen(real)));
+    return 0;
+}
+
+/**
+ * @brief check that a string lies inside the strings of a cache file.
+ * @param strings the strings.
+ * @param size their size. The last byte is '\0'.
+ * @param off the offset of the string.
+ * @param len where the length of the string is stored.
+ * @returns True if \a off is valid.
+ */
+static int valid_string(const char *strings, size_t size, int32_t off, size_t *len) {
+    if (off < 0 || (size_t)off >= size) {
+        return 0;
+    }
+    *len = strlen(strings + off);
+    return 1;
+}
+
+/**
+ * @brief check that the marks of a word lie inside the strings of a cache file.
+ * @param strings the strings.
+ * @param size their size.
+ * @param off the offset of the marks, -1 for none.
+ * @param len length of the word.
+ * @param refs True for reference marks, which must not run past the end of the word.
+ * @returns True if the marks are valid.
+ */
+static int valid_marks(const char *strings, size_t size, int32_t off, size_t len, int refs) {
+    const unsigned char *m;
+    size_t i;
+
+    if (off == -1) {
+        return 1;
+    }
+    if (off < 0 || (size_t)off + len + 1 > size) {
+        return 0;
+    }
+    m = (const unsigned char *)strings + off;
+    for (i = 0; refs && i < len; i += m[i] ? m[i] : 1) {
+        if (i + m[i] > len)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief check the instructions of a mapped program.
+ * @param p the program.
+ * @returns True if every argument is in range.
+ */
+static int valid_code(const program *p) {
+    const instruction *ins;
+    int i;
+
+    for (i = 0; i < p->length; ++i) {
+        ins = &p->code[i];
+        switch (ins->code) {
+            case INS_RUN:
+                if (ins->arg < 0 || ins->arg >= p->commands_count)
+                    return 0;
+                break;
+            case INS_JUMP:
+            case INS_JUMP_FAIL:
+            case INS_JUMP_OK:
+                if (ins->arg < 0 || ins->arg > p->length)
+                    return 0;
+                break;
+            case INS_FOR_START:
+            case INS_FOR_NEXT:
+                if (ins->arg < 0 || ins->arg >= p->loops_count)
+                    return 0;
+                break;
+            case INS_FORGET:
+            case INS_KEEP:
+            case INS_RESTORE:
+            case INS_SUCCEED:
+                break;
+            default:
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief map the cache file of a script and check its header.
+ * @param cache the name of the cache file.
+ * @param real the real path of the script.
+ * @param st the status of the script.
+ * @param l where the layout of the file is stored.
+ * @param len where the length of the mapping is stored.
+ * @returns the mapping, NULL if there is no cache file for this version of the script.
+ */
+static char *map_cache(const char *cache, const char *real, const struct stat *st, source_layout *l, size_t *len) {
+    const source_header *h;
+    struct stat cst;
+    char *base;
+    int fd;
+
+    if ((fd = open(cache, O_RDONLY | O_CLOEXEC)) == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &cst) == -1 || cst.st_size < (off_t)sizeof(source_header) ||
+        (base = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    *len = cst.st_size;
+    h = (const source_header *)base;
+    layout(h, l);
+    if (h->magic != SOURCE_MAGIC || h->mtime_sec != (uint64_t)st->st_mtim.tv_sec ||
+        h->mtime_nsec != (uint64_t)st->st_mtim.tv_nsec || h->size != (uint64_t)st->st_size ||
+        h->path_len != strlen(real) || l->total != *len || strcmp(base + sizeof(source_header), real) != 0 ||
+        h->strings == 0 || base[l->total - 1] != '\0' ||
+        h->sum != fnv1a(base + sizeof(source_header), l->total - sizeof(source_header))) {
+        munmap(base, *len);
+        return NULL;
+    }
+    return base;
+}
+
+/**
+ * @brief give the tokens of a cache file pointers into its mapping.
+ * @param base the mapping.
+ * @param l its layout.
+ * @param tokens where the tokens are stored.
+ * @returns 0 on success, -1 if a token is damaged.
+ */
+static int load_tokens(const char *base, const source_layout *l, token *tokens) {
+    const source_header *h = (const source_header *)base;
+    const source_token *t = (const source_token *)(base + l->tokens);
+    const char *strings = base + l->strings;
+    uint32_t i;
+    size_t n;
+
+    for (i = 0; i < h->tokens; ++i) {
+        tokens[i].type = t[i].type;
+        tokens[i].text = tokens[i].end = tokens[i].glob = tokens[i].refs = NULL;
+        tokens[i].quoted = t[i].quoted;
+        if (t[i].type != TOK_WORD) {
+            if (t[i].type < TOK_PIPE || t[i].type > TOK_AMP)
+                return -1;
+            continue;
+        }
+        if (!valid_string(strings, h->strings, t[i].text, &n) || !valid_marks(strings, h->strings, t[i].glob, n, 0) ||
+            !valid_marks(strings, h->strings, t[i].refs, n, 1)) {
+            return -1;
+        }
+        /* the strings are never written to, see build_pipeline() */
+        tokens[i].text = (char *)strings + t[i].text;
+        tokens[i].glob = t[i].glob == -1 ? NULL : (char *)strings + t[i].glob;
+        tokens[i].refs = t[i].refs == -1 ? NULL : (char *)strings + t[i].refs;
+    }
+    return 0;
+}
+
+/**
+ * @brief load the pipelines and for loops of a cache file.
+ * @param base the mapping.
+ * @param l its layout.
+ * @param tokens the tokens, from load_tokens().
+ * @param p the program. Its vectors are allocated from line_arena.
+ * @returns 0 on success, -1 if a pipeline or loop is damaged.
+ *
+ * The builtins of the pipelines are looked up again: a cache file outlives the shell that wrote it.
+ */
+static int load_blocks(const char *base, const source_layout *l, token *tokens, program *p) {
+    const source_header *h = (const source_header *)base;
+    const source_command *c = (const source_command *)(base + l->commands);
+    const source_loop *f = (const source_loop *)(base + l->loops);
+    const char *strings = base + l->strings;
+    uint32_t i;
+    size_t n;
+
+    p->commands = arena_alloc(&line_arena, h->commands * sizeof(block_command));
+    for (i = 0; i < h->commands; ++i) {
+        if (c[i].first < 0 || c[i].count < 0 || (uint32_t)c[i].first + c[i].count > h->tokens)
+            return -1;
+        p->commands[i].tokens = tokens + c[i].first;
+        p->commands[i].count = c[i].count;
+        p->commands[i].background = c[i].background;
+        resolve_command(&p->commands[i]);
+    }
+    p->loops = arena_alloc(&line_arena, h->loops * sizeof(for_loop));
+    for (i = 0; i < h->loops; ++i) {
+        if (!valid_string(strings, h->strings, f[i].name, &n) || f[i].first < 0 || f[i].count < 0 ||
+            (uint32_t)f[i].first + f[i].count > h->tokens || f[i].end < 0 || (uint32_t)f[i].end > h->length)
+            return -1;
+        p->loops[i].name = (char *)strings + f[i].name;
+        p->loops[i].words = tokens + f[i].first;
+        p->loops[i].count = f[i].count;
+        p->loops[i].end = f[i].end;
+    }
+    p->commands_count = h->commands;
+    p->loops_count = h->loops;
+    return 0;
+}
+
+/**
+ * @brief load the program of a script from its cache file.
+ * @param cache the name of the cache file.
+ * @param real the real path of the script.
+ * @param st the status of the script.
+ * @param p where the program is stored. Its instructions are the ones in the mapping.
+ * @param len where the length of the mapping is stored.
+ * @returns the mapping, to unmap once the program ran. NULL if there is no valid cache file for
+ * this version of the script.
+ */
+static char *load_cache(const char *cache, const char *real, const struct stat *st, program *p, size_t *len) {
+    const source_header *h;
+    source_layout l;
+    token *tokens;
+    char *base;
+
+    if ((base = map_cache(cache, real, st, &l, len)) == NULL) {
+        return NULL;
+    }
+    h = (const source_header *)base;
+    memset(p, 0, sizeof(*p));
+    p->code = (instruction *)(base + l.code);
+    p->length = h->length;
+    tokens = arena_alloc(&line_arena, h->tokens * sizeof(token));
+    if (load_tokens(base, &l, tokens) == -1 || load_blocks(base, &l, tokens, p) == -1 || !valid_code(p)) {
+        munmap(base, *len);
+        return NULL;
+    }
+    return base;
+}
+
+/**
+ * @brief the bytes a token adds to the strings of a cache file.
+ * @param t the token.
+ * @returns the size of its word and of its marks.
+ */
+static size_t token_strings(const token *t) {
+    size_t n = t->type == TOK_WORD ? strlen(t->text) + 1 : 0;
+    return n + (t->glob ? n : 0) + (t->refs ? n : 0);
+}
+
+/**
+ * @brief append bytes to the strings of a cache file.
+ * @param strings the strings.
+ * @param used pointer to the bytes used so far, advanced.
+ * @param s the bytes, NULL for none.
+ * @param n number of bytes.
+ * @returns the offset of the bytes, -1 for none.
+ */
+static int32_t put_string(char *strings, size_t *used, const char *s, size_t n) {
+    int32_t off = *used;
+
+    if (s == NULL) {
+        return -1;
+    }
+    memcpy(strings + *used, s, n);
+    *used += n;
+    return off;
+}
+
+/**
+ * @brief write a token to a cache file.
+ * @param t the token.
+ * @param st where it is written.
+ * @param strings the strings.
+ * @param used pointer to the bytes of strings used so far, advanced.
+ */
+static void put_token(const token *t, source_token *st, char *strings, size_t *used) {
+    size_t n = t->type == TOK_WORD ? strlen(t->text) + 1 : 0;
+
+    st->type = t->type;
+    st->quoted = t->quoted;
+    st->text = put_string(strings, used, t->text, n);
+    st->glob = put_string(strings, used, t->glob, n);
+    st->refs = put_string(strings, used, t->refs, n);
+}
+
+/**
+ * @brief save the program of a script in its cache file.
+ * @param cache the name of the cache file.
+ * @param real the real path of the script.
+ * @param st the status of the script when it was read.
+ * @param p the program.
+ *
+ * The file is built in line_arena and written at once. Errors are ignored: the script is then
+ * compiled again the next time.
+ */
+static void save_cache(const char *cache, const char *real, const struct stat *st, const program *p) {
+    char tmp[PATH_MAX + 8];
+    source_header h;
+    source_layout l;
+    source_command *sc;
+    source_loop *sl;
+    source_token *stok;
+    char *base, *strings;
+    size_t used = 1; /* offset 0 holds "", so the strings are never empty */
+    uint32_t k = 0;
+    int i, j, fd;
+
+    memset(&h, 0, sizeof(h));
+    h.magic = SOURCE_MAGIC;
+    h.mtime_sec = st->st_mtim.tv_sec;
+    h.mtime_nsec = st->st_mtim.tv_nsec;
+    h.size = st->st_size;
+    h.path_len = strlen(real);
+    h.length = p->length;
+    h.commands = p->commands_count;
+    h.loops = p->loops_count;
+    h.strings = 1;
+    for (i = 0; i < p->commands_count; ++i) {
+        h.tokens += p->commands[i].count;
+        for (j = 0; j < p->commands[i].count; ++j)
+            h.strings += token_strings(&p->commands[i].tokens[j]);
+    }
+    for (i = 0; i < p->loops_count; ++i) {
+        h.tokens += p->loops[i].count;
+        h.strings += strlen(p->loops[i].name) + 1;
+        for (j = 0; j < p->loops[i].count; ++j)
+            h.strings += token_strings(&p->loops[i].words[j]);
+    }
+    layout(&h, &l);
+    base = arena_alloc(&line_arena, l.total);
+    memset(base, 0, l.code);
+    memcpy(base, &h, sizeof(h));
+    memcpy(base + sizeof(h), real, h.path_len + 1);
+    memcpy(base + l.code, p->code, p->length * sizeof(instruction));
+    sc = (source_command *)(base + l.commands);
+    sl = (source_loop *)(base + l.loops);
+    stok = (source_token *)(base + l.tokens);
+    strings = base + l.strings;
+    strings[0] = '\0';
+    for (i = 0; i < p->commands_count; ++i) {
+        sc[i].first = k;
+        sc[i].count = p->commands[i].count;
+        sc[i].background = p->commands[i].background;
+        for (j = 0; j < p->commands[i].count; ++j)
+            put_token(&p->commands[i].tokens[j], &stok[k++], strings, &used);
+    }
+    for (i = 0; i < p->loops_count; ++i) {
+        sl[i].name = put_string(strings, &used, p->loops[i].name, strlen(p->loops[i].name) + 1);
+        sl[i].first = k;
+        sl[i].count = p->loops[i].count;
+        sl[i].end = p->loops[i].end;
+        for (j = 0; j < p->loops[i].count; ++j)
+            put_token(&p->loops[i].words[j], &stok[k++], strings, &used);
+    }
+    ((source_header *)base)->sum = fnv1a(base + sizeof(h), l.total - sizeof(h));
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", cache);
+    if ((fd = mkstemp(tmp)) == -1) {
+        return;
+    }
+    if (write(fd, base, l.total) != (ssize_t)l.total || close(fd) == -1 || rename(tmp, cache) == -1) {
+        unlink(tmp);
+    }
+}
+
+/**
+ * @brief read a whole file.
+ * @param fd the file.
+ * @param len where the length is stored.
+ * @returns the '\0' terminated contents in line_arena, NULL on a read error.
+ */
+static char *read_file(int fd, size_t *len) {
+    size_t cap = READ_BLOCK_SIZE;
+    char *text = arena_alloc(&line_arena, cap);
+    ssize_t n;
+
+    *len = 0;
+    while ((n = read(fd, text + *len, cap - *len - 1)) != 0) {
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return NULL;
+        *len += n;
+        if (cap - *len == 1) {
+            text = arena_grow(&line_arena, text, cap, cap * 2);
+            cap *= 2;
+        }
+    }
+    text[*len] = '\0';
+    return text;
+}
+
+/**
+ * @brief run the program of a script, inside the shell or in a pipeline stage.
+ * @param p the program.
+ *
+ * A stage starts with an empty signal mask and without signal_fd, see setup_child_signals(), so
+ * it creates its own before it waits for the commands of the script.
+ */
+static void run_script(program *p) {
+    sigset_t mask;
+
+    sigprocmask(SIG_BLOCK, NULL, &mask);
+    if (!sigismember(&mask, SIGCHLD)) {
+        interactive = 0;
+        if (setup_child_signals() == -1) {
+            last_status = W_EXITCODE(EXIT_FAILURE, 0);
+            return;
+        }
+    }
+    source_depth++;
+    run_program(p);
+    source_depth--;
+}
+
+/**
+ * @brief the source builtin. Runs a script inside the shell.
+ * @param argc argument count.
+ * @param argv 'source file'.
+ *
+ * The status is the one of the last command of the script, 2 on a syntax error, which stops the
+ * script before any of it runs. The cache is used for regular files only.
+ */
+void source_builtin(int argc, char **argv) {
+    char real[PATH_MAX], cache[PATH_MAX];
+    list_item *items;
+    struct stat st;
+    program p;
+    char *text, *map;
+    size_t len;
+    int fd, count, cached;
+
+    if (argc != 2) {
+        printf("%s: invalid usage\n", argv[0]);
+        last_status = W_EXITCODE(2, 0);
+        return;
+    }
+    if (source_depth == SOURCE_DEPTH_MAX) {
+        fprintf(stderr, "%s: %s: too many nested scripts\n", argv[0], argv[1]);
+        last_status = W_EXITCODE(EXIT_FAILURE, 0);
+        return;
+    }
+    if ((fd = open(argv[1], O_RDONLY | O_CLOEXEC)) == -1 || fstat(fd, &st) == -1) {
+        perror(argv[1]);
+        if (fd != -1)
+            close(fd);
+        last_status = W_EXITCODE(EXIT_FAILURE, 0);
+        return;
+    }
+    cached = S_ISREG(st.st_mode) && realpath(argv[1], real) && cache_name(real, cache) == 0;
+    if (cached && (map = load_cache(cache, real, &st, &p, &len)) != NULL) {
+        close(fd);
+        run_script(&p);
+        munmap(map, len);
+        return;
+    }
+
+    text = read_file(fd, &len);
+    close(fd);
+    if (text == NULL) {
+        perror(argv[1]);
+        last_status = W_EXITCODE(EXIT_FAILURE, 0);
+        return;
+    }
+    if ((count = split_list(text, &line_arena, &items)) <= 0 || compile_program(items, count, 0, &p) == -1) {
+        last_status = W_EXITCODE(count == 0 ? 0 : 2, 0);
+        return;
+    }
+    if (cached)
+        save_cache(cache, real, &st, &p);
+    run_script(&p);
+}
@@ -0,0 +1,357 @@
+/** \file spawn.c
+* \brief functions that launch child processes.
+*
+* The shell can create its children with one of several engines. posix_spawn() is the default,
+* it avoids copying the page tables of the shell. The vfork engine does the same with a
+* clone(CLONE_VM | CLONE_VFORK) child that runs on a private stack. fork() is kept as a fallback
+* and for comparison. The engine is chosen at startup with the -e option.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/** the environment of the child being launched, from vars_envp(). */
+static char **child_envp = NULL;
+
+/** the engine used by spawn_command(). One of the values of \enum spawn_engines. */
+int spawn_engine = ENGINE_SPAWN;
+
+/** names of the engines, indexed by their code. */
+static const char *engine_names[ENGINES_NUM] = {"spawn", "vfork", "fork"};
+
+/**
+ * @brief a cached set of posix_spawn() file actions.
+ */
+typedef struct cached_actions {
+    int fd_in;                          /**< the fd that becomes stdin, -1 if not redirected. */
+    int fd_out;                         /**< the fd that becomes stdout, -1 if not redirected. */
+    int used;                           /**< True if \a actions is initialized. */
+    posix_spawn_file_actions_t actions; /**< the dup2 actions for \a fd_in and \a fd_out. */
+} cached_actions;
+
+/** file actions by redirection. Pipes reuse the same low fds line after line, so a few entries are enough. */
+static cached_actions actions_cache[SPAWN_ACTIONS_CACHE_SIZE];
+/** the entry replaced on the next miss. */
+static int actions_victim = 0;
+
+/** signals that the shell ignores or handles and its children must get with their default action. */
+static const int reset_signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD};
+
+/**
+ * @brief select the engine from its name.
+ * @param name one of "spawn", "vfork" or "fork".
+ * @returns 0 on success, -1 if the name is unknown.
+ */
+int set_spawn_engine(const char *name) {
+    int i;
+    for (i = 0; i < ENGINES_NUM; ++i) {
+        if (strcmp(engine_names[i], name) == 0) {
+            spawn_engine = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief get the name of the selected engine.
+ * @returns the name of \a spawn_engine.
+ */
+const char *spawn_engine_name() { return engine_names[spawn_engine]; }
+
+/**
+ * @brief prepare the process state of a child before exec.
+ * @param spec the command to launch.
+ * @param mask the signal mask the child must run with.
+ *
+ * Used by the fork and vfork engines. Every signal the shell handles or ignores on purpose
+ * gets its default action back, the other ignored signals stay ignored like with a plain fork().
+ * Only async-signal-safe calls are made, this runs in a vfork() style child too.
+ */
+static void child_setup(const launch_spec *spec, const sigset_t *mask) {
+    struct sigaction dfl;
+    unsigned i;
+
+    memset(&dfl, 0, sizeof(dfl));
+    dfl.sa_handler = SIG_DFL;
+    for (i = 0; i < sizeof(reset_signals) / sizeof(reset_signals[0]); ++i) {
+        sigaction(reset_signals[i], &dfl, NULL);
+    }
+    setpgid(0, spec->pgid);
+    if (spec->fd_in != -1)
+        dup2(spec->fd_in, STDIN_FILENO);
+    if (spec->fd_out != -1)
+        dup2(spec->fd_out, STDOUT_FILENO);
+    if (spec->place)
+        placement_apply(spec->place);
+    sigprocmask(SIG_SETMASK, mask, NULL);
+}
+
+/**
+ * @brief exec the command of a child. Only returns on failure.
+ * @param spec the command to launch.
+ * @returns the errno of the failed exec.
+ */
+static int child_exec(const launch_spec *spec) {
+    if (spec->path) {
+        execve(spec->path, spec->argv, child_envp);
+    }
+    /* not cached, or the cached file is gone: let execvpe() search PATH */
+    execvpe(spec->argv[0], spec->argv, child_envp);
+    return errno;
+}
+
+/**
+ * @brief arguments shared between the parent and a vfork engine child.
+ */
+typedef struct vfork_args {
+    const launch_spec *spec; /**< the command to launch. */
+    const sigset_t *mask;    /**< the signal mask of the child. */
+    int err;                 /**< set by the child if exec fails. */
+} vfork_args;
+
+/**
+ * @brief entry point of a vfork engine child.
+ * @param arg pointer to the \a vfork_args of the parent.
+ * @returns never, the child execs or exits.
+ *
+ * The child shares the memory of the suspended parent, so the exec error is reported by writing
+ * it in \a arg.
+ */
+static int vfork_child(void *arg) {
+    vfork_args *args = arg;
+    child_setup(args->spec, args->mask);
+    args->err = child_exec(args->spec);
+    _exit(127);
+}
+
+/** stack used by the vfork engine children. The parent is suspended while it is used, so one is enough. */
+static char vfork_stack[VFORK_STACK_SIZE] __attribute__((aligned(16)));
+
+/**
+ * @brief launch with clone(CLONE_VM | CLONE_VFORK).
+ * @param spec the command to launch.
+ * @param mask the signal mask the child must run with.
+ * @returns the pid of the child, -1 with errno set on failure.
+ *
+ * All signals are blocked around clone() so no handler of the shell can run on the shared memory
+ * before the child resets them.
+ */
+static pid_t spawn_vfork(const launch_spec *spec, const sigset_t *mask) {
+    vfork_args args;
+    sigset_t all, old;
+    pid_t pid;
+    int status;
+
+    args.spec = spec;
+    args.mask = mask;
+    args.err = 0;
+    sigfillset(&all);
+    sigprocmask(SIG_SETMASK, &all, &old);
+    /* the stack grows down on every architecture we care about */
+    pid = clone(vfork_child, vfork_stack + sizeof(vfork_stack), CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+    if (pid > 0 && args.err) {
+        /* the child did not exec: collect it before SIGCHLD is unblocked */
+        waitpid(pid, &status, 0);
+        errno = args.err;
+        pid = -1;
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return pid;
+}
+
+/**
+ * @brief launch with fork().
+ * @param spec the command to launch.
+ * @param mask the signal mask the child must run with.
+ * @returns the pid of the child, -1 with errno set if fork() failed.
+ *
+ * Exec errors happen in the child, it prints them and exits with 127.
+ * This is also the only engine that can run a \a child_fn, the other ones share the memory of the
+ * shell until exec.
+ */
+static pid_t spawn_fork(const launch_spec *spec, const sigset_t *mask) {
+    pid_t pid;
+
+    /* the child must not print again what is still buffered in the shell */
+    fflush(NULL);
+    pid = fork();
+    if (pid == 0) {
+        child_setup(spec, mask);
+        if (spec->child_fn) {
+            int ret;
+            if (spec->fd_extra != -1)
+                dup2(spec->fd_extra, 3);
+            /* nothing is exec'd, so close-on-exec does not apply: close the other pipes by hand */
+            close_range(spec->fd_extra != -1 ? 4 : 3, ~0U, 0);
+            ret = spec->child_fn(spec->child_arg);
+            fflush(NULL);
+            _exit(ret);
+        }
+        errno = child_exec(spec);
+        perror(spec->argv[0]);
+        _exit(127); /* exec shouldn't return, 127 like a command that is not found */
+    } else if (pid > 0) {
+        /* also set it in the parent, so it is valid whichever process runs first */
+        setpgid(pid, spec->pgid ? spec->pgid : pid);
+    }
+    return pid;
+}
+
+/**
+ * @brief get the file actions for a redirection.
+ * @param fd_in the fd that becomes stdin, -1 if not redirected.
+ * @param fd_out the fd that becomes stdout, -1 if not redirected.
+ * @returns the file actions. They belong to the cache.
+ *
+ * glibc allocates the action list on the first add, so the actions are built once per fd pair
+ * and kept. Entries are replaced round robin.
+ */
+static posix_spawn_file_actions_t *get_file_actions(int fd_in, int fd_out) {
+    cached_actions *c;
+    int i;
+
+    for (i = 0; i < SPAWN_ACTIONS_CACHE_SIZE; ++i) {
+        c = &actions_cache[i];
+        if (c->used && c->fd_in == fd_in && c->fd_out == fd_out)
+            return &c->actions;
+    }
+    c = &actions_cache[actions_victim];
+    actions_victim = (actions_victim + 1) % SPAWN_ACTIONS_CACHE_SIZE;
+    if (c->used)
+        posix_spawn_file_actions_destroy(&c->actions);
+    posix_spawn_file_actions_init(&c->actions);
+    if (fd_in != -1)
+        posix_spawn_file_actions_adddup2(&c->actions, fd_in, STDIN_FILENO);
+    if (fd_out != -1)
+        posix_spawn_file_actions_adddup2(&c->actions, fd_out, STDOUT_FILENO);
+    c->fd_in = fd_in;
+    c->fd_out = fd_out;
+    c->used = 1;
+    return &c->actions;
+}
+
+/**
+ * @brief free the cached posix_spawn() file actions.
+ */
+void spawn_free() {
+    int i;
+    for (i = 0; i < SPAWN_ACTIONS_CACHE_SIZE; ++i) {
+        if (actions_cache[i].used)
+            posix_spawn_file_actions_destroy(&actions_cache[i].actions);
+        actions_cache[i].used = 0;
+    }
+}
+
+/**
+ * @brief launch with posix_spawn().
+ * @param spec the command to launch.
+ * @param mask the signal mask the child must run with.
+ * @returns the pid of the child, -1 with errno set on failure.
+ *
+ * The signal defaults, the signal mask and the process group are set through spawn attributes.
+ * File actions are only used when stdin or stdout are redirected, and come from a cache.
+ */
+static pid_t spawn_posix(const launch_spec *spec, const sigset_t *mask) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t *actions_p = NULL;
+    sigset_t defaults;
+    pid_t pid;
+    unsigned i;
+    int err;
+
+    sigemptyset(&defaults);
+    for (i = 0; i < sizeof(reset_signals) / sizeof(reset_signals[0]); ++i) {
+        sigaddset(&defaults, reset_signals[i]);
+    }
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, mask);
+    posix_spawnattr_setpgroup(&attr, spec->pgid);
+    if (spec->fd_in != -1 || spec->fd_out != -1) {
+        actions_p = get_file_actions(spec->fd_in, spec->fd_out);
+    }
+
+    err = ENOENT;
+    if (spec->path) {
+        err = posix_spawn(&pid, spec->path, actions_p, &attr, spec->argv, child_envp);
+    }
+    if (err == ENOENT) {
+        /* not cached, or the cached file is gone */
+        if (spec->path) {
+            path_forget(spec->argv[0]);
+        }
+        err = posix_spawnp(&pid, spec->argv[0], actions_p, &attr, spec->argv, child_envp);
+    }
+    posix_spawnattr_destroy(&attr);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * @brief initialize a launch_spec for a plain command.
+ * @param spec the spec to initialize.
+ * @param argv NULL terminated argument vector.
+ *
+ * Nothing is redirected, no path is cached and a new process group is created.
+ */
+void launch_spec_init(launch_spec *spec, char **argv) {
+    spec->path = NULL;
+    spec->argv = argv;
+    spec->pgid = 0;
+    spec->fd_in = spec->fd_out = spec->fd_extra = -1;
+    spec->child_fn = NULL;
+    spec->child_arg = NULL;
+    spec->place = NULL;
+}
+
+/**
+ * @brief launch a command with the selected engine.
+ * @param spec the command to launch.
+ * @returns the pid of the child.
+ * @returns -1 with errno set if the child could not be created or, with the spawn and vfork
+ * engines, if the exec failed.
+ *
+ * The shell keeps SIGCHLD and SIGINT blocked and reads them from signal_fd, so the child can not
+ * be reaped before it is recorded. Children start with an empty signal mask.
+ * posix_spawn() can not set a placement, such children are launched with the vfork engine.
+ */
+pid_t spawn_command(const launch_spec *spec) {
+    sigset_t mask;
+    pid_t pid;
+
+    /* output of builtins must come before the output of the child */
+    fflush(stdout);
+    child_envp = vars_envp();
+    sigemptyset(&mask);
+    if (spec->child_fn) {
+        return spawn_fork(spec, &mask);
+    }
+    switch (spawn_engine) {
+        case ENGINE_VFORK:
+            pid = spawn_vfork(spec, &mask);
+            break;
+        case ENGINE_FORK:
+            pid = spawn_fork(spec, &mask);
+            break;
+        default:
+            pid = spec->place ? spawn_vfork(spec, &mask) : spawn_posix(spec, &mask);
+            break;
+    }
+    return pid;
+}
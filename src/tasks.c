@@ -0,0 +1,451 @@
+/** \file tasks.c
+* \brief the tasks builtin: run a graph of dependent commands, the ready ones in parallel.
+*
+* A task file holds one task per line, 'name: dep... : command'. A task starts once every task
+* it depends on succeeded, with at most one task per core alive at once, or N with -j. Like the
+* jobs of parallel, a running task is a child in the job table and harvest_dead_child() marks it
+* completed, its slot goes to the next ready task at once.
+*
+* The command of a task is a line of this shell, run by a forked copy of it, so it may hold lists,
+* pipelines and variables. Its stdout goes to a memfd that is written whole when the task ends,
+* so the outputs of tasks that run together never mix. stderr is not captured.
+*
+* A failed task skips the tasks that depend on it and the others go on, like 'make -k'. With -e
+* no task starts after the first failure, the running ones are waited for.
+*/
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/**
+ * @brief a task of the file.
+ */
+typedef struct task {
+    char *name;       /**< the name, unique in the file. */
+    char *command;    /**< the command line, "" for a task that only groups its dependencies. */
+    char **dep_names; /**< the names of the dependencies. */
+    int *deps;        /**< the indices of the dependencies, filled in once all tasks are read. */
+    int ndeps;        /**< number of dependencies. */
+    int line;         /**< the line of the file the task is on. */
+    int state;        /**< one of the values of \enum task_states. */
+    int output;       /**< memfd holding the stdout of the task, -1 if not captured. */
+    process *proc;    /**< the record of the running task, NULL when it does not run. */
+} task;
+
+/**
+ * @brief the state of one run of the tasks builtin.
+ */
+typedef struct task_graph {
+    const char *name; /**< name of the builtin, used in messages. */
+    const char *path; /**< the task file. */
+    task *tasks;      /**< the tasks, in file order. */
+    int count;        /**< number of tasks. */
+    int cap;          /**< capacity of \a tasks. */
+    int running;      /**< tasks alive right now. */
+    int failed;       /**< tasks that failed. */
+    int stop;         /**< True to start no task after a failure. */
+    int stopped;      /**< True once no task may start anymore. */
+    pid_t pgid;       /**< process group for all tasks, 0 to give each its own. */
+} task_graph;
+
+/**
+ * @brief parse a line of the task file.
+ * @param g the graph the task is added to.
+ * @param line the line, copied to line_arena. The task points inside it.
+ * @param line_no the number of the line, for messages.
+ * @returns 0 on success or for a blank or comment line, -1 on a syntax error after printing it.
+ */
+static int parse_task(task_graph *g, char *line, int line_no) {
+    char *first, *second, *word, *save;
+    task *t;
+    int cap = 0;
+
+    line += strspn(line, " \t");
+    if (*line == '\0' || *line == '#') {
+        return 0;
+    }
+    if ((first = strchr(line, ':')) == NULL || (second = strchr(first + 1, ':')) == NULL) {
+        fprintf(stderr, "%s: %s:%d: expected 'name: dep... : command'\n", g->name, g->path, line_no);
+        return -1;
+    }
+    *first = *second = '\0';
+    if (g->count == g->cap) {
+        int c = g->cap ? g->cap * 2 : TASKS_INITIAL_SIZE;
+        g->tasks = arena_grow(&line_arena, g->tasks, g->cap * sizeof(task), c * sizeof(task));
+        g->cap = c;
+    }
+    t = &g->tasks[g->count];
+    memset(t, 0, sizeof(task));
+    t->line = line_no;
+    t->output = -1;
+    if ((t->name = strtok_r(line, " \t", &save)) == NULL || strtok_r(NULL, " \t", &save) != NULL) {
+        fprintf(stderr, "%s: %s:%d: the name must be one word\n", g->name, g->path, line_no);
+        return -1;
+    }
+    for (word = strtok_r(first + 1, " \t", &save); word; word = strtok_r(NULL, " \t", &save)) {
+        if (t->ndeps == cap) {
+            int c = cap ? cap * 2 : TASKS_INITIAL_SIZE;
+            t->dep_names = arena_grow(&line_arena, t->dep_names, cap * sizeof(char *), c * sizeof(char *));
+            cap = c;
+        }
+        t->dep_names[t->ndeps++] = word;
+    }
+    t->command = second + 1 + strspn(second + 1, " \t");
+    g->count++;
+    return 0;
+}
+
+/**
+ * @brief find a task by name.
+ * @param g the graph.
+ * @param name the name.
+ * @returns the index of the task, -1 if there is none.
+ *
+ * A linear search: task files are small and every name is looked up once.
+ */
+static int find_task(const task_graph *g, const char *name) {
+    int i;
+    for (i = 0; i < g->count; ++i) {
+        if (strcmp(g->tasks[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * @brief read the task file and resolve the dependencies.
+ * @param g the graph, with its name and path set.
+ * @returns 0 on success, -1 after printing why the file can not be used.
+ */
+static int read_tasks(task_graph *g) {
+    line_reader reader;
+    task *t;
+    char *line;
+    int fd, i, j;
+    int line_no = 0;
+    int ret = 0;
+
+    if ((fd = open(g->path, O_RDONLY | O_CLOEXEC)) == -1) {
+        perror(g->path);
+        return -1;
+    }
+    reader_open_fd(&reader, fd);
+    while (ret == 0 && (line = reader_next_line(&reader)) != NULL) {
+        /* the line is only valid until the next read */
+        ret = parse_task(g, arena_strdup(&line_arena, line), ++line_no);
+    }
+    reader_close(&reader);
+    close(fd);
+    for (i = 0; ret == 0 && i < g->count; ++i) {
+        t = &g->tasks[i];
+        if (find_task(g, t->name) != i) {
+            fprintf(stderr, "%s: %s:%d: task '%s' is defined twice\n", g->name, g->path, t->line, t->name);
+            return -1;
+        }
+        t->deps = arena_alloc(&line_arena, t->ndeps * sizeof(int));
+        for (j = 0; j < t->ndeps; ++j) {
+            if ((t->deps[j] = find_task(g, t->dep_names[j])) == -1) {
+                fprintf(stderr, "%s: %s:%d: unknown task '%s'\n", g->name, g->path, t->line, t->dep_names[j]);
+                return -1;
+            }
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief check that the dependencies have no cycle.
+ * @param g the graph, with the dependencies resolved and every task waiting.
+ * @returns 0 if there is no cycle, -1 after printing a task of one.
+ *
+ * Marks as done, pass by pass, the tasks whose dependencies are all done, like a run where every
+ * task succeeds. The tasks left waiting are on a cycle or depend on one. All are waiting again
+ * afterwards.
+ */
+static int check_cycles(task_graph *g) {
+    int progress = 1;
+    int ret = 0;
+    int i, j;
+
+    while (progress) {
+        progress = 0;
+        for (i = 0; i < g->count; ++i) {
+            if (g->tasks[i].state == TASK_DONE)
+                continue;
+            for (j = 0; j < g->tasks[i].ndeps && g->tasks[g->tasks[i].deps[j]].state == TASK_DONE; ++j) {
+            }
+            if (j == g->tasks[i].ndeps) {
+                g->tasks[i].state = TASK_DONE;
+                progress = 1;
+            }
+        }
+    }
+    for (i = 0; i < g->count; ++i) {
+        if (g->tasks[i].state != TASK_DONE && ret == 0) {
+            fprintf(stderr, "%s: %s:%d: the dependencies of '%s' form a cycle\n", g->name, g->path, g->tasks[i].line,
+                    g->tasks[i].name);
+            ret = -1;
+        }
+        g->tasks[i].state = TASK_WAITING;
+    }
+    return ret;
+}
+
+/**
+ * @brief child entry of a task.
+ * @param arg pointer to the task.
+ * @returns the exit code of its command line.
+ *
+ * The child is a fork of the shell. It runs the line like the shell would, but without a
+ * terminal to ask about ctrl-c and with a signal_fd of its own.
+ */
+static int task_main(void *arg) {
+    task *t = arg;
+
+    interactive = 0;
+    if (setup_child_signals() == -1) {
+        return EXIT_FAILURE;
+    }
+    last_status = 0;
+    execute_line(t->command, 0);
+    return WIFSIGNALED(last_status) ? 128 + WTERMSIG(last_status) : WEXITSTATUS(last_status);
+}
+
+/**
+ * @brief record that a task did not succeed and report it to stderr.
+ * @param g the graph.
+ * @param t the task, with its status in \a t->proc or NULL if it could not be launched.
+ */
+static void task_failed(task_graph *g, task *t) {
+    int status = t->proc ? t->proc->status : W_EXITCODE(127, 0);
+
+    t->state = TASK_FAILED;
+    g->failed++;
+    g->stopped |= g->stop;
+    if (WIFSIGNALED(status)) {
+        fprintf(stderr, "%s: task '%s' killed by signal %d\n", g->name, t->name, WTERMSIG(status));
+    } else {
+        fprintf(stderr, "%s: task '%s' exited with status %d\n", g->name, t->name, WEXITSTATUS(status));
+    }
+}
+
+/**
+ * @brief launch a task.
+ * @param g the graph.
+ * @param t the task, with all its dependencies done.
+ *
+ * A task without a command is done at once.
+ */
+static void launch_task(task_graph *g, task *t) {
+    launch_spec spec;
+    char *argv[2];
+    int n = 0;
+
+    if (*t->command == '\0') {
+        t->state = TASK_DONE;
+        return;
+    }
+    argv[0] = t->name;
+    argv[1] = NULL;
+    /* without a memfd, e.g. out of file descriptors, the output goes straight to stdout */
+    t->output = memfd_create("tasks", MFD_CLOEXEC);
+    launch_spec_init(&spec, argv);
+    spec.pgid = g->pgid;
+    spec.fd_out = t->output;
+    spec.child_fn = task_main;
+    spec.child_arg = t;
+    launch_one(&spec, 1, 0, &t->proc, &n);
+    if (n == 0) {
+        /* launch_one() printed the error */
+        write_captured(&t->output);
+        task_failed(g, t);
+    } else {
+        t->state = TASK_RUNNING;
+        g->running++;
+        current = t->proc;
+    }
+}
+
+/**
+ * @brief skip the tasks whose dependencies did not succeed and launch the ready ones.
+ * @param g the graph.
+ * @param max_jobs how many tasks may be alive at once.
+ * @returns True if the state of a task changed. A change can make other tasks ready or skipped.
+ */
+static int schedule(task_graph *g, long max_jobs) {
+    task *t, *dep;
+    int changed = 0;
+    int i, j, ready;
+
+    for (i = 0; i < g->count; ++i) {
+        t = &g->tasks[i];
+        if (t->state != TASK_WAITING)
+            continue;
+        ready = 1;
+        for (j = 0; j < t->ndeps; ++j) {
+            dep = &g->tasks[t->deps[j]];
+            if (dep->state == TASK_FAILED || dep->state == TASK_SKIPPED) {
+                fprintf(stderr, "%s: task '%s' skipped, '%s' did not succeed\n", g->name, t->name, dep->name);
+                t->state = TASK_SKIPPED;
+                changed = 1;
+                break;
+            }
+            ready &= dep->state == TASK_DONE;
+        }
+        if (t->state == TASK_WAITING && ready && !g->stopped && g->running < max_jobs) {
+            launch_task(g, t);
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+/**
+ * @brief collect the tasks that harvest_dead_child() marked completed and write their outputs.
+ * @param g the graph.
+ */
+static void collect(task_graph *g) {
+    task *t;
+    int i;
+
+    for (i = 0; i < g->count; ++i) {
+        t = &g->tasks[i];
+        if (t->state != TASK_RUNNING || !t->proc->completed)
+            continue;
+        write_captured(&t->output);
+        g->running--;
+        if (t->proc->status == 0)
+            t->state = TASK_DONE;
+        else
+            task_failed(g, t);
+        if (current == t->proc)
+            current = NULL;
+        job_release(t->proc);
+        t->proc = NULL;
+    }
+    /* ctrl-c names the process in current, it must be a task that still runs */
+    for (i = 0; current == NULL && i < g->count; ++i) {
+        if (g->tasks[i].state == TASK_RUNNING)
+            current = g->tasks[i].proc;
+    }
+}
+
+/**
+ * @brief terminate all running tasks.
+ * @param g the graph.
+ */
+static void kill_running(task_graph *g) {
+    int i;
+    for (i = 0; i < g->count; ++i) {
+        if (g->tasks[i].state == TASK_RUNNING && !g->tasks[i].proc->completed)
+            kill(g->pgid ? g->tasks[i].proc->pid : -g->tasks[i].proc->pgid, SIGTERM);
+    }
+}
+
+/**
+ * @brief run the tasks of a graph, at most a number at a time.
+ * @param g the graph, checked for cycles.
+ * @param max_jobs how many tasks may be alive at once.
+ * @returns 0 when no task runs anymore, -1 if the run could not start, after printing why.
+ *
+ * Inside the shell every task gets its own process group and ctrl-c stops the whole run. As a
+ * pipeline stage the tasks join the group of the stage, like the jobs of parallel.
+ */
+static int run_tasks(task_graph *g, long max_jobs) {
+    struct pollfd pfd;
+    sigset_t chld, old_mask;
+
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old_mask);
+    if (getpid() != shell_pid) {
+        g->pgid = getpgrp();
+        if (setup_child_signals() == -1)
+            return -1;
+    }
+
+    foreground_interrupted = 0;
+    pfd.fd = signal_fd;
+    pfd.events = POLLIN;
+    fflush(stdout);
+    while (1) {
+        while (schedule(g, max_jobs)) {
+        }
+        if (g->running == 0) {
+            break;
+        }
+        if (poll(&pfd, 1, -1) > 0) {
+            handle_signals(1);
+        }
+        collect(g);
+        if (!g->stopped && foreground_interrupted) {
+            g->stopped = 1;
+            kill_running(g);
+        }
+    }
+    fflush(stdout);
+
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    current = NULL;
+    return 0;
+}
+
+/**
+ * @brief the tasks builtin.
+ * @param argc argument count.
+ * @param argv 'tasks [-e] [-j N] file'.
+ *
+ * The exit status is 0 if every task succeeded, 1 if one failed, was skipped or did not start.
+ */
+void tasks_builtin(int argc, char **argv) {
+    task_graph g;
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    char *end;
+    int i, done = 0;
+
+    memset(&g, 0, sizeof(g));
+    g.name = argv[0];
+    for (i = 1; i < argc - 1 && argv[i][0] == '-'; ++i) {
+        if (strcmp(argv[i], "-e") == 0) {
+            g.stop = 1;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 2 < argc) {
+            max_jobs = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || max_jobs <= 0) {
+                fprintf(stderr, "%s: -j needs a positive number\n", argv[0]);
+                last_status = W_EXITCODE(2, 0);
+                return;
+            }
+        } else {
+            break;
+        }
+    }
+    if (i != argc - 1) {
+        printf("%s: invalid usage\n", argv[0]);
+        last_status = W_EXITCODE(2, 0);
+        return;
+    }
+    g.path = argv[i];
+    if (read_tasks(&g) == -1 || check_cycles(&g) == -1 || run_tasks(&g, max_jobs) == -1) {
+        last_status = W_EXITCODE(EXIT_FAILURE, 0);
+        return;
+    }
+    for (i = 0; i < g.count; ++i) {
+        done += g.tasks[i].state == TASK_DONE;
+    }
+    if (done < g.count) {
+        fprintf(stderr, "%s: %d of %d tasks failed, %d did not run\n", g.name, g.failed, g.count,
+                g.count - done - g.failed);
+    }
+    last_status = W_EXITCODE(done == g.count ? EXIT_SUCCESS : EXIT_FAILURE, 0);
+}
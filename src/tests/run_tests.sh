@@ -0,0 +1,158 @@
+#!/bin/sh
+# Regression tests of the shell, run with 'make test'.
+#
+# Every case runs the shell non-interactively and compares its stdout and exit status with the
+# expected ones. stderr is dropped. Prints one line per failed case and a summary, exits with 1
+# if a case failed.
+#
+# usage: run_tests.sh path/to/shell
+
+SHELL_BIN=${1:-../bin/shell}
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+total=0
+failed=0
+
+# check NAME STATUS OUTPUT ARGS...: run the shell with ARGS, expect exit STATUS and stdout OUTPUT.
+check() {
+    run_case /dev/null "$@"
+}
+
+# check_merged NAME STATUS OUTPUT ARGS...: like check, with stderr in OUTPUT, in the order it was written.
+check_merged() {
+    run_case /dev/stdout "$@"
+}
+
+# run_case ERR NAME STATUS OUTPUT ARGS...: the cases, with stderr sent to ERR.
+run_case() {
+    err=$1
+    name=$2
+    want_status=$3
+    want_out=$4
+    shift 4
+    total=$((total + 1))
+    out=$(HOME="$TMP" timeout 60 "$SHELL_BIN" "$@" 2>"$err")
+    status=$?
+    if [ "$status" != "$want_status" ] || [ "$out" != "$want_out" ]; then
+        failed=$((failed + 1))
+        printf 'FAIL %s: status %s, expected %s\n' "$name" "$status" "$want_status"
+        printf '  output:   %s\n  expected: %s\n' "$out" "$want_out"
+    fi
+}
+
+# check_count NAME PATTERN COUNT SCRIPT: feed SCRIPT to the shell on stdin, expect COUNT lines of stdout to match
+# PATTERN, and nothing on stderr.
+check_count() {
+    name=$1
+    pattern=$2
+    want_count=$3
+    total=$((total + 1))
+    HOME="$TMP" timeout 300 "$SHELL_BIN" <"$4" >"$TMP/out" 2>"$TMP/err"
+    count=$(grep -c "$pattern" "$TMP/out")
+    if [ "$count" != "$want_count" ] || [ -s "$TMP/err" ]; then
+        failed=$((failed + 1))
+        printf 'FAIL %s: %s lines match, expected %s\n' "$name" "$count" "$want_count"
+        head -3 "$TMP/err"
+    fi
+}
+
+# every one of 10000 background jobs is reaped and found in the job table. The foreground sleep
+# gives the last ones time to exit, pdead prints every exit. A prompt may come first on its line
+{
+    echo 'pdead on'
+    i=0
+    while [ $i -lt 10000 ]; do
+        echo '/bin/true &'
+        i=$((i + 1))
+    done
+    echo '/bin/sleep 1'
+} >"$TMP/bg_stress"
+check_count "10000 background jobs" '\[[0-9]*\] exited with status 0$' 10001 "$TMP/bg_stress"
+
+# a command found through a relative PATH directory is searched again after cd: tool is in c,
+# which is after '.' in PATH, until the working directory has one
+mkdir -p "$TMP/a" "$TMP/c"
+printf '#!/bin/sh\necho A\n' >"$TMP/a/tool"
+printf '#!/bin/sh\necho C\n' >"$TMP/c/tool"
+chmod +x "$TMP/a/tool" "$TMP/c/tool"
+check "relative PATH after cd" 0 "C
+A" -c "PATH=.:$TMP/c:/usr/bin:/bin
+cd $TMP
+tool
+cd $TMP/a
+tool"
+check "empty PATH entry after cd" 0 "C
+A" -c "PATH=:$TMP/c:/usr/bin:/bin
+cd $TMP
+tool
+cd $TMP/a
+tool"
+check "hash relative PATH" 1 "" -c "PATH=.:/usr/bin:/bin
+cd $TMP/a
+hash tool"
+check "hash absolute PATH" 0 "" -c "PATH=$TMP/a:/usr/bin:/bin
+hash tool"
+
+# a command that can not be launched has status 127 with every engine
+for e in spawn vfork fork; do
+    check "$e: not found" 127 "" -e "$e" -c 'nosuchcmd'
+    check "$e: not found &&" 127 "" -e "$e" -c 'nosuchcmd && echo RAN_AND'
+    check "$e: not found ||" 0 "RAN_OR" -e "$e" -c 'nosuchcmd || echo RAN_OR'
+    check "$e: not found if" 0 "ELSE" -e "$e" -c 'if nosuchcmd; then echo THEN; else echo ELSE; fi'
+    check "$e: not found last stage" 0 "127" -e "$e" -c 'echo a | nosuchcmd; echo $?'
+    check "$e: not found first stage" 0 "0" -e "$e" -c 'nosuchcmd | cat; echo $?'
+    check "$e: found" 0 "a" -e "$e" -c '/bin/echo a'
+done
+
+# the output of a builtin is flushed before stderr and the output of children
+check_merged "builtin output order" 0 "a
+export: '1x': not a valid name
+b
+c
+d" -c 'echo a; export 1x; printf "b\n"; /bin/echo c; cat /dev/null; echo d'
+
+# printf skips a first '--' and quotes with %q like coreutils
+check "printf --" 0 "-x" -c "printf -- '-x\n'"
+check "printf -- only" 1 "" -c "printf --"
+check "printf %q plain" 0 "abc-1.2/x" -c "printf '%q' abc-1.2/x"
+check "printf %q empty" 0 "''" -c "printf '%q' ''"
+check "printf %q space" 0 "'a b'" -c "printf '%q' 'a b'"
+check "printf %q quote" 0 "\"it's\"" -c "printf '%q' \"it's\""
+check "printf %q quote and dollar" 0 "'a'\\''\$b'" -c "printf '%q' \"a'\\\$b\""
+TAB_WORD=$(printf 'a\tb')
+export TAB_WORD
+check "printf %q control" 0 "'a'\$'\\t''b'" -c 'printf "%q" "$TAB_WORD"'
+check "printf %q tilde" 0 "'~x' a~x" -c "printf '%q %q' '~x' a~x"
+
+# test compares integers of any size, like coreutils
+check "test wider than 64 bits" 0 "" -c '[ 99999999999999999999 -gt 1 ]'
+check "test negative wider than 64 bits" 0 "" -c 'test -99999999999999999999 -lt -99999999999999999998'
+check "test leading zeros" 0 "" -c 'test 0099999999999999999999 -eq 99999999999999999999'
+check "test -0" 0 "" -c 'test -0 -eq +0'
+check "test blanks" 0 "" -c 'test " 5 " -ge 5'
+check "test false" 1 "" -c 'test 18446744073709551616 -le 18446744073709551615'
+check "test invalid integer" 2 "" -c 'test +-5 -eq 1'
+check "test not an integer" 2 "" -c 'test 1.0 -eq 1'
+
+# a syntax error runs nothing and has status 2
+check "empty list item" 2 "" -c 'echo a; ; echo b'
+check "missing command after &&" 2 "" -c 'echo a &&'
+check "missing command after ||" 2 "" -c 'echo a ||'
+check "unterminated quote" 2 "" -c "echo 'a"
+check "missing done" 2 "" -c 'for i in 1; do echo $i'
+check "syntax error status" 0 "2" -c 'echo a; ; echo b
+echo $?'
+
+# a pattern that ends with '/' only matches directories, links to them included, and keeps the '/'
+mkdir -p "$TMP/g/dA/sub" "$TMP/g/fB"
+touch "$TMP/g/fA" "$TMP/g/fB/sub"
+ln -s dA "$TMP/g/lA"
+ln -s fA "$TMP/g/lF"
+check "glob trailing slash" 0 "dA/ lA/" -c "cd $TMP/g; echo *A/"
+check "glob without trailing slash" 0 "dA fA lA" -c "cd $TMP/g; echo *A"
+check "glob trailing slash after a plain part" 0 "dA/sub/ lA/sub/" -c "cd $TMP/g; echo */sub/"
+check "glob trailing slash link to a file" 0 "lA/" -c "cd $TMP/g; echo l*/"
+check "glob trailing slash no match" 0 "f*x/" -c "cd $TMP/g; echo f*x/"
+
+printf '%d of %d cases failed\n' "$failed" "$total"
+[ "$failed" -eq 0 ]
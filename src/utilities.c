@@ -0,0 +1,1112 @@
+/** \file utilities.c
+* \brief in-process versions of small utilities: echo, printf, test and [, true, false and cat.
+*
+* Scripts call these on almost every line, and the fork and exec of each costs more than the
+* work it does. Alone on a line they run inside the shell, in a pipeline they are a builtin stage
+* like any other builtin. Their output and exit status follow GNU coreutils. 'fastutils off'
+* makes the shell run the external binaries instead, so the results can be compared.
+*
+* cat copies regular files with copy_file_range() or sendfile(), the data does not pass through
+* user space. Only its formatting options read the input.
+*/
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/** True if echo, printf, test, [, true, false and cat run as builtins. Else the external binaries run. */
+int fast_utils = 1;
+
+/**
+ * @brief the value of a hexadecimal digit.
+ * @param c the character.
+ * @returns the value, -1 if \a c is not a hexadecimal digit.
+ */
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * @brief write the character of a backslash escape to stdout.
+ * @param p the text after the backslash.
+ * @param in_format True in the format of printf, where octal escapes are \\NNN and \\" is a quote. Else, for
+ * echo -e and %b, they are \\0NNN or \\NNN.
+ * @param stop set to 1 by \\c, which ends all output, and to -1 by an invalid escape after printing it.
+ * @returns the text after the escape.
+ */
+static const char *put_escape(const char *p, int in_format, int *stop) {
+    static const char names[] = "abefnrtv\\";
+    static const char values[] = "\a\b\033\f\n\r\t\v\\";
+    const char *e;
+    int c = 0, n;
+
+    if (*p != '\0' && (e = strchr(names, *p)) != NULL) {
+        putchar(values[e - names]);
+        return p + 1;
+    }
+    if (*p == 'c') {
+        *stop = 1;
+        return p + 1;
+    }
+    if (*p == '"' && in_format) {
+        putchar('"');
+        return p + 1;
+    }
+    if (*p == 'x' && hex_value(p[1]) >= 0) {
+        for (n = 0, p++; n < 2 && hex_value(*p) >= 0; n++, p++) {
+            c = c * 16 + hex_value(*p);
+        }
+        putchar(c);
+        return p;
+    }
+    if (*p == 'x' && in_format) {
+        fprintf(stderr, "printf: missing hexadecimal number in escape\n");
+        *stop = -1;
+        return p;
+    }
+    if (*p >= '0' && *p <= '7') {
+        /* \0NNN outside the format, the 0 does not count as a digit */
+        if (!in_format && *p == '0')
+            p++;
+        for (n = 0; n < 3 && *p >= '0' && *p <= '7'; n++, p++) {
+            c = c * 8 + *p - '0';
+        }
+        putchar(c);
+        return p;
+    }
+    /* not an escape, the backslash stays */
+    putchar('\\');
+    return p;
+}
+
+/**
+ * @brief the echo builtin.
+ * @param argc argument count.
+ * @param argv 'echo [-neE]... [string]...'.
+ *
+ * Like coreutils, an argument is an option only if it is all made of 'n', 'e' and 'E' after the
+ * '-'. -e turns on backslash escapes, -E turns them off again.
+ */
+void echo_builtin(int argc, char **argv) {
+    int newline = 1, escapes = 0, stop = 0;
+    const char *p;
+    int i;
+
+    for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0' &&
+                strspn(argv[i] + 1, "neE") == strlen(argv[i] + 1);
+         ++i) {
+        for (p = argv[i] + 1; *p; ++p) {
+            if (*p == 'n')
+                newline = 0;
+            else
+                escapes = *p == 'e';
+        }
+    }
+    for (; i < argc && !stop; ++i) {
+        if (escapes) {
+            for (p = argv[i]; *p && !stop;) {
+                if (*p == '\\')
+                    p = put_escape(p + 1, 0, &stop);
+                else
+                    putchar(*p++);
+            }
+        } else {
+            fputs(argv[i], stdout);
+        }
+        if (i + 1 < argc && !stop)
+            putchar(' ');
+    }
+    if (newline && !stop) {
+        putchar('\n');
+    }
+}
+
+/**
+ * @brief the state of one printf.
+ */
+typedef struct printf_state {
+    const char *name; /**< name of the builtin, used in messages. */
+    char **args;      /**< the arguments not yet used, NULL terminated. */
+    int stop;         /**< 1 after \\c, -1 after an invalid format. Nothing more is printed. */
+    int failed;       /**< True if an argument was not a valid number. */
+} printf_state;
+
+/**
+ * @brief take the next argument.
+ * @param s the state.
+ * @returns the argument, NULL if there are no more.
+ */
+static const char *next_arg(printf_state *s) { return *s->args ? *s->args++ : NULL; }
+
+/**
+ * @brief check how a number argument converted and report the problems, like coreutils.
+ * @param s the state.
+ * @param arg the argument.
+ * @param end where the conversion stopped.
+ */
+static void check_number(printf_state *s, const char *arg, const char *end) {
+    if (errno == ERANGE) {
+        fprintf(stderr, "%s: '%s': %s\n", s->name, arg, strerror(ERANGE));
+    } else if (end == arg && *arg) {
+        fprintf(stderr, "%s: '%s': expected a numeric value\n", s->name, arg);
+    } else if (*end) {
+        fprintf(stderr, "%s: '%s': value not completely converted\n", s->name, arg);
+    } else {
+        return;
+    }
+    s->failed = 1;
+}
+
+/**
+ * @brief take the next argument as a number.
+ * @param s the state.
+ * @param conv the conversion: 'd' or 'i' for a signed, 'u', 'o', 'x' or 'X' for an unsigned and
+ * anything else for a floating point number.
+ * @param value where a signed or unsigned integer is stored.
+ * @param real where a floating point number is stored.
+ *
+ * A missing argument is 0. 'c or "c is the code of the character c. Otherwise the base comes
+ * from the prefix like in C, 0x for hexadecimal and 0 for octal.
+ */
+static void next_number(printf_state *s, char conv, long long *value, long double *real) {
+    const char *arg = next_arg(s);
+    char *end;
+
+    *value = 0;
+    *real = 0;
+    if (arg == NULL) {
+        return;
+    }
+    if ((arg[0] == '\'' || arg[0] == '"') && arg[1] != '\0') {
+        *value = (unsigned char)arg[1];
+        *real = *value;
+        return;
+    }
+    errno = 0;
+    if (conv == 'd' || conv == 'i')
+        *value = strtoll(arg, &end, 0);
+    else if (strchr("uoxX", conv))
+        *value = (long long)strtoull(arg, &end, 0);
+    else
+        *real = strtold(arg, &end);
+    check_number(s, arg, end);
+}
+
+/**
+ * @brief write a string to stdout quoted for the shell, for %q.
+ * @param arg the string.
+ *
+ * Like the shell-escape quoting of coreutils in the C locale. A string of safe bytes is written
+ * as it is. A string with a single quote and otherwise only letters, digits, spaces and
+ * "%+,-./:@]_" goes in double quotes. Anything else goes in single quotes, where a single quote
+ * is '\\'' and control and non-ASCII bytes are $'\\t' or $'\\NNN'.
+ */
+static void put_quoted(const char *arg) {
+    static const char names[] = "abfnrtv";
+    static const char values[] = "\a\b\f\n\r\t\v";
+    const unsigned char *p;
+    const char *e;
+    int plain = 1, single = 0, doubled = 1, in_dollar = 0;
+    int alnum, first;
+
+    if (*arg == '\0') {
+        fputs("''", stdout);
+        return;
+    }
+    for (p = (const unsigned char *)arg; *p; ++p) {
+        alnum = *p < 0x7f && isalnum(*p);
+        first = p == (const unsigned char *)arg;
+        /* '#' and '~' are special at the start of a word, '{' and '}' alone */
+        if (!alnum && !strchr("%+,-./:@]_", *p) && (first || !strchr("#~", *p)) &&
+            (arg[1] == '\0' || !strchr("{}", *p)))
+            plain = 0;
+        if (*p == '\'')
+            single = 1;
+        if (!alnum && !strchr("%+,-./:@]_' ", *p) && !(first && strchr("#~", *p)))
+            doubled = 0;
+    }
+    if (plain) {
+        fputs(arg, stdout);
+        return;
+    }
+    if (single && doubled) {
+        printf("\"%s\"", arg);
+        return;
+    }
+    putchar('\'');
+    for (p = (const unsigned char *)arg; *p; ++p) {
+        if (*p < 0x20 || *p >= 0x7f) {
+            if (!in_dollar)
+                fputs("'$'", stdout);
+            in_dollar = 1;
+            if ((e = strchr(values, *p)) != NULL)
+                printf("\\%c", names[e - values]);
+            else
+                printf("\\%03o", *p);
+        } else if (*p == '\'') {
+            /* also ends a $'' */
+            fputs("'\\''", stdout);
+            in_dollar = 0;
+        } else {
+            if (in_dollar)
+                fputs("''", stdout);
+            in_dollar = 0;
+            putchar(*p);
+        }
+    }
+    putchar('\'');
+}
+
+/**
+ * @brief print one conversion of the format.
+ * @param s the state.
+ * @param f the conversion, after its '%'.
+ * @returns the format after the conversion.
+ *
+ * The flags, width and precision are copied to a format for the printf() of the C library, '*'
+ * takes them from the arguments. Length modifiers are ignored, every integer is a long long.
+ */
+static const char *put_conversion(printf_state *s, const char *f) {
+    const char *start = f;
+    const char *arg;
+    char spec[PRINTF_SPEC_SIZE];
+    long long value;
+    long double real;
+    size_t n = 0;
+    int i;
+
+    spec[n++] = '%';
+    while (*f && strchr("-+ #0'", *f) && n < sizeof(spec) / 4) {
+        spec[n++] = *f++;
+    }
+    for (i = 0; i < 2; ++i) {
+        if (i == 1 && *f == '.')
+            spec[n++] = *f++;
+        if (*f == '*') {
+            next_number(s, 'd', &value, &real);
+            /* a negative precision is as if there was none */
+            if (i == 1 && value < 0)
+                n--;
+            else
+                n += snprintf(spec + n, sizeof(spec) - n, "%d", (int)value);
+            f++;
+        } else {
+            for (; *f >= '0' && *f <= '9' && n < sizeof(spec) - 16; f++) {
+                spec[n++] = *f;
+            }
+        }
+    }
+    while (*f && strchr("hlLjzt", *f)) {
+        f++;
+    }
+    spec[n] = '\0';
+    switch (*f) {
+        case 'd':
+        case 'i':
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            next_number(s, *f, &value, &real);
+            snprintf(spec + n, sizeof(spec) - n, "ll%c", *f);
+            printf(spec, value);
+            break;
+        case 'a':
+        case 'A':
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+            next_number(s, *f, &value, &real);
+            snprintf(spec + n, sizeof(spec) - n, "L%c", *f);
+            printf(spec, real);
+            break;
+        case 'c':
+        case 's':
+            arg = next_arg(s);
+            spec[n++] = *f;
+            spec[n] = '\0';
+            if (*f == 'c')
+                printf(spec, arg ? (unsigned char)*arg : '\0');
+            else
+                printf(spec, arg ? arg : "");
+            break;
+        case 'b':
+            for (arg = next_arg(s); arg && *arg && !s->stop;) {
+                if (*arg == '\\')
+                    arg = put_escape(arg + 1, 0, &s->stop);
+                else
+                    putchar(*arg++);
+            }
+            break;
+        case 'q':
+            /* like coreutils, %q takes no flags, width or precision */
+            if (f == start) {
+                if ((arg = next_arg(s)) != NULL)
+                    put_quoted(arg);
+                break;
+            }
+            /* fall through */
+        case '%':
+            if (f == start) {
+                putchar('%');
+                break;
+            }
+            /* fall through */
+        default:
+            fprintf(stderr, "%s: %%%.*s: invalid conversion specification\n", s->name, (int)(f - start + (*f != 0)),
+                    start);
+            s->stop = -1;
+            return f;
+    }
+    return f + 1;
+}
+
+/**
+ * @brief the printf builtin.
+ * @param argc argument count.
+ * @param argv 'printf [--] format [argument]...'.
+ *
+ * The format is used again while arguments are left, missing ones are "" or 0. The exit status
+ * is 1 if an argument was not a valid number or the format is invalid. A first '--' is skipped,
+ * like coreutils does, so a format can start with '-'.
+ */
+void printf_builtin(int argc, char **argv) {
+    printf_state s;
+    const char *f;
+    char **first;
+
+    if (argc > 1 && strcmp(argv[1], "--") == 0) {
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+    if (argc < 2) {
+        fprintf(stderr, "%s: missing operand\nTry '%s --help' for more information.\n", argv[0], argv[0]);
+        last_status = W_EXITCODE(EXIT_FAILURE, 0);
+        return;
+    }
+    s.name = argv[0];
+    s.args = argv + 2;
+    s.stop = s.failed = 0;
+    do {
+        first = s.args;
+        for (f = argv[1]; *f && !s.stop;) {
+            if (*f == '%')
+                f = put_conversion(&s, f + 1);
+            else if (*f == '\\')
+                f = put_escape(f + 1, 1, &s.stop);
+            else
+                putchar(*f++);
+        }
+    } while (!s.stop && *s.args && s.args != first);
+    if (!s.stop && *s.args) {
+        fprintf(stderr, "%s: warning: ignoring excess arguments, starting with '%s'\n", s.name, *s.args);
+    }
+    if (s.failed || s.stop == -1) {
+        last_status = W_EXITCODE(EXIT_FAILURE, 0);
+    }
+}
+
+/**
+ * @brief the state of one test.
+ */
+typedef struct test_state {
+    const char *name; /**< name of the builtin, used in messages. */
+    char **argv;      /**< the arguments, without the name and the ']' of '['. */
+    int argc;         /**< number of arguments. */
+    int pos;          /**< the next argument. */
+    int error;        /**< True after a syntax error was printed. */
+} test_state;
+
+/**
+ * @brief print a syntax error of test, only the first one.
+ * @param t the state.
+ * @param msg the message, with a %s for \a arg.
+ * @param arg the argument the message is about.
+ * @returns False, so the caller can return it as the result.
+ */
+static int test_error(test_state *t, const char *msg, const char *arg) {
+    if (!t->error) {
+        fprintf(stderr, "%s: ", t->name);
+        fprintf(stderr, msg, arg);
+        fprintf(stderr, "\n");
+    }
+    t->error = 1;
+    return 0;
+}
+
+/**
+ * @brief check if an argument is a binary operator of test.
+ * @param op the argument.
+ * @returns True for =, ==, !=, -eq, -ne, -lt, -le, -gt, -ge, -nt, -ot and -ef.
+ */
+static int is_binary(const char *op) {
+    static const char *ops[] = {"=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef"};
+    size_t i;
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i) {
+        if (strcmp(op, ops[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief an integer operand of test, of any length.
+ */
+typedef struct test_number {
+    int negative;       /**< True if it is below 0. */
+    const char *digits; /**< its digits without leading zeros, none for 0. */
+    size_t length;      /**< number of digits. */
+} test_number;
+
+/**
+ * @brief read an integer operand of test.
+ * @param t the state.
+ * @param arg the operand.
+ * @param n where the integer is stored. It points inside \a arg.
+ * @returns True if \a arg is an integer, with an optional sign and blanks around it.
+ *
+ * Like coreutils, the digits are kept as they are, so integers of any size can be compared.
+ */
+static int test_integer(test_state *t, const char *arg, test_number *n) {
+    const char *p = arg + strspn(arg, " \t");
+
+    n->negative = *p == '-';
+    if (*p == '-' || *p == '+')
+        p++;
+    if (*p < '0' || *p > '9') {
+        return test_error(t, "invalid integer '%s'", arg);
+    }
+    p += strspn(p, "0");
+    n->digits = p;
+    n->length = strspn(p, "0123456789");
+    p += n->length;
+    if (p[strspn(p, " \t")] != '\0') {
+        return test_error(t, "invalid integer '%s'", arg);
+    }
+    if (n->length == 0)
+        n->negative = 0; /* -0 is 0 */
+    return 1;
+}
+
+/**
+ * @brief compare two integer operands of test.
+ * @param a the left operand.
+ * @param b the right operand.
+ * @returns less than, equal to or greater than 0 if \a a is below, equal to or above \a b.
+ */
+static int test_compare(const test_number *a, const test_number *b) {
+    int c;
+
+    if (a->negative != b->negative) {
+        return a->negative ? -1 : 1;
+    }
+    if (a->length != b->length)
+        c = a->length < b->length ? -1 : 1;
+    else
+        c = memcmp(a->digits, b->digits, a->length);
+    return a->negative ? -c : c;
+}
+
+/**
+ * @brief evaluate a binary operator of test.
+ * @param t the state.
+ * @param a the left operand.
+ * @param op the operator, is_binary() must be True for it.
+ * @param b the right operand.
+ * @returns the result.
+ */
+static int test_binary(test_state *t, const char *a, const char *op, const char *b) {
+    struct stat sa, sb;
+    test_number x, y;
+    int ea, eb, c;
+
+    if (op[0] != '-') {
+        return (strcmp(a, b) == 0) == (op[0] != '!');
+    }
+    if (op[1] == 'n' && op[2] == 't') {
+        ea = stat(a, &sa) == 0;
+        eb = stat(b, &sb) == 0;
+        return ea && (!eb || sa.st_mtim.tv_sec > sb.st_mtim.tv_sec ||
+                      (sa.st_mtim.tv_sec == sb.st_mtim.tv_sec && sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec));
+    }
+    if (op[1] == 'o' && op[2] == 't') {
+        return test_binary(t, b, "-nt", a);
+    }
+    if (op[1] == 'e' && op[2] == 'f') {
+        return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+    }
+    if (!test_integer(t, a, &x) || !test_integer(t, b, &y)) {
+        return 0;
+    }
+    c = test_compare(&x, &y);
+    switch (op[1] * 256 + op[2]) {
+        case 'e' * 256 + 'q':
+            return c == 0;
+        case 'n' * 256 + 'e':
+            return c != 0;
+        case 'l' * 256 + 't':
+            return c < 0;
+        case 'l' * 256 + 'e':
+            return c <= 0;
+        case 'g' * 256 + 't':
+            return c > 0;
+        default:
+            return c >= 0;
+    }
+}
+
+/**
+ * @brief evaluate a unary operator of test.
+ * @param t the state.
+ * @param op the operator, a '-' and one letter.
+ * @param arg the operand.
+ * @returns the result.
+ */
+static int test_unary(test_state *t, const char *op, const char *arg) {
+    struct stat st;
+    test_number fd;
+    int found;
+
+    switch (op[1]) {
+        case 'n':
+            return arg[0] != '\0';
+        case 'z':
+            return arg[0] == '\0';
+        case 't':
+            /* a descriptor has at most 10 digits */
+            return test_integer(t, arg, &fd) && !fd.negative && fd.length <= 10 && atoll(fd.digits) <= 0x7fffffff &&
+                   isatty((int)atoll(fd.digits));
+        case 'r':
+            return faccessat(AT_FDCWD, arg, R_OK, AT_EACCESS) == 0;
+        case 'w':
+            return faccessat(AT_FDCWD, arg, W_OK, AT_EACCESS) == 0;
+        case 'x':
+            return faccessat(AT_FDCWD, arg, X_OK, AT_EACCESS) == 0;
+    }
+    found = (op[1] == 'h' || op[1] == 'L' ? lstat(arg, &st) : stat(arg, &st)) == 0;
+    switch (op[1]) {
+        case 'e':
+            return found;
+        case 'f':
+            return found && S_ISREG(st.st_mode);
+        case 'd':
+            return found && S_ISDIR(st.st_mode);
+        case 'b':
+            return found && S_ISBLK(st.st_mode);
+        case 'c':
+            return found && S_ISCHR(st.st_mode);
+        case 'p':
+            return found && S_ISFIFO(st.st_mode);
+        case 'S':
+            return found && S_ISSOCK(st.st_mode);
+        case 'h':
+        case 'L':
+            return found && S_ISLNK(st.st_mode);
+        case 's':
+            return found && st.st_size > 0;
+        case 'g':
+            return found && (st.st_mode & S_ISGID);
+        case 'u':
+            return found && (st.st_mode & S_ISUID);
+        case 'k':
+            return found && (st.st_mode & S_ISVTX);
+        case 'O':
+            return found && st.st_uid == geteuid();
+        case 'G':
+            return found && st.st_gid == getegid();
+        case 'N':
+            return found && (st.st_mtim.tv_sec > st.st_atim.tv_sec ||
+                             (st.st_mtim.tv_sec == st.st_atim.tv_sec && st.st_mtim.tv_nsec > st.st_atim.tv_nsec));
+        default:
+            return test_error(t, "'%s': unary operator expected", op);
+    }
+}
+
+static int test_or(test_state *t);
+
+/**
+ * @brief evaluate a term of a test expression: '!' term, '(' expression ')', a unary or binary
+ * operation or a string.
+ * @param t the state.
+ * @returns the result.
+ */
+static int test_term(test_state *t) {
+    char **a = t->argv + t->pos;
+    int left = t->argc - t->pos;
+    int value;
+
+    if (left <= 0) {
+        return test_error(t, "missing argument after '%s'", t->pos > 0 ? t->argv[t->pos - 1] : "");
+    }
+    if (strcmp(a[0], "!") == 0) {
+        t->pos++;
+        return !test_term(t);
+    }
+    if (strcmp(a[0], "(") == 0) {
+        t->pos++;
+        value = test_or(t);
+        if (t->pos >= t->argc || strcmp(t->argv[t->pos], ")") != 0)
+            return test_error(t, "missing ')'", "");
+        t->pos++;
+        return value;
+    }
+    if (left >= 3 && is_binary(a[1])) {
+        t->pos += 3;
+        return test_binary(t, a[0], a[1], a[2]);
+    }
+    if (a[0][0] == '-' && a[0][1] != '\0' && a[0][2] == '\0') {
+        if (left < 2)
+            return test_error(t, "missing argument after '%s'", a[0]);
+        t->pos += 2;
+        return test_unary(t, a[0], a[1]);
+    }
+    t->pos++;
+    return a[0][0] != '\0';
+}
+
+/**
+ * @brief evaluate terms joined by '-a'.
+ * @param t the state.
+ * @returns the result.
+ */
+static int test_and(test_state *t) {
+    int value = test_term(t);
+    while (!t->error && t->pos < t->argc && strcmp(t->argv[t->pos], "-a") == 0) {
+        t->pos++;
+        value = test_term(t) && value;
+    }
+    return value;
+}
+
+/**
+ * @brief evaluate '-a' expressions joined by '-o'.
+ * @param t the state.
+ * @returns the result.
+ */
+static int test_or(test_state *t) {
+    int value = test_and(t);
+    while (!t->error && t->pos < t->argc && strcmp(t->argv[t->pos], "-o") == 0) {
+        t->pos++;
+        value = test_and(t) || value;
+    }
+    return value;
+}
+
+/**
+ * @brief evaluate a test expression, with the special cases POSIX gives to 4 arguments or less.
+ * @param t the state.
+ * @param n number of arguments left from t->pos.
+ * @returns the result.
+ *
+ * With few arguments the position decides what is an operator, so 'test -f' is a string and
+ * 'test ! = x' compares "!" with "x".
+ */
+static int test_posix(test_state *t, int n) {
+    char **a = t->argv + t->pos;
+    int value;
+
+    switch (n) {
+        case 0:
+            return 0;
+        case 1:
+            t->pos++;
+            return a[0][0] != '\0';
+        case 2:
+            if (strcmp(a[0], "!") == 0) {
+                t->pos += 2;
+                return a[1][0] == '\0';
+            }
+            if (a[0][0] != '-' || a[0][1] == '\0' || a[0][2] != '\0')
+                return test_error(t, "missing argument after '%s'", a[1]);
+            t->pos += 2;
+            return test_unary(t, a[0], a[1]);
+        case 3:
+            if (is_binary(a[1])) {
+                t->pos += 3;
+                return test_binary(t, a[0], a[1], a[2]);
+            }
+            if (strcmp(a[0], "!") == 0) {
+                t->pos++;
+                return !test_posix(t, 2);
+            }
+            if (strcmp(a[0], "(") == 0 && strcmp(a[2], ")") == 0) {
+                t->pos += 3;
+                return a[1][0] != '\0';
+            }
+            if (strcmp(a[1], "-a") == 0 || strcmp(a[1], "-o") == 0)
+                return test_or(t);
+            return test_error(t, "'%s': binary operator expected", a[1]);
+        case 4:
+            if (strcmp(a[0], "!") == 0) {
+                t->pos++;
+                return !test_posix(t, 3);
+            }
+            if (strcmp(a[0], "(") == 0 && strcmp(a[3], ")") == 0) {
+                t->pos++;
+                value = test_posix(t, 2);
+                t->pos++;
+                return value;
+            }
+            /* fall through */
+        default:
+            return test_or(t);
+    }
+}
+
+/**
+ * @brief the test and [ builtins.
+ * @param argc argument count.
+ * @param argv 'test expression' or '[ expression ]'.
+ *
+ * The exit status is 0 if the expression is true, 1 if it is false and 2 on a syntax error.
+ */
+void test_builtin(int argc, char **argv) {
+    test_state t;
+    int value;
+
+    t.name = argv[0];
+    t.argv = argv + 1;
+    t.argc = argc - 1;
+    t.pos = t.error = 0;
+    if (strcmp(argv[0], "[") == 0) {
+        if (argc < 2 || strcmp(argv[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            last_status = W_EXITCODE(2, 0);
+            return;
+        }
+        t.argc--;
+    }
+    value = test_posix(&t, t.argc);
+    if (!t.error && t.pos < t.argc) {
+        test_error(&t, "extra argument '%s'", t.argv[t.pos]);
+    }
+    last_status = W_EXITCODE(t.error ? 2 : !value, 0);
+}
+
+/**
+ * @brief the true builtin.
+ * @param argc unused.
+ * @param argv unused.
+ */
+void true_builtin(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+}
+
+/**
+ * @brief the false builtin.
+ * @param argc unused.
+ * @param argv unused.
+ */
+void false_builtin(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    last_status = W_EXITCODE(EXIT_FAILURE, 0);
+}
+
+/**
+ * @brief the formatting options of cat and the state they keep from one file to the next.
+ */
+typedef struct cat_format {
+    int number;      /**< -n: number the lines. */
+    int nonblank;    /**< -b: number the lines that are not empty. */
+    int squeeze;     /**< -s: print one empty line for several. */
+    int ends;        /**< -E: print '$' at the end of every line. */
+    int tabs;        /**< -T: print tabs as ^I. */
+    int nonprinting; /**< -v: print control characters as ^X and bytes above 127 as M-X. */
+    long line;       /**< number of the last numbered line. */
+    int empty;       /**< number of empty lines in a row so far. */
+    int line_start;  /**< True at the start of a line. */
+} cat_format;
+
+/**
+ * @brief wait until a terminal has input or ctrl-c is pressed.
+ * @param fd the terminal.
+ * @returns 0 if \a fd is readable, -1 on ctrl-c.
+ *
+ * Inside the shell SIGINT is blocked and read from signal_fd, so read() from the terminal would
+ * not return on ctrl-c. Dead children found meanwhile are harvested.
+ */
+static int wait_input(int fd) {
+    struct signalfd_siginfo info;
+    struct pollfd pfd[2];
+    int chld = 0;
+
+    pfd[0].fd = fd;
+    pfd[1].fd = signal_fd;
+    pfd[0].events = pfd[1].events = POLLIN;
+    while (poll(pfd, 2, -1) <= 0 || !(pfd[0].revents & (POLLIN | POLLHUP))) {
+        while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+            if (info.ssi_signo == SIGINT)
+                return -1;
+            chld = 1;
+        }
+        if (chld)
+            harvest_dead_child();
+        chld = 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief read a block of input for cat.
+ * @param fd the input.
+ * @param buffer where the data is stored.
+ * @param size size of \a buffer.
+ * @returns the number of bytes read, 0 at the end, -1 on an error with errno set or on ctrl-c
+ * with errno 0.
+ */
+static ssize_t cat_read(int fd, char *buffer, size_t size) {
+    if (getpid() == shell_pid && isatty(fd) && wait_input(fd) == -1) {
+        errno = 0;
+        return -1;
+    }
+    return read(fd, buffer, size);
+}
+
+/**
+ * @brief copy an input to stdout unchanged.
+ * @param fd the input.
+ * @returns 0 on success, -1 on an error with errno set, or on ctrl-c with errno 0.
+ *
+ * A regular file is copied with copy_file_range(), which works when stdout is a file too, or else
+ * with sendfile(). Both continue at the offset where the other one stopped. Whatever they can not
+ * copy, e.g. from a pipe, goes through read() and write().
+ */
+static int cat_copy(int fd) {
+    char buffer[READ_BLOCK_SIZE];
+    struct stat st;
+    ssize_t n, w, done;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        while ((n = copy_file_range(fd, NULL, STDOUT_FILENO, NULL, CAT_CHUNK, 0)) > 0) {
+        }
+        if (n == 0)
+            return 0;
+        while ((n = sendfile(STDOUT_FILENO, fd, NULL, CAT_CHUNK)) > 0) {
+        }
+        if (n == 0)
+            return 0;
+    }
+    while ((n = cat_read(fd, buffer, sizeof(buffer))) > 0) {
+        for (done = 0; done < n; done += w) {
+            if ((w = write(STDOUT_FILENO, buffer + done, n - done)) == -1)
+                return -1;
+        }
+    }
+    return n == 0 ? 0 : -1;
+}
+
+/**
+ * @brief copy an input to stdout with the formatting options.
+ * @param fd the input.
+ * @param f the options and the state left by the previous input.
+ * @returns 0 on success, -1 on an error with errno set, or on ctrl-c with errno 0.
+ */
+static int cat_formatted(int fd, cat_format *f) {
+    unsigned char buffer[READ_BLOCK_SIZE];
+    ssize_t n, i;
+    int c;
+
+    while ((n = cat_read(fd, (char *)buffer, sizeof(buffer))) > 0) {
+        for (i = 0; i < n; ++i) {
+            c = buffer[i];
+            if (c == '\n') {
+                if (f->line_start) {
+                    if (f->squeeze && ++f->empty > 1)
+                        continue;
+                    if (f->number && !f->nonblank)
+                        printf("%6ld\t", ++f->line);
+                }
+                if (f->ends)
+                    putchar('$');
+                putchar('\n');
+                f->line_start = 1;
+                continue;
+            }
+            if (f->line_start) {
+                if (f->number)
+                    printf("%6ld\t", ++f->line);
+                f->empty = f->line_start = 0;
+            }
+            if (c == '\t' && f->tabs) {
+                fputs("^I", stdout);
+            } else if (f->nonprinting && c != '\t' && (c < 32 || c >= 127)) {
+                if (c >= 128) {
+                    fputs("M-", stdout);
+                    c -= 128;
+                }
+                if (c < 32)
+                    printf("^%c", c + 64);
+                else if (c == 127)
+                    fputs("^?", stdout);
+                else
+                    putchar(c);
+            } else {
+                putchar(c);
+            }
+        }
+    }
+    return n == 0 ? 0 : -1;
+}
+
+/**
+ * @brief the cat builtin.
+ * @param argc argument count.
+ * @param argv 'cat [-AbeEnstTuv] [file]...', '-' or no file for stdin.
+ *
+ * Options may come after files, like with GNU getopt(), up to '--'. The exit status is 1 if a
+ * file could not be read.
+ */
+void cat_builtin(int argc, char **argv) {
+    cat_format f;
+    struct stat in, out;
+    int options = 1, inputs = 0, failed = 0, formatted;
+    const char *p;
+    int i, fd, ret;
+
+    memset(&f, 0, sizeof(f));
+    f.line_start = 1;
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--") == 0)
+            break;
+        if (argv[i][0] != '-' || argv[i][1] == '\0')
+            continue;
+        for (p = argv[i] + 1; *p; ++p) {
+            switch (*p) {
+                case 'A':
+                    f.nonprinting = f.ends = f.tabs = 1;
+                    break;
+                case 'b':
+                    f.number = f.nonblank = 1;
+                    break;
+                case 'e':
+                    f.nonprinting = f.ends = 1;
+                    break;
+                case 'E':
+                    f.ends = 1;
+                    break;
+                case 'n':
+                    f.number = 1;
+                    break;
+                case 's':
+                    f.squeeze = 1;
+                    break;
+                case 't':
+                    f.nonprinting = f.tabs = 1;
+                    break;
+                case 'T':
+                    f.tabs = 1;
+                    break;
+                case 'u':
+                    break;
+                case 'v':
+                    f.nonprinting = 1;
+                    break;
+                default:
+                    fprintf(stderr, "%s: invalid option -- '%c'\nTry '%s --help' for more information.\n", argv[0],
+                            *p, argv[0]);
+                    last_status = W_EXITCODE(EXIT_FAILURE, 0);
+                    return;
+            }
+        }
+    }
+    formatted = f.number || f.squeeze || f.ends || f.tabs || f.nonprinting;
+    fflush(stdout);
+    if (fstat(STDOUT_FILENO, &out) == -1) {
+        out.st_ino = 0;
+    }
+    for (i = 1; i <= argc; ++i) {
+        /* no file means stdin, like a single '-' */
+        if (i == argc && inputs > 0)
+            break;
+        if (i < argc && options && strcmp(argv[i], "--") == 0) {
+            options = 0;
+            continue;
+        }
+        if (i < argc && options && argv[i][0] == '-' && argv[i][1] != '\0')
+            continue;
+        inputs++;
+        p = i < argc ? argv[i] : "-";
+        if (strcmp(p, "-") == 0) {
+            fd = STDIN_FILENO;
+        } else if ((fd = open(p, O_RDONLY | O_CLOEXEC)) == -1) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], p, strerror(errno));
+            failed = 1;
+            continue;
+        }
+        if (out.st_ino != 0 && S_ISREG(out.st_mode) && fstat(fd, &in) == 0 && in.st_dev == out.st_dev &&
+            in.st_ino == out.st_ino) {
+            fprintf(stderr, "%s: %s: input file is output file\n", argv[0], p);
+            ret = 0;
+            failed = 1;
+        } else {
+            ret = formatted ? cat_formatted(fd, &f) : cat_copy(fd);
+        }
+        if (ret == -1 && errno == 0) {
+            /* ctrl-c, the rest of the line is not run either */
+            printf("\n");
+            foreground_interrupted = 1;
+            last_status = W_EXITCODE(128 + SIGINT, 0);
+            if (fd != STDIN_FILENO)
+                close(fd);
+            return;
+        }
+        if (ret == -1) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], p, strerror(errno));
+            failed = 1;
+        }
+        if (fd != STDIN_FILENO)
+            close(fd);
+    }
+    fflush(stdout);
+    if (failed) {
+        last_status = W_EXITCODE(EXIT_FAILURE, 0);
+    }
+}
+
+/**
+ * @brief enable/disable the in-process echo, printf, test, [, true, false and cat.
+ * @param argc argument count, should be 2.
+ * @param argv argv[1] should contain "on" or "off" string.
+ */
+void fast_utils_set(int argc, char **argv) {
+    if (argc != 2) {
+        printf("%s: invalid usage\n", argv[0]);
+        last_status = W_EXITCODE(2, 0);
+        return;
+    }
+    if (strcmp(argv[1], "on") == 0) {
+        printf("fast utilities: %s -> ENABLED\n", fast_utils ? "ENABLED" : "DISABLED");
+        fast_utils = 1;
+    } else if (strcmp(argv[1], "off") == 0) {
+        printf("fast utilities: %s -> DISABLED\n", fast_utils ? "ENABLED" : "DISABLED");
+        fast_utils = 0;
+    } else {
+        fprintf(stderr, "%s: invalid option\n", argv[0]);
+    }
+}
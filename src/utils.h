@@ -9,7 +9,10 @@
 #define SHELL_UTILS
 
 #include <limits.h>
+#include <stdio.h>
+#include <sys/resource.h>
 #include <sys/types.h>
+#include <time.h>
 
 /* resolve portability problems with defined/undefined macros */
 #if !defined(sig_t)
@@ -35,8 +38,19 @@
 
 /* builtin related functions */
 int check_if_builtin(char *cmd);
+int builtin_code(const char *cmd);
+int builtin_enabled(int code);
 void call_builtin(int code, int argc, char **argv);
 void free_all();
+void shell_quit(int exit_code);
+
+/* prompt */
+const char *shell_get_cwd();
+const char *shell_get_host();
+const char *shell_get_user();
+void prompt_invalidate_cwd();
+const char *create_prompt_message();
+void prompt_free();
 
 /* builtin functions */
 void jobs_list(int argc, char **argv);
@@ -47,11 +61,50 @@ void history_on(int argc, char **argv);
 void history_off(int argc, char **argv);
 void print_dead(int argc, char **argv);
 void print_wd(int argc, char **argv);
+void hash_builtin(int argc, char **argv);
+void time_builtin(int argc, char **argv);
+void parallel_builtin(int argc, char **argv);
+void place_builtin(int argc, char **argv);
+void ulimit_builtin(int argc, char **argv);
+void hsearch_builtin(int argc, char **argv);
+void glob_sorting(int argc, char **argv);
+void batch_builtin(int argc, char **argv);
+void batch_auto_set(int argc, char **argv);
+void export_builtin(int argc, char **argv);
+void unset_builtin(int argc, char **argv);
+void tasks_builtin(int argc, char **argv);
+void echo_builtin(int argc, char **argv);
+void printf_builtin(int argc, char **argv);
+void test_builtin(int argc, char **argv);
+void true_builtin(int argc, char **argv);
+void false_builtin(int argc, char **argv);
+void cat_builtin(int argc, char **argv);
+void fast_utils_set(int argc, char **argv);
+void source_builtin(int argc, char **argv);
+
+/* shell variables */
+int var_name_valid(const char *name, size_t len);
+const char *var_lookup(const char *name, size_t len);
+const char *var_get(const char *name);
+void var_set(const char *name, size_t len, const char *value, int export);
+void var_unset(const char *name);
+char **vars_envp();
+void vars_init();
+void vars_free();
+int is_assignment(const char *word);
+void assign(const char *word, int export);
+
+/* command path cache */
+void parse_path();
+char *path_lookup(const char *name);
+void path_forget(const char *name);
+void path_hash_flush();
+void path_hash_free();
 
 /**
  * @brief enum that gives values to all the builtin command codes
  */
-enum {
+enum builtin_codes_macro {
     EXIT_CMD = 0, /**< builtin command code for exit  command*/
     CD_CMD,       /**< builtin command code for cd    command*/
     JOBS_CMD,     /**< builtin command code for jobs  command*/
@@ -60,8 +113,29 @@ enum {
     HON_CMD,      /**< builtin command code for hon   command*/
     PDEAD_CMD,    /**< builtin command code for pdead command*/
     PWD_CMD,      /**< builtin command code for pwd   command*/
+    HASH_CMD,     /**< builtin command code for hash  command*/
+    TIME_CMD,     /**< builtin command code for time  command*/
+    PARALLEL_CMD, /**< builtin command code for parallel command*/
+    PLACE_CMD,    /**< builtin command code for place  command*/
+    ULIMIT_CMD,   /**< builtin command code for ulimit  command*/
+    HSEARCH_CMD,  /**< builtin command code for hsearch command*/
+    GSORT_CMD,    /**< builtin command code for gsort command*/
+    BATCH_CMD,    /**< builtin command code for batch command*/
+    ABATCH_CMD,   /**< builtin command code for autobatch command*/
+    EXPORT_CMD,   /**< builtin command code for export command*/
+    UNSET_CMD,    /**< builtin command code for unset command*/
+    TASKS_CMD,    /**< builtin command code for tasks command*/
+    ECHO_CMD,     /**< builtin command code for echo command, the first of the fast utilities*/
+    PRINTF_CMD,   /**< builtin command code for printf command*/
+    TEST_CMD,     /**< builtin command code for test command*/
+    BRACKET_CMD,  /**< builtin command code for [ command*/
+    TRUE_CMD,     /**< builtin command code for true command*/
+    FALSE_CMD,    /**< builtin command code for false command*/
+    CAT_CMD,      /**< builtin command code for cat command, the last of the fast utilities*/
+    FAST_CMD,     /**< builtin command code for fastutils command*/
+    SOURCE_CMD,   /**< builtin command code for source command*/
     BUILTINS_NUM  /**< length of this enumerator, must always be last */
-} builtin_codes_macro;
+};
 
 /**
  * @brief a struct that implements a builtin command.
@@ -73,6 +147,82 @@ typedef struct builtin_struct {
     char *help_text;                       /**< what is printed when 'help [cmd]' is called. */
 } builtin_struct;
 
+/** the table of all builtins, indexed by their code. */
+extern const builtin_struct builtins[BUILTINS_NUM];
+
+/**
+ * @brief the engines that can be used to launch a child process.
+ */
+enum spawn_engines {
+    ENGINE_SPAWN = 0, /**< posix_spawn() */
+    ENGINE_VFORK,     /**< clone() with CLONE_VM | CLONE_VFORK */
+    ENGINE_FORK,      /**< fork() followed by exec in the child */
+    ENGINES_NUM       /**< length of this enumerator, must always be last */
+};
+
+/**
+ * @brief max number of CPUs a placement can name.
+ */
+#define PLACE_MAX_CPUS 1024
+
+/**
+ * @brief the attributes set in a \a placement.
+ */
+enum placement_flags {
+    PLACE_CPUS = 1,  /**< the CPU affinity is set. */
+    PLACE_NICE = 2,  /**< the nice level is set. */
+    PLACE_IOPRIO = 4 /**< the I/O priority is set. */
+};
+
+/**
+ * @brief scheduling attributes applied to a child before exec.
+ */
+typedef struct placement {
+    int set;                                                          /**< placement_flags of the set attributes. */
+    unsigned long cpus[PLACE_MAX_CPUS / (8 * sizeof(unsigned long))]; /**< CPU affinity mask, a cpu_set_t. */
+    int nice;                                                         /**< nice level, -20 to 19. */
+    int ioprio;                                                       /**< ioprio_set() value: class and level. */
+} placement;
+
+/* placement of launched processes */
+extern placement default_placement;
+int placement_option(placement *p, const char *opt, const char *value);
+void placement_merge(placement *result, const placement *line);
+void placement_apply(const placement *p);
+
+/**
+ * @brief everything needed to launch a single command.
+ */
+typedef struct launch_spec {
+    char *path;                 /**< cached location of argv[0], NULL if it must be searched in PATH. */
+    char **argv;                /**< NULL terminated argument vector. */
+    pid_t pgid;                 /**< process group to join, 0 to start a new one. */
+    int fd_in;                  /**< becomes stdin of the child, -1 to inherit it. */
+    int fd_out;                 /**< becomes stdout of the child, -1 to inherit it. */
+    int fd_extra;               /**< becomes fd 3 of a \a child_fn child, -1 if unused. */
+    int (*child_fn)(void *arg); /**< if set, the child runs this instead of exec and exits with its result. */
+    void *child_arg;            /**< argument passed to \a child_fn. */
+    const placement *place;     /**< scheduling attributes of the child, NULL to inherit those of the shell. */
+} launch_spec;
+
+/* launching processes */
+extern int spawn_engine;
+int set_spawn_engine(const char *name);
+const char *spawn_engine_name();
+void launch_spec_init(launch_spec *spec, char **argv);
+pid_t spawn_command(const launch_spec *spec);
+void spawn_free();
+
+/**
+ * @brief number of posix_spawn() file action sets kept for reuse.
+ */
+#define SPAWN_ACTIONS_CACHE_SIZE 16
+
+/**
+ * @brief size of the stack used by children of the vfork engine until they exec.
+ */
+#define VFORK_STACK_SIZE 65536
+
 /**
  * @brief max length of one line.
  */
@@ -84,22 +234,404 @@ typedef struct builtin_struct {
 #define MAX_PID_LENGTH 10
 
 /**
- * @brief the maximum number of arguments the user can input for a command.
+ * @brief alignment of every arena allocation. Must be a power of 2.
+ */
+#define ARENA_ALIGN 16
+
+/**
+ * @brief size of the first chunk of an arena. Later chunks double in size.
+ */
+#define ARENA_CHUNK_SIZE (1 << 16)
+
+/**
+ * @brief a block of arena memory.
+ */
+typedef struct arena_chunk {
+    struct arena_chunk *next; /**< the previously allocated chunk. */
+    size_t size;              /**< usable bytes in \a data. */
+    char data[];              /**< the memory handed out. */
+} arena_chunk;
+
+/**
+ * @brief a bump allocator. Memory is only given back all at once with arena_reset().
+ */
+typedef struct arena {
+    arena_chunk *head; /**< the current chunk, followed by the older ones. */
+    char *ptr;         /**< the first free byte of \a head. */
+    char *end;         /**< the end of \a head. */
+    char *last;        /**< the latest allocation, which arena_grow() can extend in place. */
+} arena;
+
+/**
+ * @brief a position in an arena, see arena_save() and arena_rewind().
+ */
+typedef struct arena_mark {
+    arena_chunk *head; /**< the current chunk when the mark was taken. */
+    char *ptr;         /**< the first free byte of \a head then. */
+} arena_mark;
+
+/* arena allocator */
+void arena_init(arena *a);
+void *arena_alloc(arena *a, size_t n);
+void *arena_grow(arena *a, void *p, size_t old, size_t n);
+char *arena_strdup(arena *a, const char *s);
+arena_mark arena_save(arena *a);
+void arena_rewind(arena *a, arena_mark m);
+void arena_reset(arena *a);
+void arena_free(arena *a);
+
+/** the arena of the current line. Reset before each top level line is read. */
+extern arena line_arena;
+
+#ifdef COUNT_ALLOCS
+/* allocation counter, see alloccount.c */
+extern unsigned long alloc_count;
+void alloc_count_start();
+void alloc_count_report();
+/** start counting the allocations of a command line. */
+#define ALLOC_COUNT_START() alloc_count_start()
+/** print the allocations of the current command line. */
+#define ALLOC_COUNT_REPORT() alloc_count_report()
+#else
+#define ALLOC_COUNT_START()
+#define ALLOC_COUNT_REPORT()
+#endif
+
+/**
+ * @brief initial capacity of the token vector of a line.
+ */
+#define TOKENS_INITIAL_SIZE 16
+
+/**
+ * @brief initial capacity of the argument vector of a command.
+ */
+#define ARGV_INITIAL_SIZE 8
+
+/**
+ * @brief initial capacity of the command vectors of a pipeline.
+ */
+#define COMMANDS_INITIAL_SIZE 4
+
+/**
+ * @brief initial number of slots in the variable hash table. Must be a power of 2.
+ */
+#define VARS_TABLE_INITIAL_SIZE 256
+
+/**
+ * @brief initial number of slots in the command path hash table. Must be a power of 2.
+ */
+#define PATH_HASH_INITIAL_SIZE 64
+
+/**
+ * @brief size requested with F_SETPIPE_SZ for the pipes between pipeline stages.
+ */
+#define PIPE_SIZE (1 << 20)
+
+/**
+ * @brief max bytes moved by one tee() or splice() call of a fan-out relay.
+ */
+#define RELAY_CHUNK (1 << 20)
+
+/**
+ * @brief size of the blocks read by the non-interactive line reader.
+ */
+#define READ_BLOCK_SIZE (1 << 16)
+
+/**
+ * @brief reads lines from a file descriptor or a string in large blocks.
+ */
+typedef struct line_reader {
+    int fd;       /**< input file descriptor, -1 for a string. */
+    char *buffer; /**< the buffered input, one byte longer than \a size for a terminator. */
+    size_t size;  /**< capacity of \a buffer. */
+    size_t start; /**< offset of the first unread byte. */
+    size_t end;   /**< offset after the last buffered byte. */
+    int eof;      /**< True once the input is exhausted. */
+} line_reader;
+
+/* non-interactive input */
+void reader_open_fd(line_reader *r, int fd);
+void reader_open_string(line_reader *r, const char *s);
+void reader_close(line_reader *r);
+char *reader_next_line(line_reader *r);
+
+/**
+ * @brief a parsed command line: stages connected with '|', optionally followed by a fan-out.
  *
- * Does not include argv[0] (command name). If the user enters more arguments they will be ignored.
- * We can overcome this limitation if we implement the argv[] array in main() using a dynamic array.
+ * 'a | b |& c, d' has the stages a and b. The output of b is copied to both c and d, which are
+ * the fan-out consumers.
+ */
+typedef struct pipeline {
+    int stages;      /**< number of commands connected with '|'. */
+    int consumers;   /**< number of commands after '|&', 0 if there is no fan-out. */
+    int *argc;       /**< argument count of each command, stages first then consumers. */
+    char ***argv;    /**< argument vector of each command, stages first then consumers. */
+    int background;  /**< True if the line ended with '&'. */
+    int timed;       /**< True if the line started with the 'time' prefix. */
+    placement place; /**< attributes of the 'place' prefix, place.set is 0 without it. */
+    int builtin;     /**< builtin_code() of the first command if it is already known, else BUILTIN_UNKNOWN. */
+} pipeline;
+
+/**
+ * @brief pipeline.builtin of a pipeline whose command was not looked up yet.
+ */
+#define BUILTIN_UNKNOWN (-2)
+
+/**
+ * @brief the kinds of tokens made by the lexer.
+ */
+enum token_types {
+    TOK_WORD = 0, /**< a word, already unquoted */
+    TOK_PIPE,     /**< '|' */
+    TOK_FANOUT,   /**< '|&' */
+    TOK_COMMA,    /**< ',' between fan-out consumers */
+    TOK_AMP       /**< '&' */
+};
+
+/**
+ * @brief the operators that end a pipeline of a list.
+ */
+enum list_operators {
+    LIST_END = 0, /**< the end of the line */
+    LIST_SEQ,     /**< ';' */
+    LIST_BG,      /**< '&', the pipeline runs in the background */
+    LIST_AND,     /**< '&&', the next pipeline runs if this one succeeded */
+    LIST_OR       /**< '||', the next pipeline runs if this one failed */
+};
+
+/**
+ * @brief a pipeline of a list, still unparsed.
+ */
+typedef struct list_item {
+    char *text; /**< the text of the pipeline, '\0' terminated inside the line. */
+    int op;     /**< the operator after it, one of the values of \enum list_operators. */
+} list_item;
+
+/**
+ * @brief initial capacity of the vector of the pipelines of a list.
+ */
+#define LIST_INITIAL_SIZE 8
+
+/**
+ * @brief a token of a command line.
+ */
+typedef struct token {
+    int type;   /**< one of the values of \enum token_types. */
+    char *text; /**< the '\0' terminated word inside the line, NULL for operators. */
+    char *end;  /**< the end of the word, where its terminator is written. */
+    char *glob; /**< NULL if the word has no unquoted '*', '?' or '['. Else True for each of them, per byte. */
+    char *refs; /**< NULL if the word has no variable references. Else the length of each one at its '$', per byte. */
+    int quoted; /**< True if the word had quotes or escapes, so it is kept even if it expands to nothing. */
+} token;
+
+/* lexer and parser */
+int lex_line(char *line, arena *a, token **tokens);
+char *expand_word(const token *t, arena *a, char **glob);
+int expand_words(const token *tokens, int count, arena *a, char ***words);
+int split_list(char *line, arena *a, list_item **items);
+int build_pipeline(const token *tokens, int count, pipeline *pl, arena *a);
+int parse_pipeline(char *line, pipeline *pl, arena *a);
+extern const char *list_names[];
+
+/**
+ * @brief the keywords of the blocks, recognized as the first word of a pipeline.
+ */
+enum keywords {
+    KW_NONE = 0, /**< not a keyword: a command */
+    KW_FOR,      /**< 'for' */
+    KW_WHILE,    /**< 'while' */
+    KW_UNTIL,    /**< 'until' */
+    KW_IF,       /**< 'if' */
+    KW_DO,       /**< 'do' */
+    KW_DONE,     /**< 'done' */
+    KW_THEN,     /**< 'then' */
+    KW_ELIF,     /**< 'elif' */
+    KW_ELSE,     /**< 'else' */
+    KW_FI,       /**< 'fi' */
+    KW_END       /**< no pipelines left */
+};
+
+/**
+ * @brief the instructions a list is compiled to, see control.c.
+ */
+enum instruction_codes {
+    INS_RUN = 0,   /**< run the pipeline arg */
+    INS_JUMP,      /**< continue at instruction arg */
+    INS_JUMP_FAIL, /**< continue at instruction arg if the last pipeline failed */
+    INS_JUMP_OK,   /**< continue at instruction arg if the last pipeline succeeded */
+    INS_FOR_START, /**< expand the words of the for loop arg */
+    INS_FOR_NEXT,  /**< set the variable of the for loop arg to its next word, or leave the loop */
+    INS_FORGET,    /**< set the kept status to 0, at the start of a loop */
+    INS_KEEP,      /**< keep the status, at the end of an iteration */
+    INS_RESTORE,   /**< set the status to the kept one, after a loop */
+    INS_SUCCEED    /**< set the status to 0, after an if without a branch taken */
+};
+
+/**
+ * @brief initial capacity of the instruction, pipeline and loop vectors of a program.
+ */
+#define PROGRAM_INITIAL_SIZE 16
+
+/**
+ * @brief a pipeline of a program, lexed once.
+ */
+typedef struct block_command {
+    token *tokens;  /**< the tokens, expanded each time the pipeline runs. */
+    int count;      /**< number of tokens. */
+    int background; /**< True if the pipeline ended with '&'. */
+    char *name;     /**< the command name if it is a literal word, NULL if it is only known once expanded. */
+    int code;       /**< builtin_code() of \a name. */
+} block_command;
+
+/**
+ * @brief a for loop of a program.
+ */
+typedef struct for_loop {
+    char *name;        /**< the variable. */
+    token *words;      /**< the tokens of the words after 'in'. */
+    int count;         /**< number of tokens in \a words. */
+    int end;           /**< the instruction after the loop. */
+    char **values;     /**< the expanded words while the loop runs, NULL terminated. */
+    int next;          /**< index of the next value. */
+    arena_mark *outer; /**< the memory of the pipelines around the loop. */
+    arena_mark inner;  /**< the end of \a values, where the memory of the pipelines of the body starts. */
+} for_loop;
+
+/**
+ * @brief an instruction of a program.
+ */
+typedef struct instruction {
+    int code; /**< one of the values of \enum instruction_codes. */
+    int arg;  /**< a pipeline, an instruction or a loop, depending on \a code. */
+} instruction;
+
+/**
+ * @brief a compiled list.
+ */
+typedef struct program {
+    instruction *code;       /**< the instructions. */
+    int length;              /**< number of instructions. */
+    int code_cap;            /**< capacity of \a code. */
+    block_command *commands; /**< the pipelines. */
+    int commands_count;      /**< number of pipelines. */
+    int commands_cap;        /**< capacity of \a commands. */
+    for_loop *loops;         /**< the for loops. */
+    int loops_count;         /**< number of for loops. */
+    int loops_cap;           /**< capacity of \a loops. */
+} program;
+
+/* blocks, see control.c */
+void resolve_command(block_command *cmd);
+int compile_program(list_item *items, int count, int more, program *p);
+void run_program(program *p);
+int run_list(list_item *items, int count, int more);
+int execute_line(const char *line, int more);
+int block_open();
+int drop_open_block();
+int run_input(const char *line, int more);
+
+/**
+ * @brief the first 8 bytes of a cache file of the source builtin, "shsrcv01". Changes with its format.
+ */
+#define SOURCE_MAGIC 0x3130766372736873ULL
+
+/**
+ * @brief how deep source can nest, e.g. a script that sources itself.
+ */
+#define SOURCE_DEPTH_MAX 100
+
+/**
+ * @brief size of the buffer directories are read into by the glob expansion.
+ */
+#define GLOB_DENTS_SIZE (1 << 20)
+
+/**
+ * @brief initial capacity of the match vector of a pattern.
+ */
+#define GLOB_MATCHES_INITIAL_SIZE 16
+
+/* pathname expansion */
+extern int glob_sort;
+size_t glob_expand(const char *word, const char *active, arena *a, char ***matches);
+void glob_free();
+
+/* pipelines */
+void run_pipeline(pipeline *pl);
+void run_queued_jobs();
+
+/**
+ * @brief initial capacity of the job vector of the parallel builtin.
+ */
+#define PARALLEL_JOBS_INITIAL_SIZE 16
+
+/**
+ * @brief jobs of the parallel builtin that may wait, finished, for an earlier one beyond the running ones.
  *
- * example: user enters:'./t 1 2 3 4 5 6 7' with a MAX_ARGS of 4 ./t will be executed and
- * arguments 1, 2, 3 and 4 will be passed. 5, 6 and 7 will be ignored and will not cause an error.
+ * Bounds the memfds held open for ordered output while a slow job blocks the output of the others.
  */
-#define MAX_ARGS 4
+#define PARALLEL_BACKLOG 64
 
 /**
- * @brief the real length of *argv[].
+ * @brief the most bytes of arguments and environment exec takes, 3/4 of the 8 MB stack limit of the kernel.
  *
- * the *argv[] array needs 2 extra spaces. One for the command name and one for NULL.
+ * sysconf(_SC_ARG_MAX) follows RLIMIT_STACK and can be higher than what the kernel accepts.
  */
-#define ARGS_ARRAY_LEN MAX_ARGS + 2
+#define BATCH_ARG_MAX (6 << 20)
+
+/**
+ * @brief bytes of the argument area of exec that batch leaves free, for the auxiliary data of the kernel.
+ */
+#define BATCH_HEADROOM 4096
+
+/* in-process utilities, see utilities.c */
+extern int fast_utils;
+
+/**
+ * @brief size of the format given to the C library for one conversion of the printf builtin.
+ */
+#define PRINTF_SPEC_SIZE 64
+
+/**
+ * @brief the most bytes cat asks copy_file_range() or sendfile() to copy at once.
+ */
+#define CAT_CHUNK (1 << 30)
+
+/* parallel and batch */
+extern int batch_auto;
+size_t exec_args_size(char **argv, int argc);
+size_t exec_args_limit();
+void write_captured(int *fd);
+
+/**
+ * @brief the states of a task of the tasks builtin.
+ */
+enum task_states {
+    TASK_WAITING = 0, /**< not started, some of its dependencies are not done */
+    TASK_RUNNING,     /**< its command runs */
+    TASK_DONE,        /**< succeeded */
+    TASK_FAILED,      /**< its command failed or could not be launched */
+    TASK_SKIPPED      /**< not run because a dependency failed or was skipped */
+};
+
+/**
+ * @brief initial capacity of the task vector of the tasks builtin, and of the dependency vector of a task.
+ */
+#define TASKS_INITIAL_SIZE 16
+
+/**
+ * @brief number of process records allocated at once by the job table.
+ */
+#define JOB_SLAB_SIZE 256
+
+/**
+ * @brief initial number of slots in the job hash table. Must be a power of 2.
+ */
+#define JOB_TABLE_INITIAL_SIZE 64
+
+/**
+ * @brief max number of completed background jobs kept until 'jobs' lists them. The oldest are dropped.
+ */
+#define JOB_FINISHED_MAX 1024
 
 /**
  * @brief Length of the message shown when a child is terminated by a signal.
@@ -109,23 +641,192 @@ typedef struct builtin_struct {
 /**
  * @brief used in mass_signal_set()
  */
-enum {
+enum signal_set {
     SET_DFL = 0, /**< Ignore signals */
     SET_IGN      /**< Default behavior */
-} signal_set;
+};
 
 /**
  * @brief struct that defines a single process
  */
 typedef struct process {
-    struct process *next; /**< next process in list. */
-    pid_t pid;            /**< process ID. */
-    int completed;        /**< true if process is completed. */
-    int status;           /**< reported status value. */
-    int bg;               /**< true if process is running on the background */
+    struct process *next;  /**< next process in launch order, or next free record. */
+    struct process *prev;  /**< previous process in launch order. */
+    pid_t pid;             /**< process ID. */
+    pid_t pgid;            /**< process group, shared by all processes of a pipeline. */
+    int completed;         /**< true if process is completed. */
+    int status;            /**< reported status value. */
+    int bg;                /**< true if process is running on the background */
+    struct timespec start; /**< when the process was launched, CLOCK_MONOTONIC. */
+    struct timespec end;   /**< when the process was reaped, CLOCK_MONOTONIC. */
+    struct rusage usage;   /**< resources used by the process, filled in by wait4() when it is reaped. */
 } process;
 
-/** the head process is the latest added process. The head of the linked list */
-process *head;
+/**
+ * @brief resources used by a process or a whole pipeline.
+ */
+typedef struct job_stats {
+    double wall; /**< elapsed time in seconds. */
+    double user; /**< user CPU time in seconds. */
+    double sys;  /**< system CPU time in seconds. */
+    long maxrss; /**< max resident set size in KB. The max over all processes of a pipeline. */
+    long nvcsw;  /**< voluntary context switches. */
+    long nivcsw; /**< involuntary context switches. */
+} job_stats;
+
+/* signals and children, see signals.c */
+extern process *current;
+extern int signal_fd;
+extern int interactive;
+extern int last_status;
+extern int script_interrupted;
+extern int readline_active;
+extern int always_print_dead;
+extern int foreground_interrupted;
+extern pid_t shell_pid;
+void setup_signals();
+int setup_child_signals();
+void mass_signal_set(int handler_code);
+void handle_signals(int foreground);
+int poll_interrupt();
+void harvest_dead_child();
+void wait_for_processes(process **procs, int count, int last_started);
+int launch_one(launch_spec *spec, int argc, int bg, process **procs, int *count);
+
+/**
+ * @brief lines of the history log given to readline at startup. Older ones stay in the log only.
+ */
+#define HISTORY_RECENT 1000
+
+/**
+ * @brief identifies a history index file, "hlogidx1" in little endian.
+ */
+#define HLOG_MAGIC 0x31786469676f6c68ULL
+
+/**
+ * @brief the mappings of the history log and its index grow in steps of this many bytes.
+ */
+#define HLOG_MAP_STEP (1 << 20)
+
+/**
+ * @brief line offsets written to the history index at once while it is built.
+ */
+#define HLOG_INDEX_BATCH 512
+
+/* history log */
+int hlog_open();
+void hlog_append(const char *line);
+size_t hlog_count();
+size_t hlog_accepted();
+const char *hlog_line(size_t i, size_t *len);
+void hlog_close();
+
+/**
+ * @brief initial number of slots of the tables of the history search.
+ */
+#define HSEARCH_TABLE_INITIAL_SIZE 1024
+
+/**
+ * @brief max number of results of a history search.
+ */
+#define HSEARCH_MAX_RESULTS 64
+
+/**
+ * @brief results printed by 'hsearch' without -n.
+ */
+#define HSEARCH_DEFAULT_RESULTS 10
+
+/**
+ * @brief max length of a history search query. Longer ones are cut.
+ */
+#define HSEARCH_MAX_QUERY 4096
+
+/**
+ * @brief max number of words of a history search query. The others are ignored.
+ */
+#define HSEARCH_MAX_WORDS 16
+
+/**
+ * @brief max number of trigrams used to find the candidates of a query. The words are still checked whole.
+ */
+#define HSEARCH_MAX_TRIGRAMS 64
+
+/**
+ * @brief age in lines after which the rank of a history line is halved.
+ */
+#define HSEARCH_RECENCY_SCALE 1000.0
+
+/**
+ * @brief history lines indexed for search at a time while the shell waits for input.
+ */
+#define HSEARCH_INDEX_STEP 1024
+
+/**
+ * @brief a result of a history search.
+ */
+typedef struct hs_result {
+    const char *line; /**< the line in the mapping of the history log, not '\0' terminated. */
+    size_t len;       /**< length of the line. */
+    unsigned count;   /**< how many times the line is in the log. */
+} hs_result;
+
+/* history search */
+int histsearch_pending();
+void histsearch_step();
+int histsearch_query(size_t lines, const char *query, hs_result *best, int max);
+int histsearch_key(int count, int key);
+void histsearch_free();
+
+/**
+ * @brief initial capacity of the name vector of a PATH directory in the completion index.
+ */
+#define COMPLETE_NAMES_INITIAL_SIZE 256
+
+/**
+ * @brief milliseconds a changed PATH directory must be quiet before it is listed again.
+ */
+#define COMPLETE_DEBOUNCE_MS 200
+
+/**
+ * @brief size of the buffer inotify events are read into.
+ */
+#define COMPLETE_EVENT_BUFFER 4096
+
+/* tab completion */
+void completion_init();
+void completion_free();
+
+/* job table */
+extern int save_history_to_file;
+process *job_alloc();
+void job_release(process *p);
+void job_insert(process *p);
+process *job_find(pid_t pid);
+process *pop_from_pid(pid_t id_to_match);
+process *job_oldest();
+size_t job_count();
+void job_finish(process *p);
+process *job_finished_oldest();
+void job_finished_clear();
+void job_stats_of(const process *p, job_stats *s);
+void job_stats_add(job_stats *total, const job_stats *s);
+void job_stats_print(FILE *f, const job_stats *s);
+
+/**
+ * @brief a background pipeline waiting for a free slot, see 'jobs -max'.
+ */
+typedef struct queued_job {
+    struct queued_job *next; /**< the next entry of the queue. */
+    int id;                  /**< number shown by 'jobs'. */
+    pipeline pl;             /**< the pipeline. Its vectors and strings are in the same block as the entry. */
+} queued_job;
+
+/* admission queue of background pipelines */
+extern int bg_jobs_max;
+size_t job_bg_running();
+queued_job *job_queue_push(const pipeline *pl);
+queued_job *job_queue_oldest();
+queued_job *job_queue_pop();
+size_t job_queue_length();
 
 #endif
@@ -0,0 +1,355 @@
+/** \file vars.c
+* \brief shell variables and the environment of the children.
+*
+* Variables live in an open addressing hash table. Each entry is a single "NAME=value" string,
+* so the environment passed to exec is a vector of pointers to the strings of the exported
+* entries. That vector is built once and only rebuilt after an exported variable was set,
+* exported or unset, every launch in between reuses it.
+*
+* The variables of the environment the shell was started with are exported. Exported changes
+* are also made with setenv(), so the PATH searches of execvp() and posix_spawnp() see them.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "utils.h"
+
+extern char **environ;
+
+/**
+ * @brief a variable.
+ */
+typedef struct var_entry {
+    char *text;      /**< "NAME=value", NULL if the slot is empty. */
+    size_t name_len; /**< length of the name. */
+    int exported;    /**< True if it is in the environment of the children. */
+} var_entry;
+
+/** open addressing table, always a power of 2 in length. */
+static var_entry *table = NULL;
+/** number of slots in \a table. */
+static size_t table_size = 0;
+/** number of used slots in \a table. */
+static size_t table_used = 0;
+
+/** the environment of the children, NULL terminated. Points to the strings of the entries. */
+static char **envp = NULL;
+/** capacity of \a envp. */
+static size_t envp_cap = 0;
+/** True if \a envp matches the exported variables. */
+static int envp_valid = 0;
+
+/**
+ * @brief FNV-1a hash of a name.
+ * @param name the name.
+ * @param len length of the name.
+ * @returns the hash value.
+ */
+static size_t hash_name(const char *name, size_t len) {
+    size_t h = 2166136261u;
+    while (len--) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief find the slot for a name.
+ * @param name the name, need not be '\0' terminated.
+ * @param len length of the name.
+ * @returns the slot that holds \a name or the empty slot where it should be inserted.
+ */
+static var_entry *find_slot(const char *name, size_t len) {
+    size_t i = hash_name(name, len) & (table_size - 1);
+    while (table[i].text && (table[i].name_len != len || memcmp(table[i].text, name, len) != 0)) {
+        i = (i + 1) & (table_size - 1);
+    }
+    return &table[i];
+}
+
+/**
+ * @brief double the size of the table and rehash all entries.
+ */
+static void grow_table() {
+    var_entry *old = table;
+    size_t old_size = table_size;
+    size_t i;
+
+    table_size = old_size ? old_size * 2 : VARS_TABLE_INITIAL_SIZE;
+    table = calloc(table_size, sizeof(var_entry));
+    for (i = 0; i < old_size; ++i) {
+        if (old[i].text) {
+            *find_slot(old[i].text, old[i].name_len) = old[i];
+        }
+    }
+    free(old);
+}
+
+/**
+ * @brief check if a string is a valid variable name.
+ * @param name the name.
+ * @param len length of the name.
+ * @returns True if it is a letter or '_' followed by letters, digits and '_'.
+ */
+int var_name_valid(const char *name, size_t len) {
+    size_t i;
+    if (len == 0 || (name[0] >= '0' && name[0] <= '9')) {
+        return 0;
+    }
+    for (i = 0; i < len; ++i) {
+        if (!(name[i] == '_' || (name[i] >= 'a' && name[i] <= 'z') || (name[i] >= 'A' && name[i] <= 'Z') ||
+              (name[i] >= '0' && name[i] <= '9')))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief look up a variable.
+ * @param name the name, need not be '\0' terminated.
+ * @param len length of the name.
+ * @returns the value, NULL if the variable is not set. Valid until the variable changes.
+ */
+const char *var_lookup(const char *name, size_t len) {
+    var_entry *e;
+
+    if (table_size == 0) {
+        return NULL;
+    }
+    e = find_slot(name, len);
+    return e->text ? e->text + e->name_len + 1 : NULL;
+}
+
+/**
+ * @brief look up a variable.
+ * @param name the name.
+ * @returns the value, NULL if the variable is not set. Valid until the variable changes.
+ */
+const char *var_get(const char *name) { return var_lookup(name, strlen(name)); }
+
+/**
+ * @brief store a variable in the table.
+ * @param name the name, need not be '\0' terminated. Must be valid.
+ * @param len length of the name.
+ * @param value the value.
+ * @param export True to export the variable. An exported variable stays exported anyway.
+ * @returns the entry.
+ */
+static var_entry *store(const char *name, size_t len, const char *value, int export) {
+    size_t value_len = strlen(value);
+    var_entry *e;
+    char *text;
+
+    /* keep the load factor under 1/2 */
+    if ((table_used + 1) * 2 > table_size) {
+        grow_table();
+    }
+    e = find_slot(name, len);
+    text = malloc(len + value_len + 2);
+    memcpy(text, name, len);
+    text[len] = '=';
+    memcpy(text + len + 1, value, value_len + 1);
+    if (e->text == NULL) {
+        table_used++;
+        e->exported = 0;
+    }
+    free(e->text);
+    e->text = text;
+    e->name_len = len;
+    if (export || e->exported) {
+        e->exported = 1;
+        envp_valid = 0;
+    }
+    return e;
+}
+
+/**
+ * @brief set a variable.
+ * @param name the name, need not be '\0' terminated. Must be valid.
+ * @param len length of the name.
+ * @param value the value.
+ * @param export True to export the variable. An exported variable stays exported anyway.
+ */
+void var_set(const char *name, size_t len, const char *value, int export) {
+    var_entry *e = store(name, len, value, export);
+
+    if (e->exported) {
+        e->text[len] = '\0';
+        setenv(e->text, e->text + len + 1, 1);
+        e->text[len] = '=';
+    }
+}
+
+/**
+ * @brief remove a variable.
+ * @param name the name.
+ *
+ * The entries that follow in the same probe sequence are moved back, like in path_forget().
+ */
+void var_unset(const char *name) {
+    size_t len = strlen(name);
+    size_t i, j, k;
+
+    if (table_size == 0 || find_slot(name, len)->text == NULL) {
+        return;
+    }
+    i = find_slot(name, len) - table;
+    if (table[i].exported) {
+        envp_valid = 0;
+        unsetenv(name);
+    }
+    free(table[i].text);
+    table[i].text = NULL;
+    table_used--;
+    for (j = (i + 1) & (table_size - 1); table[j].text; j = (j + 1) & (table_size - 1)) {
+        k = hash_name(table[j].text, table[j].name_len) & (table_size - 1);
+        /* move the entry back unless its home slot lies cyclically in (i, j] */
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        table[i] = table[j];
+        table[j].text = NULL;
+        i = j;
+    }
+}
+
+/**
+ * @brief the environment of the children.
+ * @returns the NULL terminated "NAME=value" strings of the exported variables.
+ *
+ * Only rebuilt after an exported variable changed. Called before every launch, so a child that
+ * calls it again, e.g. the child of the vfork engine, gets the cached vector and allocates nothing.
+ */
+char **vars_envp() {
+    size_t i, n = 0;
+
+    if (envp_valid) {
+        return envp;
+    }
+    if (table_used + 1 > envp_cap) {
+        envp_cap = table_used + 1;
+        envp = realloc(envp, envp_cap * sizeof(char *));
+    }
+    for (i = 0; i < table_size; ++i) {
+        if (table[i].text && table[i].exported)
+            envp[n++] = table[i].text;
+    }
+    envp[n] = NULL;
+    envp_valid = 1;
+    return envp;
+}
+
+/**
+ * @brief fill the table with the environment the shell was started with.
+ *
+ * environ already holds these values, so setenv() is not called.
+ */
+void vars_init() {
+    char **e;
+    char *eq;
+
+    for (e = environ; *e; ++e) {
+        if ((eq = strchr(*e, '=')) != NULL && var_name_valid(*e, eq - *e))
+            store(*e, eq - *e, eq + 1, 1);
+    }
+}
+
+/**
+ * @brief free all variables.
+ */
+void vars_free() {
+    size_t i;
+    for (i = 0; i < table_size; ++i) {
+        free(table[i].text);
+    }
+    free(table);
+    free(envp);
+    table = NULL;
+    envp = NULL;
+    table_size = table_used = envp_cap = 0;
+    envp_valid = 0;
+}
+
+/**
+ * @brief check if a word is an assignment.
+ * @param word the word.
+ * @returns True if it is NAME=value with a valid name.
+ */
+int is_assignment(const char *word) {
+    const char *eq = strchr(word, '=');
+    return eq != NULL && var_name_valid(word, eq - word);
+}
+
+/**
+ * @brief run an assignment.
+ * @param word NAME=value.
+ * @param export True to export the variable.
+ */
+void assign(const char *word, int export) {
+    const char *eq = strchr(word, '=');
+    var_set(word, eq - word, eq + 1, export);
+}
+
+/**
+ * @brief compare two entries for qsort().
+ * @param a pointer to the first entry.
+ * @param b pointer to the second entry.
+ * @returns like strcmp() on the "NAME=value" strings.
+ */
+static int compare_entries(const void *a, const void *b) {
+    return strcmp((*(var_entry *const *)a)->text, (*(var_entry *const *)b)->text);
+}
+
+/**
+ * @brief the export builtin.
+ * @param argc argument count.
+ * @param argv 'export' lists the exported variables, 'export NAME[=value]...' exports them.
+ */
+void export_builtin(int argc, char **argv) {
+    var_entry **sorted;
+    const char *value;
+    size_t i, n = 0;
+    int a;
+
+    if (argc == 1) {
+        sorted = arena_alloc(&line_arena, (table_used + 1) * sizeof(var_entry *));
+        for (i = 0; i < table_size; ++i) {
+            if (table[i].text && table[i].exported)
+                sorted[n++] = &table[i];
+        }
+        qsort(sorted, n, sizeof(var_entry *), compare_entries);
+        for (i = 0; i < n; ++i) {
+            printf("export %.*s=\"%s\"\n", (int)sorted[i]->name_len, sorted[i]->text,
+                   sorted[i]->text + sorted[i]->name_len + 1);
+        }
+        return;
+    }
+    for (a = 1; a < argc; ++a) {
+        if (is_assignment(argv[a])) {
+            assign(argv[a], 1);
+        } else if (var_name_valid(argv[a], strlen(argv[a]))) {
+            /* a variable that is not set is exported empty. The value is copied before it is freed */
+            value = var_get(argv[a]);
+            var_set(argv[a], strlen(argv[a]), value ? value : "", 1);
+        } else {
+            fprintf(stderr, "%s: '%s': not a valid name\n", argv[0], argv[a]);
+            last_status = W_EXITCODE(EXIT_FAILURE, 0);
+        }
+    }
+}
+
+/**
+ * @brief the unset builtin.
+ * @param argc argument count.
+ * @param argv 'unset NAME...'.
+ */
+void unset_builtin(int argc, char **argv) {
+    int a;
+    for (a = 1; a < argc; ++a) {
+        var_unset(argv[a]);
+    }
+}